@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include "libggyl.h"
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * End to end benchmark of ggyl (make bench).
+ *
+ * A churn thread creates, modifies, deletes and renames files at a given rate
+ * in a tree of a given fan-out and depth, while the main thread runs a
+ * watcher over the tree. Every file has a slot holding the time of its
+ * earliest change that hasn't been delivered yet, taken right before the
+ * syscall, and the batch callback turns that into the write to dispatch
+ * latency. Files whose changes never arrive are missed. The results are
+ * written as a line of JSON.
+ */
+
+#define BENCH_CREATE 0
+#define BENCH_MODIFY 1
+#define BENCH_DELETE 2
+#define BENCH_RENAME 3
+
+// A file the churn thread works on
+typedef struct {
+    _Atomic uint64_t pending; // Time of the earliest undelivered change, or 0
+    int leaf;                 // Directory the file is in
+    int exists;
+} bench_file;
+
+// Configuration and results of a run
+typedef struct {
+    char root[4096];
+    int fanout;
+    int depth;
+    int num_files;
+    int rate;        // Operations per second, 0 for as fast as possible
+    double duration; // Seconds of churn
+    double churn_seconds;
+    int debounce_ms;
+    int mix[4]; // Weights of create, modify, delete and rename
+    const char *out;
+
+    int num_leaves;
+    bench_file *files;
+    unsigned seed;
+    _Atomic int churning;
+    uint64_t ops[4];
+    uint64_t num_ops;
+    uint64_t *latencies; // Nanoseconds, one per delivered change
+    size_t num_latencies;
+    size_t latency_capacity;
+    uint64_t changes;   // Changes delivered
+    uint64_t unmatched; // Changes without an undelivered write
+    uint64_t batches;
+} bench_t;
+
+// Get the monotonic time in nanoseconds
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Print usage and exit
+static void usage() {
+    fprintf(stderr, "Usage: bench [--fanout N] [--depth N] [--files N] "
+                    "[--rate ops/s] [--duration s]\n"
+                    "             [--debounce ms] [--mix c:m:d:r] "
+                    "[--dir path] [--out file]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --fanout N    Subdirectories per directory, defaults "
+                    "to 4\n");
+    fprintf(stderr, "  --depth N     Levels of subdirectories, defaults to "
+                    "3\n");
+    fprintf(stderr, "  --files N     Files churned, defaults to 4096\n");
+    fprintf(stderr, "  --rate N      Operations per second, 0 for as fast as "
+                    "possible, defaults\n"
+                    "                to 20000\n");
+    fprintf(stderr, "  --duration s  Seconds of churn, defaults to 5\n");
+    fprintf(stderr, "  --debounce ms  Debounce of the watcher, defaults to "
+                    "0\n");
+    fprintf(stderr, "  --mix c:m:d:r  Weights of creates, modifies, deletes "
+                    "and renames,\n"
+                    "                 defaults to 1:4:1:1\n");
+    fprintf(stderr, "  --dir path    Where the tree is made, defaults to a "
+                    "new directory in /tmp\n");
+    fprintf(stderr, "  --out file    Write the results to file instead of "
+                    "stdout\n");
+    exit(EXIT_FAILURE);
+}
+
+/* -------------------------------- Tree ---------------------------------- */
+
+// Build the path of a leaf directory, leaves are numbered in base fanout
+static int leaf_path(bench_t *bench, int leaf, char *buf, size_t size) {
+    int len = snprintf(buf, size, "%s", bench->root);
+    for (int d = 0; d < bench->depth; d++) {
+        len += snprintf(buf + len, size - len, "/d%d", leaf % bench->fanout);
+        leaf /= bench->fanout;
+    }
+    return len;
+}
+
+// Build the path of a file
+static void file_path(bench_t *bench, int i, int leaf, char *buf,
+                      size_t size) {
+    int len = leaf_path(bench, leaf, buf, size);
+    snprintf(buf + len, size - len, "/f%d", i);
+}
+
+// Make every directory of the tree
+static void make_tree(bench_t *bench) {
+    char path[4096];
+    for (int leaf = 0; leaf < bench->num_leaves; leaf++) {
+        int len = leaf_path(bench, leaf, path, sizeof(path));
+        for (int i = strlen(bench->root) + 1; i <= len; i++) {
+            if (path[i] == '/' || path[i] == '\0') {
+                char c = path[i];
+                path[i] = '\0';
+                if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+                    perror(path);
+                    exit(EXIT_FAILURE);
+                }
+                path[i] = c;
+            }
+        }
+    }
+}
+
+// Remove a file or directory of the tree for nftw
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+/* -------------------------------- Churn --------------------------------- */
+
+// Pick an operation by the weights of the mix
+static int pick_op(bench_t *bench) {
+    int r = rand_r(&bench->seed) %
+            (bench->mix[0] + bench->mix[1] + bench->mix[2] + bench->mix[3]);
+    int op = 0;
+    while (r >= bench->mix[op]) {
+        r -= bench->mix[op++];
+    }
+    return op;
+}
+
+// Pick a random file that exists, or one that doesn't for creates
+// Returns the index of the file, -1 if none was found
+static int pick_file(bench_t *bench, int op) {
+    for (int tries = 0; tries < 64; tries++) {
+        int i = rand_r(&bench->seed) % bench->num_files;
+        if (bench->files[i].exists == (op != BENCH_CREATE)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Mark a change of a file, unless an earlier one is still undelivered
+static void mark_pending(bench_file *file) {
+    uint64_t expected = 0;
+    atomic_compare_exchange_strong(&file->pending, &expected, now_ns());
+}
+
+// Run one operation of the mix
+static void churn_once(bench_t *bench) {
+    int op = pick_op(bench);
+    if (op == BENCH_RENAME && bench->num_leaves == 1) {
+        op = BENCH_MODIFY;
+    }
+    int i = pick_file(bench, op);
+    if (i < 0) {
+        // Everything exists, or nothing does
+        op = op == BENCH_CREATE ? BENCH_MODIFY : BENCH_CREATE;
+        i = pick_file(bench, op);
+        if (i < 0) {
+            return;
+        }
+    }
+
+    bench_file *file = &bench->files[i];
+    char path[4096], to[4096];
+    file_path(bench, i, file->leaf, path, sizeof(path));
+    mark_pending(file);
+    if (op == BENCH_CREATE || op == BENCH_MODIFY) {
+        FILE *f = fopen(path, "a");
+        if (f != NULL) {
+            fputs("churn\n", f);
+            fclose(f);
+        }
+        file->exists = 1;
+    } else if (op == BENCH_DELETE) {
+        unlink(path);
+        file->exists = 0;
+    } else {
+        // Renames always move the file to another directory, renaming it to
+        // itself would be no change at all
+        int leaf = (file->leaf + 1 +
+                    rand_r(&bench->seed) % (bench->num_leaves - 1)) %
+                   bench->num_leaves;
+        file_path(bench, i, leaf, to, sizeof(to));
+        if (rename(path, to) == 0) {
+            file->leaf = leaf;
+        }
+    }
+    bench->ops[op]++;
+    bench->num_ops++;
+}
+
+// Churn random files at the configured rate for the configured time
+static void *run_churn(void *arg) {
+    bench_t *bench = (bench_t *)arg;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(bench->duration * 1e9);
+    uint64_t interval = bench->rate > 0 ? 1000000000ULL / bench->rate : 0;
+    uint64_t next = start;
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end) {
+            break;
+        }
+
+        // Operations are scheduled, so a slow one doesn't lower the rate
+        if (interval > 0 && now < next) {
+            struct timespec ts = {(next - now) / 1000000000,
+                                  (next - now) % 1000000000};
+            nanosleep(&ts, NULL);
+        }
+        next += interval;
+        churn_once(bench);
+    }
+    bench->churn_seconds = (now_ns() - start) / 1e9;
+    atomic_store(&bench->churning, 0);
+    return NULL;
+}
+
+/* ------------------------------- Watching ------------------------------- */
+
+// Find the file a changed path belongs to
+// Returns the index of the file, -1 for directories and anything else
+static int file_of_path(bench_t *bench, const char *path) {
+    const char *name = strrchr(path, '/');
+    if (name == NULL || name[1] != 'f') {
+        return -1;
+    }
+    char *end;
+    long i = strtol(name + 2, &end, 10);
+    return *end == '\0' && i >= 0 && i < bench->num_files ? (int)i : -1;
+}
+
+// Record the latency of every file in the batch
+static void on_batch(ggyl_watcher *watcher, const ggyl_batch *batch,
+                     void *arg) {
+    (void)watcher;
+    bench_t *bench = (bench_t *)arg;
+    uint64_t now = now_ns();
+    bench->batches++;
+    for (size_t c = 0; c < batch->count; c++) {
+        int i = file_of_path(bench, batch->changes[c].path);
+        if (i < 0) {
+            continue;
+        }
+        bench->changes++;
+        uint64_t written = atomic_exchange(&bench->files[i].pending, 0);
+        if (written == 0) {
+            // A rename shows up twice, or a change was delivered in pieces
+            bench->unmatched++;
+            continue;
+        }
+        if (bench->num_latencies == bench->latency_capacity) {
+            bench->latency_capacity = bench->latency_capacity * 2 + 65536;
+            bench->latencies = (uint64_t *)realloc(
+                bench->latencies, bench->latency_capacity * sizeof(uint64_t));
+        }
+        bench->latencies[bench->num_latencies++] = now - written;
+    }
+}
+
+// Compare latencies for qsort
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Get a percentile of the sorted latencies in microseconds
+static double percentile(bench_t *bench, double p) {
+    if (bench->num_latencies == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p / 100 * (bench->num_latencies - 1) + 0.5);
+    return bench->latencies[i] / 1000.0;
+}
+
+// Check if every change has been delivered
+static int all_delivered(bench_t *bench) {
+    for (int i = 0; i < bench->num_files; i++) {
+        if (atomic_load(&bench->files[i].pending) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Count the files whose changes never arrived
+static uint64_t count_missed(bench_t *bench) {
+    uint64_t missed = 0;
+    for (int i = 0; i < bench->num_files; i++) {
+        missed += atomic_load(&bench->files[i].pending) != 0;
+    }
+    return missed;
+}
+
+// Write the results as a line of JSON
+static void write_results(bench_t *bench, FILE *out, double seconds,
+                          double cpu_seconds) {
+    qsort(bench->latencies, bench->num_latencies, sizeof(uint64_t),
+          compare_latency);
+    fprintf(out,
+            "{\"bench\":\"churn\",\"fanout\":%d,\"depth\":%d,\"dirs\":%d,"
+            "\"files\":%d,\"rate\":%d,\"debounce_ms\":%d,"
+            "\"mix\":[%d,%d,%d,%d],",
+            bench->fanout, bench->depth, bench->num_leaves, bench->num_files,
+            bench->rate, bench->debounce_ms, bench->mix[0], bench->mix[1],
+            bench->mix[2], bench->mix[3]);
+    fprintf(out,
+            "\"ops\":%llu,\"creates\":%llu,\"modifies\":%llu,"
+            "\"deletes\":%llu,\"renames\":%llu,\"seconds\":%.3f,"
+            "\"ops_per_s\":%.0f,",
+            (unsigned long long)bench->num_ops,
+            (unsigned long long)bench->ops[BENCH_CREATE],
+            (unsigned long long)bench->ops[BENCH_MODIFY],
+            (unsigned long long)bench->ops[BENCH_DELETE],
+            (unsigned long long)bench->ops[BENCH_RENAME], seconds,
+            bench->num_ops / bench->churn_seconds);
+    fprintf(out,
+            "\"batches\":%llu,\"changes\":%llu,\"changes_per_s\":%.0f,"
+            "\"unmatched\":%llu,\"missed\":%llu,",
+            (unsigned long long)bench->batches,
+            (unsigned long long)bench->changes, bench->changes / seconds,
+            (unsigned long long)bench->unmatched,
+            (unsigned long long)count_missed(bench));
+    fprintf(out,
+            "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+            "\"p999\":%.1f,\"max\":%.1f},\"cpu_us_per_op\":%.3f}\n",
+            percentile(bench, 50), percentile(bench, 90),
+            percentile(bench, 99), percentile(bench, 99.9),
+            percentile(bench, 100),
+            bench->num_ops ? cpu_seconds * 1e6 / bench->num_ops : 0);
+}
+
+// Benchmark entry point
+int main(int argc, char *argv[]) {
+    bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.fanout = 4;
+    bench.depth = 3;
+    bench.num_files = 4096;
+    bench.rate = 20000;
+    bench.duration = 5;
+    bench.mix[0] = 1;
+    bench.mix[1] = 4;
+    bench.mix[2] = 1;
+    bench.mix[3] = 1;
+    bench.seed = 1;
+    const char *dir = NULL;
+
+    static struct option long_options[] = {
+        {"fanout", required_argument, NULL, 'f'},
+        {"depth", required_argument, NULL, 'D'},
+        {"files", required_argument, NULL, 'n'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 't'},
+        {"debounce", required_argument, NULL, 'B'},
+        {"mix", required_argument, NULL, 'm'},
+        {"dir", required_argument, NULL, 'd'},
+        {"out", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                bench.fanout = atoi(optarg);
+                break;
+            case 'D':
+                bench.depth = atoi(optarg);
+                break;
+            case 'n':
+                bench.num_files = atoi(optarg);
+                break;
+            case 'r':
+                bench.rate = atoi(optarg);
+                break;
+            case 't':
+                bench.duration = atof(optarg);
+                break;
+            case 'B':
+                bench.debounce_ms = atoi(optarg);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d:%d", &bench.mix[0],
+                           &bench.mix[1], &bench.mix[2], &bench.mix[3]) != 4) {
+                    usage();
+                }
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'o':
+                bench.out = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (bench.fanout < 1 || bench.depth < 0 || bench.num_files < 1 ||
+        bench.rate < 0 || bench.duration <= 0 || bench.debounce_ms < 0 ||
+        bench.mix[0] + bench.mix[1] + bench.mix[2] + bench.mix[3] <= 0) {
+        usage();
+    }
+
+    // Make the tree before watching it, so only the churn is measured
+    if (dir != NULL) {
+        snprintf(bench.root, sizeof(bench.root), "%s/ggyl_bench", dir);
+        if (mkdir(bench.root, 0755) != 0) {
+            perror(bench.root);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        strcpy(bench.root, "/tmp/ggyl_bench.XXXXXX");
+        if (mkdtemp(bench.root) == NULL) {
+            perror("mkdtemp");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench.num_leaves = 1;
+    for (int d = 0; d < bench.depth; d++) {
+        bench.num_leaves *= bench.fanout;
+    }
+    make_tree(&bench);
+    bench.files = (bench_file *)calloc(bench.num_files, sizeof(bench_file));
+    for (int i = 0; i < bench.num_files; i++) {
+        bench.files[i].leaf = i % bench.num_leaves;
+    }
+
+    ggyl_options options;
+    ggyl_options_init(&options);
+    options.dir = bench.root;
+    options.debounce_ms = bench.debounce_ms;
+    ggyl_watcher *watcher = ggyl_new(&options, on_batch, &bench);
+    if (watcher == NULL || ggyl_start(watcher) != 0) {
+        perror("ggyl");
+        exit(EXIT_FAILURE);
+    }
+
+    // The watcher runs on this thread, so its CPU time is the thread's
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    uint64_t start = now_ns();
+    atomic_store(&bench.churning, 1);
+    pthread_t churn;
+    pthread_create(&churn, NULL, run_churn, &bench);
+
+    // Keep delivering until the churn is done and everything arrived, or
+    // until what's left is given up on as missed
+    uint64_t drain_end = 0;
+    while (1) {
+        ggyl_poll(watcher, 10);
+        if (atomic_load(&bench.churning)) {
+            continue;
+        }
+        uint64_t now = now_ns();
+        if (drain_end == 0) {
+            drain_end = now + 2000000000ULL + bench.debounce_ms * 1000000ULL;
+        }
+        if (all_delivered(&bench) || now >= drain_end) {
+            break;
+        }
+    }
+    pthread_join(churn, NULL);
+    double seconds = (now_ns() - start) / 1e9;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    double cpu_seconds = (cpu_end.tv_sec - cpu_start.tv_sec) +
+                         (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+
+    FILE *out = stdout;
+    if (bench.out != NULL) {
+        out = fopen(bench.out, "a");
+        if (out == NULL) {
+            perror(bench.out);
+            exit(EXIT_FAILURE);
+        }
+    }
+    write_results(&bench, out, seconds, cpu_seconds);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    ggyl_free(watcher);
+    nftw(bench.root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    free(bench.files);
+    free(bench.latencies);
+    return 0;
+}
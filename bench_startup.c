@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+#include "libggyl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <linux/magic.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Startup benchmark of ggyl on large trees (make bench-startup).
+ *
+ * Wide and deep trees of up to millions of directories are made in /dev/shm
+ * unless --root says otherwise, and a watcher is started over them with every
+ * crawl strategy: watching everything, watching lazily, and starting from a
+ * snapshot. Each start runs in a child of its own, so its peak RSS is its
+ * own, and the syscalls of the start are counted by tracing one more child.
+ * Every start is measured RUNS times and the median time is reported.
+ * The peak RSS is taken when the start ends, saving the snapshot for the next
+ * start when the watcher is freed isn't part of it.
+ * Cold starts drop the dentry, inode and page caches first when that is
+ * allowed, which only makes a start cold when the tree is on a disk, so they
+ * are skipped for trees in memory.
+ *
+ * Results are lines of JSON, and are compared against a baseline of the same
+ * lines kept in the tree. Only starts over trees of the same size compare,
+ * since fixed costs weigh more on small trees.
+ */
+
+#define NUM_STRATEGIES 3
+#define STRATEGY_EAGER 0
+#define STRATEGY_LAZY 1
+#define STRATEGY_SNAPSHOT 2
+
+static const char *strategy_names[NUM_STRATEGIES] = {"eager", "lazy",
+                                                     "snapshot"};
+
+// Allowed growth of each number over the baseline before it is a regression
+#define SLACK_TIME 1.25
+#define SLACK_SYSCALLS 1.05
+#define SLACK_BYTES 1.05
+#define SLACK_RSS 1.10
+
+// Growth too small to tell from noise on starts that take almost nothing
+#define NOISE_MS 5
+#define NOISE_RSS_KB 1024
+
+// Starts measured of every strategy, the median time is reported
+#define RUNS 5
+
+// Shape of a synthetic tree
+typedef struct {
+    const char *name;
+    int fanout; // Subdirectories of every directory
+} tree_shape;
+
+static const tree_shape shapes[] = {{"wide", 64}, {"deep", 2}};
+
+// What a start measured, sent from the child that ran it
+typedef struct {
+    double start_ms;
+    int watched;
+    size_t bytes;
+    long rss_kb; // Peak RSS at the end of the start
+} start_result;
+
+// One line of results
+typedef struct {
+    const char *shape;
+    const char *strategy;
+    const char *cache;
+    int dirs;
+    int watched;
+    double start_ms;
+    double us_per_dir;
+    double syscalls_per_dir;
+    double bytes_per_watch;
+    long rss_kb;
+    double rss_kb_per_dir;
+} startup_result;
+
+// Configuration of the benchmark
+typedef struct {
+    int dirs;
+    int files; // Files in every directory
+    int cold;  // Also measure with dropped caches
+    char root[4096];
+    const char *baseline;
+    int update_baseline;
+    const char *out;
+} startup_bench;
+
+// Get the monotonic time in milliseconds
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Print usage and exit
+static void usage() {
+    fprintf(stderr, "Usage: bench_startup [--dirs N] [--files N] [--cold] "
+                    "[--root path]\n"
+                    "                     [--baseline file] "
+                    "[--update-baseline] [--out file]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --dirs N      Directories in every tree, defaults to "
+                    "100000\n");
+    fprintf(stderr, "  --files N     Files in every directory, defaults to "
+                    "2\n");
+    fprintf(stderr, "  --cold        Also start with dropped caches, needs "
+                    "root and a --root\n"
+                    "                on a disk\n");
+    fprintf(stderr, "  --root path   Where the trees are made, defaults to "
+                    "/dev/shm\n");
+    fprintf(stderr, "  --baseline file  Compare against the results in file, "
+                    "exits with 1 on\n"
+                    "                   regressions\n");
+    fprintf(stderr, "  --update-baseline  Write the results to the baseline "
+                    "instead\n");
+    fprintf(stderr, "  --out file    Append the results to file instead of "
+                    "stdout\n");
+    exit(EXIT_FAILURE);
+}
+
+/* -------------------------------- Trees --------------------------------- */
+
+// Make a tree of dirs directories breadth first, every directory gets
+// fanout subdirectories until there are enough
+static void make_tree(const char *root, int fanout, int dirs, int files) {
+    if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+        perror(root);
+        exit(EXIT_FAILURE);
+    }
+
+    // Directory i has the children fanout * i + 1 ... fanout * i + fanout,
+    // so its path follows from its number
+    char path[4096];
+    for (int i = 1; i < dirs; i++) {
+        int chain[64], depth = 0;
+        for (int d = i; d > 0; d = (d - 1) / fanout) {
+            chain[depth++] = (d - 1) % fanout;
+        }
+        int len = snprintf(path, sizeof(path), "%s", root);
+        for (int c = depth - 1; c >= 0; c--) {
+            len += snprintf(path + len, sizeof(path) - len, "/d%d", chain[c]);
+        }
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        for (int f = 0; f < files; f++) {
+            snprintf(path + len, sizeof(path) - len, "/f%d.c", f);
+            int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                close(fd);
+            }
+            path[len] = '\0';
+        }
+    }
+}
+
+// Remove a file or directory of a tree for nftw
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+// Check if a path is on a filesystem kept in memory, where dropping the
+// caches can't make a start cold
+static int in_memory(const char *path) {
+    struct statfs fs;
+    return statfs(path, &fs) == 0 &&
+           (fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC);
+}
+
+// Drop the dentry and inode caches, and the page cache holding the
+// directory blocks read back from the disk
+// Returns 0 on success, -1 if that isn't allowed
+static int drop_caches() {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int ok = write(fd, "3", 1) == 1;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/* ------------------------------- Starting ------------------------------- */
+
+// Set the options of a strategy
+static void strategy_options(ggyl_options *options, const char *root,
+                             const char *snapshot, int strategy) {
+    ggyl_options_init(options);
+    options->dir = root;
+    if (strategy == STRATEGY_LAZY) {
+        options->lazy_depth = 2;
+    } else if (strategy == STRATEGY_SNAPSHOT) {
+        options->snapshot_path = snapshot;
+    }
+}
+
+// Start a watcher in this child and send what it measured, the trace
+// markers around the start tell a tracing parent what to count
+static void run_start(const ggyl_options *options, int fd, int traced) {
+    if (traced) {
+        raise(SIGSTOP);
+    }
+    double start = now_ms();
+    ggyl_watcher *watcher = ggyl_new(options, NULL, NULL);
+    if (watcher == NULL || ggyl_start(watcher) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    double end = now_ms();
+    if (traced) {
+        raise(SIGSTOP);
+    }
+
+    ggyl_stats stats;
+    ggyl_get_stats(watcher, &stats);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    start_result result = {end - start, stats.num_dirs,
+                           stats.bytes + stats.path_bytes, usage.ru_maxrss};
+    if (write(fd, &result, sizeof(result)) != sizeof(result)) {
+        _exit(EXIT_FAILURE);
+    }
+
+    // Freeing the watcher saves the snapshot for the next start
+    if (options->snapshot_path != NULL) {
+        ggyl_free(watcher);
+    }
+    _exit(0);
+}
+
+// Compare start times for qsort
+static int compare_ms(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Start a watcher in a child of its own
+// Returns 0 on success
+static int measure_start(const ggyl_options *options, start_result *result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        run_start(options, fds[1], 0);
+    }
+    close(fds[1]);
+    int ok = read(fds[0], result, sizeof(start_result)) ==
+             sizeof(start_result);
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Count the syscalls of a start by tracing a child between its markers
+// Threads the start runs, like the ones validating a snapshot, are traced as
+// they are created and their syscalls count too.
+// Returns the number of syscalls, -1 if the child can't be traced
+static long count_syscalls(const ggyl_options *options) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        run_start(options, fds[1], 1);
+    }
+    close(fds[1]);
+
+    // The first stop is the child attaching, then come the markers
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFSTOPPED(status)) {
+        close(fds[0]);
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE);
+    long syscalls = 0;
+    int markers = 0;
+    pid_t tid = pid;
+    while (1) {
+        ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+        tid = waitpid(-1, &status, __WALL);
+        if (tid < 0 || (tid == pid && !WIFSTOPPED(status))) {
+            break;
+        }
+        if (!WIFSTOPPED(status)) {
+            // A thread exited, wait for the next stop of any other
+            while ((tid = waitpid(-1, &status, __WALL)) > 0 &&
+                   tid != pid && !WIFSTOPPED(status)) {
+            }
+            if (tid < 0 || !WIFSTOPPED(status)) {
+                break;
+            }
+        }
+
+        // Every syscall stops on entry and exit, only entries count. New
+        // threads start with a SIGSTOP of their own, only the main thread
+        // raises the markers.
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (markers == 1 &&
+                ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) >
+                    0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                syscalls++;
+            }
+        } else if (sig == SIGSTOP && tid == pid && status >> 16 == 0 &&
+                   ++markers == 2) {
+            break;
+        }
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, __WALL);
+    close(fds[0]);
+
+    // Raising the marker is a syscall too
+    return markers == 2 ? syscalls - 1 : -1;
+}
+
+/* ------------------------------- Results -------------------------------- */
+
+// Write a line of results
+static void write_result(FILE *out, startup_result *r) {
+    fprintf(out,
+            "{\"bench\":\"startup\",\"shape\":\"%s\",\"strategy\":\"%s\","
+            "\"cache\":\"%s\",\"dirs\":%d,\"watched\":%d,\"start_ms\":%.1f,"
+            "\"us_per_dir\":%.3f,\"syscalls_per_dir\":%.2f,"
+            "\"bytes_per_watch\":%.1f,\"rss_kb\":%ld,"
+            "\"rss_kb_per_dir\":%.3f}\n",
+            r->shape, r->strategy, r->cache, r->dirs, r->watched,
+            r->start_ms, r->us_per_dir, r->syscalls_per_dir,
+            r->bytes_per_watch, r->rss_kb, r->rss_kb_per_dir);
+}
+
+// Get a number out of a line of results
+// Returns the number, -1 if the line doesn't have it
+static double json_number(const char *line, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    return p != NULL ? atof(p + strlen(pattern)) : -1;
+}
+
+// Compare a number against its baseline, growth below noise doesn't count
+// Returns 1 if it regressed
+static int regressed(startup_result *r, const char *key, double value,
+                     double base, double slack, double noise) {
+    if (base <= 0 || value <= base * slack || value - base <= noise) {
+        return 0;
+    }
+    fprintf(stderr, "Regression: %s %s %s %s %.3f, baseline %.3f\n",
+            r->shape, r->strategy, r->cache, key, value, base);
+    return 1;
+}
+
+// Compare a line of results against the line of the baseline for the same
+// tree and start, a start the baseline has no line for fails
+// Returns the number of regressions, 1 if there was nothing to compare to
+static int compare_baseline(const char *baseline, startup_result *r) {
+    FILE *in = fopen(baseline, "r");
+    if (in == NULL) {
+        perror(baseline);
+        return 1;
+    }
+    char key[256], line[1024];
+    snprintf(key, sizeof(key),
+             "\"shape\":\"%s\",\"strategy\":\"%s\",\"cache\":\"%s\","
+             "\"dirs\":%d,",
+             r->shape, r->strategy, r->cache, r->dirs);
+    int regressions = 0, found = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (strstr(line, key) == NULL) {
+            continue;
+        }
+        found = 1;
+        regressions +=
+            regressed(r, "us_per_dir", r->us_per_dir,
+                      json_number(line, "us_per_dir"), SLACK_TIME,
+                      NOISE_MS * 1000.0 / r->dirs) +
+            regressed(r, "syscalls_per_dir", r->syscalls_per_dir,
+                      json_number(line, "syscalls_per_dir"), SLACK_SYSCALLS,
+                      0) +
+            regressed(r, "bytes_per_watch", r->bytes_per_watch,
+                      json_number(line, "bytes_per_watch"), SLACK_BYTES, 0) +
+            regressed(r, "rss_kb_per_dir", r->rss_kb_per_dir,
+                      json_number(line, "rss_kb_per_dir"), SLACK_RSS,
+                      (double)NOISE_RSS_KB / r->dirs);
+        break;
+    }
+    fclose(in);
+    if (!found) {
+        fprintf(stderr,
+                "No baseline for %s %s %s at %d directories in %s, rewrite "
+                "it with --update-baseline\n",
+                r->shape, r->strategy, r->cache, r->dirs, baseline);
+        return 1;
+    }
+    return regressions;
+}
+
+// Benchmark entry point
+int main(int argc, char *argv[]) {
+    startup_bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.dirs = 100000;
+    bench.files = 2;
+    strcpy(bench.root, "/dev/shm");
+
+    static struct option long_options[] = {
+        {"dirs", required_argument, NULL, 'n'},
+        {"files", required_argument, NULL, 'f'},
+        {"cold", no_argument, NULL, 'c'},
+        {"root", required_argument, NULL, 'r'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"update-baseline", no_argument, NULL, 'u'},
+        {"out", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                bench.dirs = atoi(optarg);
+                break;
+            case 'f':
+                bench.files = atoi(optarg);
+                break;
+            case 'c':
+                bench.cold = 1;
+                break;
+            case 'r':
+                strncpy(bench.root, optarg, sizeof(bench.root) - 64);
+                break;
+            case 'b':
+                bench.baseline = optarg;
+                break;
+            case 'u':
+                bench.update_baseline = 1;
+                break;
+            case 'o':
+                bench.out = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (bench.dirs < 1 || bench.files < 0 ||
+        (bench.update_baseline && bench.baseline == NULL)) {
+        usage();
+    }
+
+    // Every directory takes a watch, so the tree has to fit the limit
+    FILE *limit = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+    int max_watches = 0;
+    if (limit != NULL) {
+        if (fscanf(limit, "%d", &max_watches) != 1) {
+            max_watches = 0;
+        }
+        fclose(limit);
+    }
+    if (max_watches > 0 && bench.dirs > max_watches * 9 / 10) {
+        fprintf(stderr,
+                "bench_startup: fs.inotify.max_user_watches is %d, using "
+                "%d directories instead of %d\n",
+                max_watches, max_watches * 9 / 10, bench.dirs);
+        bench.dirs = max_watches * 9 / 10;
+    }
+    if (bench.cold && in_memory(bench.root)) {
+        fprintf(stderr, "bench_startup: %s is kept in memory, skipping cold "
+                        "starts, point --root at a disk for them\n",
+                bench.root);
+        bench.cold = 0;
+    }
+    if (bench.cold && drop_caches() != 0) {
+        fprintf(stderr, "bench_startup: Can't drop the caches, "
+                        "skipping cold starts\n");
+        bench.cold = 0;
+    }
+
+    FILE *out = stdout;
+    if (bench.update_baseline) {
+        out = fopen(bench.baseline, "w");
+    } else if (bench.out != NULL) {
+        out = fopen(bench.out, "a");
+    }
+    if (out == NULL) {
+        perror(bench.update_baseline ? bench.baseline : bench.out);
+        exit(EXIT_FAILURE);
+    }
+
+    int regressions = 0;
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        char root[4096 + 64], snapshot[4096 + 64];
+        snprintf(root, sizeof(root), "%s/ggyl_startup_%s", bench.root,
+                 shapes[s].name);
+        snprintf(snapshot, sizeof(snapshot), "%s/ggyl_startup_%s.snap",
+                 bench.root, shapes[s].name);
+        fprintf(stderr, "Making a %s tree of %d directories in %s\n",
+                shapes[s].name, bench.dirs, root);
+        make_tree(root, shapes[s].fanout, bench.dirs, bench.files);
+
+        for (int strategy = 0; strategy < NUM_STRATEGIES; strategy++) {
+            ggyl_options options;
+            strategy_options(&options, root, snapshot, strategy);
+
+            // A snapshot start needs the snapshot of an earlier start
+            start_result result;
+            if (strategy == STRATEGY_SNAPSHOT) {
+                unlink(snapshot);
+                measure_start(&options, &result);
+            }
+            long syscalls = count_syscalls(&options);
+
+            for (int cold = 0; cold <= bench.cold; cold++) {
+                if (cold) {
+                    drop_caches();
+                }
+                double ms[RUNS];
+                for (int run = 0; run < RUNS; run++) {
+                    if (cold && run > 0) {
+                        drop_caches();
+                    }
+                    if (measure_start(&options, &result) != 0) {
+                        fprintf(stderr, "bench_startup: %s start failed\n",
+                                strategy_names[strategy]);
+                        exit(EXIT_FAILURE);
+                    }
+                    ms[run] = result.start_ms;
+                }
+                qsort(ms, RUNS, sizeof(double), compare_ms);
+                result.start_ms = ms[RUNS / 2];
+                startup_result r;
+                r.shape = shapes[s].name;
+                r.strategy = strategy_names[strategy];
+                r.cache = cold ? "cold" : "warm";
+                r.dirs = bench.dirs;
+                r.watched = result.watched;
+                r.start_ms = result.start_ms;
+                r.us_per_dir = result.start_ms * 1000 / bench.dirs;
+                r.syscalls_per_dir =
+                    syscalls >= 0 ? (double)syscalls / bench.dirs : -1;
+                r.bytes_per_watch = (double)result.bytes / result.watched;
+                r.rss_kb = result.rss_kb;
+                r.rss_kb_per_dir = (double)result.rss_kb / bench.dirs;
+                write_result(out, &r);
+                fflush(out);
+                if (bench.baseline != NULL && !bench.update_baseline) {
+                    regressions += compare_baseline(bench.baseline, &r);
+                }
+            }
+        }
+
+        nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+        unlink(snapshot);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (regressions > 0) {
+        fprintf(stderr, "bench_startup: %d regressions against %s\n",
+                regressions, bench.baseline);
+        return 1;
+    }
+    return 0;
+}
@@ -1,21 +1,363 @@
+#define _GNU_SOURCE
 #include "ggyl.h"
+#include "ggyl_plugin.h"
+#include "ggyl_probes.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
-#include <sys/inotify.h>
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
-monitor_t monitor = {-1,
-                     ".",
-                     "",
-                     NULL,
-                     0,
-                     NULL,
-                     IN_MODIFY | IN_CREATE | IN_DELETE | IN_ISDIR |
-                         IN_MOVED_FROM};
+extern char **environ;
+
+/*
+ * The ggyl command, a thin layer over libggyl. The watcher calls back with
+ * every batch, which runs the command, is written to the stream or is handed
+ * to the plugin. Clients of a running ggyl (query, since, subscribe) only
+ * talk to its socket.
+ */
+
+/* ----------------------- Command Line Definitions ----------------------- */
+
+#define STREAM_NONE 0
+#define STREAM_JSON 1   // A line of JSON per batch
+#define STREAM_BINARY 2 // A stream_frame per batch
+#define STREAM_MAGIC "GGYLSTRM"
+#define STREAM_VERSION 1
+
+// Start of a binary stream, everything is in host byte order
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+} stream_start;
+
+// Frame of a batch in a binary stream, followed by count changes
+typedef struct {
+    uint32_t size; // Bytes in the frame after this field
+    uint32_t count;
+    uint64_t clock;
+} stream_frame;
+
+// Change in a frame, followed by len bytes of path without a terminator. The
+// next change starts right after the path, so changes aren't aligned.
+typedef struct {
+    uint32_t kind;
+    uint32_t len;
+} stream_change;
+
+// A batch copied for the plugin thread, the changes and their paths follow it
+// in the same allocation
+typedef struct plugin_batch {
+    struct plugin_batch *next;
+    ggyl_batch batch;
+} plugin_batch;
+
+// A plugin loaded with --plugin and the thread that calls it
+typedef struct {
+    char path[MAX_LEN];
+    void *handle; // NULL while the plugin fails to load
+    ggyl_plugin_fn entry;
+    ggyl_plugin_unload_fn unload;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    plugin_batch *head; // Batches waiting for the plugin, oldest first
+    plugin_batch *tail;
+    int wake_fd;    // eventfd, written when a batch is queued
+    int inotify_fd; // Watches the directory of the plugin for rebuilds
+    int stopping;   // The thread returns once the queue is empty
+} plugin_host;
+
+// A path as batches name them, with flags of what the path is to the set
+typedef struct {
+    char *path; // NULL for an empty slot
+    int flags;
+    uint64_t stamp; // Free for the owner of the set, 0 in new entries
+    uint64_t hash;
+} path_set_entry;
+
+// Paths of the command line side, hashed with open addressing
+typedef struct {
+    path_set_entry *entries;
+    size_t count;
+    size_t num_slots; // A power of 2, at least twice the count
+} path_set;
+
+// Takes a file walk_tree() found, with the length of its path and its name
+typedef void (*walk_fn)(void *arg, const char *path, int len,
+                        const char *name);
+
+#define SELF_SLACK_NS 20000000 // File times lag the clock by up to a tick
+#define SELF_RUNS 3            // Self-triggered runs in a row by default
+#define SELF_OURS 1            // fanotify saw cmd write the path
+#define SELF_THEIRS 2          // fanotify saw another process write it
+
+// Who is_self_write() puts a change down to
+#define WRITER_OTHER 0 // Changed outside the window or by another process
+#define WRITER_RUN 1   // Changed while cmd ran, but nothing ties it to cmd
+#define WRITER_CMD 2   // Written by cmd
+
+// What the last run of cmd wrote, so the batch it causes doesn't run cmd
+// again. Writes are told apart by process with fanotify, and else by time
+// and by what earlier runs wrote.
+typedef struct {
+    int max_runs;            // Self-triggered runs in a row before waiting
+    int runs;                // Self-triggered runs in a row so far
+    int ran;                 // cmd ran, so there is a window
+    int fresh;               // No batch was delivered since cmd ran
+    struct timespec started; // The window of the last run, in wall clock
+    struct timespec exited;  // time like file times
+    ggyl_change *changes;    // The batch minus what the last run wrote
+    size_t capacity;
+    const char *dir;         // The watched directory as paths start with it
+    char root[MAX_LEN];      // The watched directory resolved
+    int fan_fd;              // fanotify, -1 when it isn't permitted
+    pthread_t thread;        // Reads fan_fd
+    pthread_mutex_t lock;    // Guards pid, starting and the writes
+    pthread_cond_t spawned;  // pid is known
+    pid_t pid;               // Of the last run of cmd
+    int starting;            // cmd is being spawned, its pid isn't known
+    path_set writes; // Paths fanotify saw written, SELF_OURS | SELF_THEIRS
+    path_set outputs; // Paths changed while earlier runs ran, SELF_OURS until
+                      // they change outside a run
+} self_tracker;
+
+#define TRACE_LIB "libggyl_trace.so" // Looked for next to ggyl
+#define TRACE_INPUT 1                // cmd read the file
+#define TRACE_DIR 2                  // An input is in the directory
+#define TRACE_NEW 4                  // The last run was the first to read it
+
+// The files cmd read in any run so far, as libggyl_trace.so traced them,
+// which are then the only ones that run it and the only ones watched. A run
+// with nothing to do reads less than one that does, so inputs are only
+// dropped when they are deleted.
+typedef struct {
+    char path[MAX_LEN]; // The trace the shim appends to
+    int fd;
+    char env_preload[2 * MAX_LEN]; // LD_PRELOAD=... of cmd
+    char env_trace[MAX_LEN + 16];  // GGYL_TRACE=... of cmd
+    const char *dir;    // The watched directory as paths start with it
+    char root[MAX_LEN]; // The watched directory resolved
+    pthread_mutex_t lock; // Guards everything below
+    path_set inputs;      // TRACE_INPUT files and TRACE_DIR directories
+    path_set next;        // The trace being read
+    size_t num_dirs;      // TRACE_DIR entries of inputs
+    size_t num_files;     // TRACE_INPUT entries of inputs
+    int traced;           // cmd read something in the tree that is still there
+    int narrowed;         // The watches follow the directories of inputs
+    ggyl_change *changes; // The batch minus what cmd didn't read
+    size_t capacity;
+} input_tracer;
+
+#define FINGERPRINT_RESULTS 256 // Results kept in the cache file
+#define HASH_CHUNK 65536        // Bytes hashed per read
+
+// How cmd ended for a fingerprint of its inputs
+typedef struct {
+    uint64_t fingerprint;
+    int status; // Exit status, -1 if it didn't exit
+} fingerprint_result;
+
+// Content hashes of the inputs of cmd, the files the patterns match or the
+// ones it read with --trace, and what cmd did for each fingerprint of them
+typedef struct {
+    char path[MAX_LEN]; // The cache file
+    uint64_t rule;      // Hash of the directory, cmd and patterns
+    const char *dir;
+    int max_depth;
+    const char *const *patterns;
+    int num_patterns;
+    path_set files;   // stamp is of the stat, hash of the path and contents
+    uint64_t sum;     // Of the hashes of every file, without --trace
+    uint64_t pending; // Fingerprint of the running cmd, 0 for none
+    struct timespec started; // When cmd was spawned, in wall clock time
+    fingerprint_result results[FINGERPRINT_RESULTS]; // Oldest first
+    int num_results;
+} fingerprint_cache;
+
+#define NO_NODE UINT32_MAX
+#define INCLUDE_UNIT 1   // A translation unit, .c .cc .cpp .cxx
+#define INCLUDE_HEADER 2 // .h .hh .hpp .hxx .inc
+#define INCLUDE_DEPS 3   // A .d file the compiler wrote
+
+// A file of the include graph, known from the tree or from being included
+typedef struct {
+    char *path;          // Normalized, relative to where ggyl runs
+    int kind;            // INCLUDE_*
+    int present;         // The file was seen on disk last time it was looked
+    uint32_t *edges;     // What the file includes, or for a .d file what
+    uint32_t num_edges;  // its translation unit depends on
+    uint32_t unit;       // The translation unit of a .d file, else NO_NODE
+    uint32_t *includers; // Reverse edges, an entry per edge
+    uint32_t num_includers;
+    uint32_t includers_capacity;
+    uint32_t next_same_name; // Next node with the same file name
+    uint32_t walk;           // Last walk that reached the node
+} include_node;
+
+// Which files include which, from #include lines and .d files, kept up to
+// date with the batches to tell which translation units a change affects
+typedef struct {
+    const char *dir;
+    int max_depth;
+    char cwd[MAX_LEN];
+    include_node *nodes;
+    uint32_t num_nodes;
+    uint32_t capacity;
+    size_t num_edges;
+    path_set paths;   // stamp is the node + 1
+    path_set names;   // File names, stamp is the first node + 1 of the name
+    uint32_t walk;    // Walks so far
+    uint32_t *queue;  // Nodes to look at, of a walk or a scan
+    size_t queue_capacity;
+    size_t num_queued; // Nodes queued by the scan going on
+    uint32_t *found;  // Edges of the file being parsed
+    size_t found_capacity;
+    char *text;       // Contents of the file being parsed
+    size_t text_capacity;
+    char *env_affected; // GGYL_AFFECTED=... of the last batch
+    size_t env_affected_capacity;
+} include_graph;
+
+// The thread that runs cmd with --threads. The watcher is held while the
+// command runs, so it keeps reading and coalescing meanwhile.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int pending;           // The environment of cmd holds a batch to run
+    uint64_t delivered_ns; // When the pending batch was delivered
+    int stopping;          // The thread returns instead of waiting
+} dispatcher_t;
+
+// State of the ggyl command around its watcher
+typedef struct {
+    ggyl_watcher *watcher;
+    char cmd[MAX_LEN]; // Runs for every batch, unless streamed or a plugin
+    int stream;        // STREAM_*, batches are written instead of running cmd
+    int stream_fd;     // The real stdout, stdout itself points at stderr
+    int stream_started;
+    char *stream_buf; // Encoded batch, reused between batches
+    size_t stream_size;
+    size_t stream_capacity;
+    plugin_host *plugin; // Called instead of running cmd, or NULL
+    dispatcher_t *dispatcher; // Runs cmd off the polling thread, or NULL
+    self_tracker *self; // Keeps cmd from triggering itself, or NULL
+    input_tracer *tracer; // Only runs cmd for what it read, or NULL
+    fingerprint_cache *fingerprints; // Skips runs done before, or NULL
+    include_graph *includes; // Passes the affected units to cmd, or NULL
+    volatile sig_atomic_t print_latency; // Set by SIGUSR1
+    volatile sig_atomic_t stop_signal;   // Set by SIGINT and SIGTERM
+    char *env_paths; // GGYL_PATHS=... of the last batch
+    size_t env_paths_capacity;
+    char env_clock[96]; // GGYL_CLOCK=... of the last batch
+    char **env;         // Environment of cmd, reused between batches
+    size_t env_capacity;
+} cli_t;
+
+cli_t cli = {NULL, "", STREAM_NONE, -1};
+
+// Check if a change is an overflow, which may have hidden a change to
+// anything in the tree
+static int is_overflow(const ggyl_change *change) {
+    return change->kind == GGYL_OVERFLOW;
+}
 
 // Print usage and exit
-void usage() {
-    fprintf(stderr, "Usage: ggyl [-d directory] cmd [regex_patterns]\n");
+static void usage() {
+    fprintf(stderr, "Usage: ggyl [-d directory] [--depth N] [--lazy K] "
+                    "[--snapshot file] [--socket path]\n"
+                    "            [--debounce ms] [--journal N] [--shm file] "
+                    "cmd [regex_patterns]\n"
+                    "       ggyl --stream json|bin [options] "
+                    "[regex_patterns]\n"
+                    "       ggyl --plugin lib.so [options] "
+                    "[regex_patterns]\n"
+                    "       ggyl --daemon [--socket path] [--shm file] "
+                    "[options]\n"
+                    "       ggyl --replay file [--replay-fast] [options] "
+                    "cmd [regex_patterns]\n"
+                    "       ggyl subscribe [-s socket] [--debounce ms] cmd "
+                    "[regex_patterns]\n"
+                    "       ggyl query [-s socket] [-l] pattern...\n"
+                    "       ggyl since [-s socket] clock\n"
+                    "       ggyl metrics [-s socket]\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -d directory  Directory to monitor\n");
+    fprintf(stderr, "  --depth N     Only watch N levels below the "
+                    "directory\n");
+    fprintf(stderr, "  --lazy K      Watch K levels eagerly, deeper "
+                    "directories are watched\n"
+                    "                once activity is seen in their parent\n");
+    fprintf(stderr, "  --snapshot file  Save the watched tree to file on exit "
+                    "and reuse it\n"
+                    "                   on start to only crawl what changed\n");
+    fprintf(stderr, "  --socket path  Answer \"ggyl query\" from the watched "
+                    "tree on path\n");
+    fprintf(stderr, "  --daemon      Run no command, only serve the clients "
+                    "of the socket\n");
+    fprintf(stderr, "  --debounce ms  Quiet time before cmd runs, defaults to "
+                    "20\n");
+    fprintf(stderr, "  --journal N   Changes kept for \"ggyl since\", defaults "
+                    "to 65536\n");
+    fprintf(stderr, "  --stream json|bin  Write batches to stdout instead of "
+                    "running cmd\n");
+    fprintf(stderr, "  --plugin lib.so  Call lib.so on a thread of its own "
+                    "instead of running\n"
+                    "                   cmd, and reload it when it is "
+                    "rebuilt, see ggyl_plugin.h\n");
+    fprintf(stderr, "  --record file  Log every inotify event with its time "
+                    "to file\n");
+    fprintf(stderr, "  --replay file  Play a log of --record instead of "
+                    "watching the directory\n");
+    fprintf(stderr, "  --replay-fast  Play the log as fast as possible, "
+                    "batches stay the same\n");
+    fprintf(stderr, "  --latency     Time every stage from reading an event to "
+                    "cmd finishing,\n"
+                    "                printed on SIGUSR1 and on exit\n");
+    fprintf(stderr, "  --metrics file  Write counters and gauges to file "
+                    "every 10 seconds, in the\n"
+                    "                  OpenMetrics text format\n");
+    fprintf(stderr, "  --threads N   Read events on a thread of their own, "
+                    "match large reads on\n"
+                    "                N - 1 more and run cmd on another, so "
+                    "events keep being read\n"
+                    "                while it runs\n");
+    fprintf(stderr, "  --shards N    Spread the watches over N inotify "
+                    "instances, each read on a\n"
+                    "                thread of its own, for trees that "
+                    "overflow one queue\n");
+    fprintf(stderr, "  --ignore-self  Don't run cmd for the changes it "
+                    "made itself\n");
+    fprintf(stderr, "  --self-runs N  Run cmd at most N times in a row for "
+                    "changes it may have\n"
+                    "                 made itself, 3 by default, implies "
+                    "--ignore-self\n");
+    fprintf(stderr, "  --trace       Preload %s into cmd to trace the "
+                    "files it reads, and only\n"
+                    "                run it again and watch for changes to "
+                    "those\n",
+            TRACE_LIB);
+    fprintf(stderr, "  --fingerprint file  Skip runs for inputs with "
+                    "the same contents as those of\n"
+                    "                  a run that succeeded, keeping the "
+                    "results in file\n");
+    fprintf(stderr, "  --includes    Pass the C translation units a batch "
+                    "affects through the\n"
+                    "                #includes and .d files of the tree to "
+                    "cmd in GGYL_AFFECTED\n");
+    fprintf(stderr, "  --shm file    Publish every change into a shared memory "
+                    "ring in file,\n"
+                    "                see ggyl_ring.h\n");
     fprintf(stderr, "  cmd           Command to execute\n");
     fprintf(
         stderr,
@@ -23,279 +365,2461 @@ void usage() {
     exit(EXIT_FAILURE);
 }
 
-// Function to convert a glob pattern to a POSIX regex pattern
-void glob_to_regex(const char *glob, char *regex) {
-    char *p = regex;
-    *p++ = '^'; // Start-of-line anchor
-    while (*glob) {
-        switch (*glob) {
-            case '*':
-                *p++ = '.';
-                *p++ = '*';
-                break;
-            case '?':
-                *p++ = '.';
-                break;
-            case '.':
-                *p++ = '\\';
-                *p++ = '.';
-                break;
-            default:
-                *p++ = *glob;
-                break;
+// Connect to the control socket of a running ggyl
+// Returns the connected socket, -1 if nothing is listening
+static int connect_control_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send a request to a running ggyl and print the reply
+// Returns 0 if nothing is listening on the socket
+static int print_reply(const char *socket_path, const char *request) {
+    int fd = connect_control_socket(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "ggyl: Nothing listening on %s\n", socket_path);
+        return 0;
+    }
+    dprintf(fd, "%s\n", request);
+
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, n, stdout);
+    }
+    close(fd);
+    return 1;
+}
+
+// Print query usage and exit
+static void query_usage() {
+    fprintf(stderr, "Usage: ggyl query [-s socket] [-l] pattern...\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s socket  Socket of the running ggyl, defaults to "
+                    "$GGYL_SOCKET\n");
+    fprintf(stderr, "  -l         Print \"type size mtime path\" for each "
+                    "result\n");
+    fprintf(stderr, "  pattern    \"src/**/*.c\", relative to the monitored "
+                    "directory\n");
+    exit(EXIT_FAILURE);
+}
+
+// Entry point of "ggyl query", asks a running ggyl for matching paths
+static int query_main(int argc, char *argv[]) {
+    const char *socket_path = getenv("GGYL_SOCKET");
+    int long_format = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l")) != -1) {
+        switch (opt) {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'l':
+                long_format = 1;
+                break;
+            default:
+                query_usage();
+        }
+    }
+    if (optind >= argc || socket_path == NULL) {
+        query_usage();
+    }
+
+    char request[MAX_LEN];
+    for (int i = optind; i < argc; i++) {
+        snprintf(request, MAX_LEN, "%s %s",
+                 long_format ? "query-long" : "query", argv[i]);
+        if (!print_reply(socket_path, request)) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Print since usage and exit
+static void since_usage() {
+    fprintf(stderr, "Usage: ggyl since [-s socket] clock\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s socket  Socket of the running ggyl, defaults to "
+                    "$GGYL_SOCKET\n");
+    fprintf(stderr, "  clock      $GGYL_CLOCK of an earlier batch, or the "
+                    "clock of an earlier\n"
+                    "             reply\n");
+    exit(EXIT_FAILURE);
+}
+
+// Entry point of "ggyl since", prints the net changes after a clock
+// Exits with 2 when the client has to resync
+static int since_main(int argc, char *argv[]) {
+    const char *socket_path = getenv("GGYL_SOCKET");
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt != 's') {
+            since_usage();
+        }
+        socket_path = optarg;
+    }
+    if (optind + 1 != argc || socket_path == NULL) {
+        since_usage();
+    }
+
+    char request[MAX_LEN];
+    snprintf(request, MAX_LEN, "since %s", argv[optind]);
+    int fd = connect_control_socket(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "ggyl: Nothing listening on %s\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    dprintf(fd, "%s\n", request);
+
+    FILE *in = fdopen(fd, "r");
+    char line[MAX_LEN + 16];
+    int resync = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        resync |= strncmp(line, "resync ", 7) == 0;
+        fputs(line, stdout);
+    }
+    fclose(in);
+    return resync ? 2 : EXIT_SUCCESS;
+}
+
+// Print metrics usage and exit
+static void metrics_usage() {
+    fprintf(stderr, "Usage: ggyl metrics [-s socket]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s socket  Socket of the running ggyl, defaults to "
+                    "$GGYL_SOCKET\n");
+    exit(EXIT_FAILURE);
+}
+
+// Entry point of "ggyl metrics", prints the counters and gauges of a running
+// ggyl in the OpenMetrics text format
+static int metrics_main(int argc, char *argv[]) {
+    const char *socket_path = getenv("GGYL_SOCKET");
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt != 's') {
+            metrics_usage();
+        }
+        socket_path = optarg;
+    }
+    if (optind != argc || socket_path == NULL) {
+        metrics_usage();
+    }
+    return print_reply(socket_path, "metrics") ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Print subscribe usage and exit
+static void subscribe_usage() {
+    fprintf(stderr, "Usage: ggyl subscribe [-s socket] [--debounce ms] cmd "
+                    "[regex_patterns]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s socket        Socket of the ggyl daemon, defaults "
+                    "to $GGYL_SOCKET\n");
+    fprintf(stderr, "  --debounce ms    Quiet time before cmd runs, defaults "
+                    "to 20\n");
+    fprintf(stderr, "  cmd              Command to execute\n");
+    fprintf(stderr, "  regex_patterns   \"*.c\" \"*.md\" (optional)\n");
+    exit(EXIT_FAILURE);
+}
+
+// Entry point of "ggyl subscribe", runs a command for every batch of changes
+// a ggyl daemon sends
+static int subscribe_main(int argc, char *argv[]) {
+    const char *socket_path = getenv("GGYL_SOCKET");
+    int debounce_ms = 20;
+
+    static struct option long_options[] = {
+        {"debounce", required_argument, NULL, 'B'}, {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'B':
+                debounce_ms = atoi(optarg);
+                break;
+            default:
+                subscribe_usage();
+        }
+    }
+    if (optind >= argc || socket_path == NULL) {
+        subscribe_usage();
+    }
+    const char *cmd = argv[optind++];
+
+    int fd = connect_control_socket(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "ggyl: Nothing listening on %s\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    FILE *in = fdopen(fd, "r");
+    dprintf(fd, "subscribe %d", debounce_ms);
+    for (int i = optind; i < argc; i++) {
+        dprintf(fd, "\t%s", argv[i]);
+    }
+    dprintf(fd, "\n");
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len = getline(&line, &line_capacity, in);
+    if (len <= 0 || strncmp(line, "ok ", 3) != 0) {
+        fprintf(stderr, "ggyl: %s", len > 0 ? line : "No reply\n");
+        return EXIT_FAILURE;
+    }
+    printf("Subscribed to %s\n", socket_path);
+    printf("Executing %s\n", cmd);
+
+    // Collect the paths of a batch until the empty line that ends it
+    size_t size = 0, capacity = MAX_LEN;
+    char *paths = (char *)malloc(capacity);
+    paths[0] = '\0';
+    while ((len = getline(&line, &line_capacity, in)) > 0) {
+        if (strncmp(line, "clock ", 6) == 0) {
+            line[len - 1] = '\0';
+            setenv("GGYL_CLOCK", line + 6, 1);
+            continue;
+        }
+        if (len > 1) {
+            if (size + len + 1 > capacity) {
+                capacity = (size + len + 1) * 2;
+                paths = (char *)realloc(paths, capacity);
+            }
+            memcpy(paths + size, line, len + 1);
+            size += len;
+            continue;
+        }
+        if (size > 0) {
+            paths[size - 1] = '\0';
+        }
+        setenv("GGYL_PATHS", paths, 1);
+        size = 0;
+        paths[0] = '\0';
+
+        system("clear");
+        system(cmd);
+    }
+
+    fprintf(stderr, "ggyl: The daemon closed the connection\n");
+    free(paths);
+    free(line);
+    fclose(in);
+    return EXIT_FAILURE;
+}
+
+/* ---------------------------- Stream Output ----------------------------- */
+
+/*
+ * With --stream every batch is written to stdout instead of running a command.
+ * The batch is encoded into a buffer that is reused between batches and
+ * written with a single writev(). Everything else ggyl prints goes to stderr
+ * so it never ends up in the stream.
+ */
+
+// Make room for size more bytes in the stream buffer
+// Returns where the bytes go
+static char *reserve_stream(cli_t *cli, size_t size) {
+    if (cli->stream_size + size > cli->stream_capacity) {
+        while (cli->stream_size + size > cli->stream_capacity) {
+            cli->stream_capacity =
+                cli->stream_capacity ? cli->stream_capacity * 2 : 65536;
+        }
+        cli->stream_buf =
+            (char *)realloc(cli->stream_buf, cli->stream_capacity);
+    }
+    return cli->stream_buf + cli->stream_size;
+}
+
+// Append a string to the stream buffer as a JSON string
+static void append_json_string(cli_t *cli, const char *str, int len) {
+    // Every byte escapes to at most 6 bytes, plus the quotes
+    char *out = reserve_stream(cli, len * 6 + 2);
+    char *p = out;
+    *p++ = '"';
+    for (int i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    cli->stream_size += p - out;
+}
+
+// Encode a batch as a line of JSON, changes look like
+// {"path":"./a.c","kinds":["created","modified"],"dir":false}
+static void encode_json_batch(cli_t *cli, const ggyl_batch *batch) {
+    char *out = reserve_stream(cli, 128);
+    cli->stream_size +=
+        sprintf(out, "{\"clock\":\"%s\",\"changes\":[", batch->clock_str);
+    for (size_t i = 0; i < batch->count; i++) {
+        const ggyl_change *change = &batch->changes[i];
+        out = reserve_stream(cli, 16);
+        cli->stream_size += sprintf(out, "%s{\"path\":", i ? "," : "");
+        append_json_string(cli, change->path, strlen(change->path));
+
+        out = reserve_stream(cli, 64);
+        char *p = out + sprintf(out, ",\"kinds\":[");
+        const char *sep = "";
+        if (change->kind & GGYL_CREATED) {
+            p += sprintf(p, "\"created\"");
+            sep = ",";
+        }
+        if (change->kind & GGYL_MODIFIED) {
+            p += sprintf(p, "%s\"modified\"", sep);
+            sep = ",";
+        }
+        if (change->kind & GGYL_DELETED) {
+            p += sprintf(p, "%s\"deleted\"", sep);
+        }
+        p += sprintf(p, "],\"dir\":%s}",
+                     change->kind & GGYL_DIR ? "true" : "false");
+        cli->stream_size += p - out;
+    }
+    out = reserve_stream(cli, 3);
+    cli->stream_size += sprintf(out, "]}\n");
+}
+
+// Encode a batch as a binary frame, see stream_frame
+static void encode_binary_batch(cli_t *cli, const ggyl_batch *batch) {
+    size_t start = cli->stream_size;
+    reserve_stream(cli, sizeof(stream_frame));
+    cli->stream_size += sizeof(stream_frame);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        stream_change change;
+        change.kind = batch->changes[i].kind;
+        change.len = strlen(batch->changes[i].path);
+        char *out = reserve_stream(cli, sizeof(stream_change) + change.len);
+        memcpy(out, &change, sizeof(stream_change));
+        memcpy(out + sizeof(stream_change), batch->changes[i].path,
+               change.len);
+        cli->stream_size += sizeof(stream_change) + change.len;
+    }
+
+    stream_frame frame;
+    frame.size = cli->stream_size - start - sizeof(frame.size);
+    frame.count = batch->count;
+    frame.clock = batch->clock;
+    memcpy(cli->stream_buf + start, &frame, sizeof(stream_frame));
+}
+
+// Write the batch of changes to the stream
+static void stream_batch(cli_t *cli, const ggyl_batch *batch) {
+    cli->stream_size = 0;
+    if (cli->stream == STREAM_JSON) {
+        encode_json_batch(cli, batch);
+    } else {
+        encode_binary_batch(cli, batch);
+    }
+
+    // A binary stream starts with its magic
+    struct iovec iov[2];
+    int num_iov = 0;
+    stream_start start = {STREAM_MAGIC, STREAM_VERSION, 0};
+    if (cli->stream == STREAM_BINARY && !cli->stream_started) {
+        iov[num_iov++] = (struct iovec){&start, sizeof(start)};
+    }
+    iov[num_iov++] = (struct iovec){cli->stream_buf, cli->stream_size};
+    cli->stream_started = 1;
+
+    // Writes to pipes only come up short when interrupted
+    while (num_iov > 0) {
+        ssize_t n = writev(cli->stream_fd, iov, num_iov);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            // Whoever reads the stream is gone
+            raise(SIGTERM);
+            return;
+        }
+        while (num_iov > 0 && (size_t)n >= iov[0].iov_len) {
+            n -= iov[0].iov_len;
+            iov[0] = iov[1];
+            num_iov--;
+        }
+        if (num_iov > 0) {
+            iov[0].iov_base = (char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+}
+
+// Point stdout at stderr so only the stream is written to the real stdout
+static void redirect_stdout(cli_t *cli) {
+    fflush(stdout);
+    cli->stream_fd = dup(STDOUT_FILENO);
+    if (cli->stream_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("dup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Start a thread with every signal blocked, signals are left to the main
+// thread, which cleans up on exit
+// Returns 0 on success, -1 if the thread can't be created
+static int start_thread(pthread_t *thread, void *(*run)(void *), void *arg) {
+    sigset_t signals, previous;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &previous);
+    int ret = pthread_create(thread, NULL, run, arg);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+/* ------------------------------- Plugins -------------------------------- */
+
+/*
+ * With --plugin every batch is handed to a shared object instead of running a
+ * command, see ggyl_plugin.h. Batches are copied into a queue that a thread
+ * of its own drains, so the watcher keeps reading events while the plugin
+ * works. The same thread reloads the plugin when it is rebuilt, which never
+ * happens in the middle of a call.
+ */
+
+// Load the plugin and look up its entry points
+// Returns 0 on success, -1 if it can't be loaded
+static int load_plugin(plugin_host *host) {
+    host->handle = dlopen(host->path, RTLD_NOW | RTLD_LOCAL);
+    if (host->handle == NULL) {
+        fprintf(stderr, "ggyl: %s\n", dlerror());
+        return -1;
+    }
+    host->entry = (ggyl_plugin_fn)dlsym(host->handle, GGYL_PLUGIN_ENTRY);
+    if (host->entry == NULL) {
+        fprintf(stderr, "ggyl: %s has no %s, is it built against another "
+                        "ggyl_plugin.h?\n",
+                host->path, GGYL_PLUGIN_ENTRY);
+        dlclose(host->handle);
+        host->handle = NULL;
+        return -1;
+    }
+    host->unload =
+        (ggyl_plugin_unload_fn)dlsym(host->handle, GGYL_PLUGIN_UNLOAD);
+
+    // The plugin may refuse to load
+    ggyl_plugin_load_fn load =
+        (ggyl_plugin_load_fn)dlsym(host->handle, GGYL_PLUGIN_LOAD);
+    if (load != NULL && load() != 0) {
+        fprintf(stderr, "ggyl: %s refused to load\n", host->path);
+        dlclose(host->handle);
+        host->handle = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Unload the plugin so the next dlopen() maps the rebuilt file
+static void unload_plugin(plugin_host *host) {
+    if (host->handle == NULL) {
+        return;
+    }
+    if (host->unload != NULL) {
+        host->unload();
+    }
+    dlclose(host->handle);
+    host->handle = NULL;
+    host->entry = NULL;
+    host->unload = NULL;
+}
+
+// Check the events of the plugin's directory for a rebuild of the plugin
+// Returns 1 if the plugin was written or replaced
+static int plugin_rebuilt(plugin_host *host) {
+    const int buffer_size = 64 * (sizeof(struct inotify_event) + NAME_MAX + 1);
+    char buffer[buffer_size]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *name = strrchr(host->path, '/');
+    name = name != NULL ? name + 1 : host->path;
+
+    int rebuilt = 0;
+    ssize_t len;
+    while ((len = read(host->inotify_fd, buffer, buffer_size)) > 0) {
+        struct inotify_event *event;
+        for (char *ptr = buffer; ptr < buffer + len;
+             ptr += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)ptr;
+            rebuilt |= event->len > 0 && strcmp(event->name, name) == 0;
+        }
+    }
+    return rebuilt;
+}
+
+// Call the plugin with every queued batch, reloading it when it is rebuilt
+static void *run_plugin(void *arg) {
+    plugin_host *host = (plugin_host *)arg;
+    struct pollfd fds[2] = {{host->wake_fd, POLLIN, 0},
+                            {host->inotify_fd, POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN && plugin_rebuilt(host)) {
+            unload_plugin(host);
+            if (load_plugin(host) == 0) {
+                printf("Reloaded plugin %s\n", host->path);
+            }
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        // Take the whole queue, the watcher goes on queueing meanwhile
+        uint64_t wakes;
+        read(host->wake_fd, &wakes, sizeof(wakes));
+        pthread_mutex_lock(&host->lock);
+        plugin_batch *queued = host->head;
+        host->head = host->tail = NULL;
+        int stopping = host->stopping;
+        pthread_mutex_unlock(&host->lock);
+
+        // Batches that arrive while the plugin fails to load are dropped
+        while (queued != NULL) {
+            plugin_batch *next = queued->next;
+            if (host->entry != NULL) {
+                host->entry(&queued->batch);
+            }
+            free(queued);
+            queued = next;
+        }
+        if (stopping) {
+            return NULL;
+        }
+    }
+}
+
+// Load the plugin and start its thread
+// Returns the plugin, exits if it can't be loaded
+static plugin_host *start_plugin(const char *path) {
+    plugin_host *host = (plugin_host *)calloc(1, sizeof(plugin_host));
+    if (host == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // dlopen() searches the library path for names without a slash
+    if (strchr(path, '/') == NULL) {
+        snprintf(host->path, MAX_LEN, "./%s", path);
+    } else {
+        strncpy(host->path, path, MAX_LEN - 1);
+    }
+    if (load_plugin(host) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Compilers either write the plugin in place or move a new one over it
+    char dir[MAX_LEN];
+    strcpy(dir, host->path);
+    *strrchr(dir, '/') = '\0';
+    host->wake_fd = eventfd(0, EFD_CLOEXEC);
+    host->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (host->wake_fd < 0 || host->inotify_fd < 0 ||
+        inotify_add_watch(host->inotify_fd, dir[0] ? dir : "/",
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("plugin");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&host->lock, NULL);
+    if (start_thread(&host->thread, run_plugin, host) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    return host;
+}
+
+// Let the plugin take the batches already queued, then join its thread and
+// unload it
+static void stop_plugin(plugin_host *host) {
+    if (host == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&host->lock);
+    host->stopping = 1;
+    pthread_mutex_unlock(&host->lock);
+    uint64_t wake = 1;
+    write(host->wake_fd, &wake, sizeof(wake));
+    pthread_join(host->thread, NULL);
+
+    unload_plugin(host);
+    close(host->wake_fd);
+    close(host->inotify_fd);
+    pthread_mutex_destroy(&host->lock);
+    free(host);
+}
+
+// Copy a batch into the queue of the plugin thread
+static void queue_plugin_batch(plugin_host *host, const ggyl_batch *batch) {
+    // The changes, their paths and the clock share one allocation
+    size_t size = sizeof(plugin_batch) + batch->count * sizeof(ggyl_change) +
+                  strlen(batch->clock_str) + 1;
+    for (size_t i = 0; i < batch->count; i++) {
+        size += strlen(batch->changes[i].path) + 1;
+    }
+    plugin_batch *queued = (plugin_batch *)malloc(size);
+    if (queued == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    ggyl_change *changes = (ggyl_change *)(queued + 1);
+    char *strings = (char *)(changes + batch->count);
+    for (size_t i = 0; i < batch->count; i++) {
+        changes[i].kind = batch->changes[i].kind;
+        changes[i].path = strings;
+        strings = stpcpy(strings, batch->changes[i].path) + 1;
+    }
+    strcpy(strings, batch->clock_str);
+    queued->next = NULL;
+    queued->batch = (ggyl_batch){changes, batch->count, batch->clock, strings};
+
+    pthread_mutex_lock(&host->lock);
+    if (host->tail != NULL) {
+        host->tail->next = queued;
+    } else {
+        host->head = queued;
+    }
+    host->tail = queued;
+    pthread_mutex_unlock(&host->lock);
+
+    uint64_t wake = 1;
+    write(host->wake_fd, &wake, sizeof(wake));
+}
+
+/* ------------------------------- Path Sets ------------------------------ */
+
+// Find the slot of a path, the slot is empty if the path isn't in the set
+static size_t find_path_slot(path_set *set, const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = path; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    size_t slot = hash & (set->num_slots - 1);
+    while (set->entries[slot].path != NULL &&
+           strcmp(set->entries[slot].path, path) != 0) {
+        slot = (slot + 1) & (set->num_slots - 1);
+    }
+    return slot;
+}
+
+// Get the entry of a path, NULL if it isn't in the set
+static path_set_entry *find_entry(path_set *set, const char *path) {
+    if (set->count == 0) {
+        return NULL;
+    }
+    path_set_entry *entry = &set->entries[find_path_slot(set, path)];
+    return entry->path != NULL ? entry : NULL;
+}
+
+// Get the flags of a path, 0 if it isn't in the set
+static int path_flags(path_set *set, const char *path) {
+    path_set_entry *entry = find_entry(set, path);
+    return entry != NULL ? entry->flags : 0;
+}
+
+// Add a path to the set, or more flags to it
+// Returns the entry of the path
+static path_set_entry *add_path(path_set *set, const char *path, int flags) {
+    // Keep the table at most half full
+    if ((set->count + 1) * 2 > set->num_slots) {
+        path_set_entry *old = set->entries;
+        size_t old_slots = set->num_slots;
+        set->num_slots = old_slots ? old_slots * 2 : 256;
+        set->entries =
+            (path_set_entry *)calloc(set->num_slots, sizeof(path_set_entry));
+        for (size_t i = 0; i < old_slots; i++) {
+            if (old[i].path != NULL) {
+                set->entries[find_path_slot(set, old[i].path)] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t slot = find_path_slot(set, path);
+    if (set->entries[slot].path == NULL) {
+        set->entries[slot].path = strdup(path);
+        set->count++;
+    }
+    set->entries[slot].flags |= flags;
+    return &set->entries[slot];
+}
+
+// Remove every path from the set, its table is kept
+static void clear_paths(path_set *set) {
+    for (size_t i = 0; i < set->num_slots && set->count > 0; i++) {
+        if (set->entries[i].path != NULL) {
+            free(set->entries[i].path);
+            memset(&set->entries[i], 0, sizeof(path_set_entry));
+            set->count--;
+        }
+    }
+}
+
+// Name an absolute path below root like batches do, starting with the
+// watched directory as it was given
+// Returns 0 if the path isn't below root
+static int batch_path(const char *root, const char *dir, const char *path,
+                      char *out, size_t size) {
+    size_t root_len = strlen(root);
+    if (strncmp(path, root, root_len) != 0 || path[root_len] != '/') {
+        return 0;
+    }
+    snprintf(out, size, "%s%s", dir, path + root_len);
+    return 1;
+}
+
+// Count the levels of a path of a batch below the watched directory
+static int path_depth(const char *dir, const char *path) {
+    int depth = 0;
+    for (const char *p = path + strlen(dir); *p; p++) {
+        depth += *p == '/' && p[1] != '/' && p[1] != '\0';
+    }
+    return depth;
+}
+
+// Hand every file of a directory and below it to found, skipping hidden
+// directories and those below max_depth like the watcher. depth is the
+// level of the directory below the watched one.
+static void walk_tree(const char *dir, int depth, int max_depth,
+                      walk_fn found, void *arg) {
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        return;
+    }
+    char child[MAX_LEN];
+    struct dirent *dirent;
+    while ((dirent = readdir(dp)) != NULL) {
+        int len = snprintf(child, sizeof(child), "%s/%s", dir, dirent->d_name);
+        if (len >= (int)sizeof(child)) {
+            continue;
+        }
+        if (dirent->d_type == DT_DIR) {
+            if (dirent->d_name[0] != '.' &&
+                (max_depth < 0 || depth < max_depth)) {
+                walk_tree(child, depth + 1, max_depth, found, arg);
+            }
+        } else {
+            found(arg, child, len, dirent->d_name);
+        }
+    }
+    closedir(dp);
+}
+
+/* ----------------------------- Self Triggers ---------------------------- */
+
+// Get a time in nanoseconds
+static uint64_t timespec_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Check if a process is cmd or one of its descendants
+// Returns 1 if it is, 0 if it isn't, -1 if it is gone and nobody can tell
+static int is_descendant(pid_t pid, pid_t command) {
+    for (int depth = 0; depth < 64 && pid > 1; depth++) {
+        if (pid == command) {
+            return 1;
+        }
+        char path[64], stat[512];
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        ssize_t len = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        if (len <= 0) {
+            return -1;
+        }
+        stat[len] = '\0';
+
+        // The name may hold spaces and parentheses, the parent follows the
+        // state after the last ')'
+        char *end = strrchr(stat, ')');
+        int parent;
+        if (end == NULL || sscanf(end + 1, " %*c %d", &parent) != 1) {
+            return -1;
+        }
+        pid = parent;
+    }
+    return 0;
+}
+
+// Note who wrote the files fanotify reports under the watched directory
+static void *track_writes(void *arg) {
+    self_tracker *self = (self_tracker *)arg;
+    char buffer[8192]
+        __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    struct pollfd fds[1] = {{self->fan_fd, POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 1, -1) < 0) {
+            continue;
+        }
+        ssize_t len = read(self->fan_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            continue;
+        }
+
+        struct fanotify_event_metadata *event =
+            (struct fanotify_event_metadata *)buffer;
+        for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+            if (event->fd < 0) {
+                continue;
+            }
+            char link[64], path[MAX_LEN], key[2 * MAX_LEN];
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", event->fd);
+            ssize_t n = readlink(link, path, sizeof(path) - 1);
+            close(event->fd);
+            if (n <= 0) {
+                continue;
+            }
+            path[n] = '\0';
+            if (!batch_path(self->root, self->dir, path, key, sizeof(key))) {
+                continue;
+            }
+
+            // Writes made while cmd is spawned wait for its pid
+            pthread_mutex_lock(&self->lock);
+            while (self->starting) {
+                pthread_cond_wait(&self->spawned, &self->lock);
+            }
+            pid_t command = self->pid;
+            pthread_mutex_unlock(&self->lock);
+            int ours = is_descendant(event->pid, command);
+            if (ours < 0) {
+                continue;
+            }
+            pthread_mutex_lock(&self->lock);
+            add_path(&self->writes, key, ours ? SELF_OURS : SELF_THEIRS);
+            pthread_mutex_unlock(&self->lock);
+        }
+    }
+    return NULL;
+}
+
+// Start keeping cmd from triggering itself, fanotify is used when the
+// process may, which usually takes CAP_SYS_ADMIN
+static self_tracker *start_self_tracker(const char *dir, int max_runs) {
+    self_tracker *self = (self_tracker *)calloc(1, sizeof(self_tracker));
+    if (self == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    self->max_runs = max_runs;
+    self->dir = dir;
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->spawned, NULL);
+    self->fan_fd = -1;
+    char root[PATH_MAX];
+    if (realpath(dir, root) == NULL || strlen(root) >= MAX_LEN) {
+        return self;
+    }
+    strcpy(self->root, root);
+    self->fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC,
+                                 O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (self->fan_fd < 0) {
+        printf("Telling the writes of cmd apart by what it wrote before, "
+               "fanotify isn't permitted\n");
+        return self;
+    }
+
+    if (start_thread(&self->thread, track_writes, self) != 0) {
+        close(self->fan_fd);
+        self->fan_fd = -1;
+    }
+    return self;
+}
+
+// Open the window of a run before cmd is spawned, fanotify only watches the
+// mount while cmd runs
+static void begin_self_run(self_tracker *self) {
+    pthread_mutex_lock(&self->lock);
+    clear_paths(&self->writes);
+    self->starting = 1;
+    pthread_mutex_unlock(&self->lock);
+    if (self->fan_fd >= 0) {
+        fanotify_mark(self->fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                      FAN_CLOSE_WRITE, AT_FDCWD, self->root);
+    }
+    clock_gettime(CLOCK_REALTIME, &self->started);
+}
+
+// Let the writes of cmd be attributed once its pid is known, 0 if it
+// couldn't be spawned
+static void spawned_self_run(self_tracker *self, pid_t pid) {
+    pthread_mutex_lock(&self->lock);
+    self->pid = pid;
+    self->starting = 0;
+    pthread_cond_broadcast(&self->spawned);
+    pthread_mutex_unlock(&self->lock);
+}
+
+// Close the window of a run once cmd exited
+static void end_self_run(self_tracker *self) {
+    clock_gettime(CLOCK_REALTIME, &self->exited);
+    if (self->fan_fd >= 0) {
+        fanotify_mark(self->fan_fd, FAN_MARK_REMOVE | FAN_MARK_MOUNT,
+                      FAN_CLOSE_WRITE, AT_FDCWD, self->root);
+    }
+    self->ran = 1;
+    self->fresh = 1;
+}
+
+// Find out who made a change, by who fanotify saw write it or else by when
+// it last changed. A change made while cmd ran is only put down to cmd when
+// an earlier run changed the same path too, since a file saved by anybody
+// else meanwhile changed within the window just as well. A file that came
+// and went while cmd ran counts as changed within the window.
+// Returns WRITER_CMD, WRITER_RUN or WRITER_OTHER
+static int is_self_write(self_tracker *self, const ggyl_change *change) {
+    // Overflows are never the command's
+    if (is_overflow(change)) {
+        return WRITER_OTHER;
+    }
+    int writers = path_flags(&self->writes, change->path);
+    if (writers != 0) {
+        return writers == SELF_OURS ? WRITER_CMD : WRITER_OTHER;
+    }
+    struct stat st;
+    int during;
+    if (lstat(change->path, &st) != 0) {
+        during = self->fresh && (change->kind & GGYL_CREATED);
+    } else {
+        uint64_t changed = timespec_ns(&st.st_ctim);
+        during = changed + SELF_SLACK_NS >= timespec_ns(&self->started) &&
+                 changed <= timespec_ns(&self->exited) + SELF_SLACK_NS;
+    }
+    if (!during) {
+        return WRITER_OTHER;
+    }
+    return path_flags(&self->outputs, change->path) == SELF_OURS
+               ? WRITER_CMD
+               : WRITER_RUN;
+}
+
+// Take the changes the last run of cmd made out of a batch, and stop
+// running cmd after max_runs runs in a row that it may have triggered
+// itself, until something else changes
+// Returns 1 if cmd should run for the changes left in rest
+static int drop_self_writes(self_tracker *self, const ggyl_batch *batch,
+                            ggyl_batch *rest) {
+    *rest = *batch;
+    if (!self->ran) {
+        return 1;
+    }
+    if (batch->count > self->capacity) {
+        self->capacity = batch->count * 2;
+        self->changes = (ggyl_change *)realloc(
+            self->changes, self->capacity * sizeof(ggyl_change));
+    }
+
+    // Paths changed while cmd ran are remembered, so the next run changing
+    // them again is put down to cmd, until they change outside a run
+    size_t kept = 0, during = 0;
+    pthread_mutex_lock(&self->lock);
+    for (size_t i = 0; i < batch->count; i++) {
+        const ggyl_change *change = &batch->changes[i];
+        int writer = is_self_write(self, change);
+        if (writer == WRITER_CMD) {
+            continue;
+        }
+        if (writer == WRITER_RUN) {
+            add_path(&self->outputs, change->path, SELF_OURS);
+            during++;
+        } else {
+            path_set_entry *entry = find_entry(&self->outputs, change->path);
+            if (entry != NULL) {
+                entry->flags = 0;
+            }
+        }
+        self->changes[kept++] = *change;
+    }
+    pthread_mutex_unlock(&self->lock);
+    self->fresh = 0;
+    size_t dropped = batch->count - kept;
+    rest->changes = self->changes;
+    rest->count = kept;
+
+    if (rest->count == 0) {
+        printf("ggyl: Ignoring %zu changes made by cmd\n", dropped);
+        return 0;
+    }
+
+    // Only a batch of nothing but changes made while cmd ran may have been
+    // triggered by it, anything changed outside the window starts over
+    if (during < kept) {
+        self->runs = 0;
+        return 1;
+    }
+    if (++self->runs > self->max_runs) {
+        if (self->runs == self->max_runs + 1) {
+            printf("ggyl: cmd triggered itself %d times in a row, waiting "
+                   "for something else to change\n",
+                   self->max_runs);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* ----------------------------- Input Tracing ---------------------------- */
+
+// Start tracing what cmd reads with the shim next to ggyl, into a trace file
+// of our own
+// Returns the tracer, exits if the shim can't be found
+static input_tracer *start_input_tracer(const char *dir) {
+    input_tracer *tracer = (input_tracer *)calloc(1, sizeof(input_tracer));
+    if (tracer == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    tracer->dir = dir;
+    tracer->narrowed = 1;
+    pthread_mutex_init(&tracer->lock, NULL);
+    char root[PATH_MAX];
+    if (realpath(dir, root) == NULL || strlen(root) >= MAX_LEN) {
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(tracer->root, root);
+
+    // cmd may change directories, so the shim is named by its absolute path
+    char lib[MAX_LEN];
+    ssize_t len = readlink("/proc/self/exe", lib, sizeof(lib) - 1);
+    char *slash = len > 0 ? memrchr(lib, '/', len) : NULL;
+    if (slash == NULL ||
+        (size_t)(slash - lib) + sizeof("/" TRACE_LIB) > sizeof(lib)) {
+        fprintf(stderr, "--trace can't find where ggyl is\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(slash + 1, TRACE_LIB);
+    if (access(lib, R_OK) != 0) {
+        fprintf(stderr, "--trace needs %s, which make builds\n", lib);
+        exit(EXIT_FAILURE);
+    }
+    const char *preload = getenv("LD_PRELOAD");
+    snprintf(tracer->env_preload, sizeof(tracer->env_preload),
+             "LD_PRELOAD=%s%s%s", lib, preload != NULL ? " " : "",
+             preload != NULL ? preload : "");
+
+    strcpy(tracer->path, "/tmp/ggyl_trace_XXXXXX");
+    tracer->fd = mkstemp(tracer->path);
+    if (tracer->fd < 0) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(tracer->env_trace, sizeof(tracer->env_trace), "GGYL_TRACE=%s",
+             tracer->path);
+    return tracer;
+}
+
+// Remove the trace file
+static void stop_input_tracer(input_tracer *tracer) {
+    if (tracer != NULL) {
+        close(tracer->fd);
+        unlink(tracer->path);
+    }
+}
+
+// Start an empty trace before cmd runs
+static void begin_trace(input_tracer *tracer) {
+    if (ftruncate(tracer->fd, 0) != 0) {
+        perror(tracer->path);
+    }
+}
+
+// Add the trace of the run of cmd that just ended to the inputs, with the
+// directories of the files. Files outside of the tree are left out.
+static void read_trace(input_tracer *tracer) {
+    FILE *file = fopen(tracer->path, "r");
+    if (file == NULL) {
+        perror(tracer->path);
+        return;
+    }
+    path_set *next = &tracer->next;
+    clear_paths(next);
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    char path[2 * MAX_LEN];
+    while ((len = getline(&line, &capacity, file)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        if (!batch_path(tracer->root, tracer->dir, line, path,
+                        sizeof(path))) {
+            continue;
+        }
+        add_path(next, path, TRACE_INPUT);
+        *strrchr(path, '/') = '\0';
+        add_path(next, path, TRACE_DIR);
+    }
+    free(line);
+    fclose(file);
+
+    // The watches only need to change when there are new directories
+    pthread_mutex_lock(&tracer->lock);
+    int traced = tracer->traced;
+    size_t num_dirs = tracer->num_dirs;
+    for (size_t i = 0; i < tracer->inputs.num_slots; i++) {
+        tracer->inputs.entries[i].flags &= ~TRACE_NEW;
+    }
+    for (size_t i = 0; i < next->num_slots; i++) {
+        path_set_entry *entry = &next->entries[i];
+        if (entry->path == NULL) {
+            continue;
+        }
+        int flags = path_flags(&tracer->inputs, entry->path);
+        tracer->num_dirs += (entry->flags & ~flags & TRACE_DIR) != 0;
+        int added = (entry->flags & ~flags & TRACE_INPUT) != 0;
+        tracer->num_files += added;
+        add_path(&tracer->inputs, entry->path,
+                 entry->flags | (added ? TRACE_NEW : 0));
+    }
+    tracer->traced = tracer->num_files > 0;
+    tracer->narrowed = tracer->narrowed && traced == tracer->traced &&
+                       num_dirs == tracer->num_dirs;
+    pthread_mutex_unlock(&tracer->lock);
+}
+
+// Narrow the watches down to the directories cmd read from in its last
+// run, or watch the whole tree again when it read nothing in it. Called
+// between polls, as the watcher is only touched by the polling thread.
+static void narrow_watches(input_tracer *tracer, ggyl_watcher *watcher) {
+    pthread_mutex_lock(&tracer->lock);
+    if (tracer->narrowed) {
+        pthread_mutex_unlock(&tracer->lock);
+        return;
+    }
+    tracer->narrowed = 1;
+    if (!tracer->traced) {
+        pthread_mutex_unlock(&tracer->lock);
+        int count = ggyl_watch_only(watcher, NULL, 0);
+        printf("ggyl: cmd read nothing in %s, watching all %d "
+               "directories\n",
+               tracer->dir, count);
+        return;
+    }
+
+    // The watcher takes the directories relative to the watched one
+    const char **dirs =
+        (const char **)malloc(tracer->num_dirs * sizeof(const char *));
+    size_t count = 0;
+    size_t dir_len = strlen(tracer->dir);
+    for (size_t i = 0; i < tracer->inputs.num_slots; i++) {
+        path_set_entry *entry = &tracer->inputs.entries[i];
+        if (entry->path != NULL && (entry->flags & TRACE_DIR)) {
+            const char *rel = entry->path + dir_len;
+            dirs[count++] = *rel == '/' ? rel + 1 : rel;
+        }
+    }
+    int watched = ggyl_watch_only(watcher, dirs, count);
+    free(dirs);
+    printf("ggyl: cmd read %zu files, watching their %d directories\n",
+           tracer->num_files, watched);
+    pthread_mutex_unlock(&tracer->lock);
+}
+
+// Take the changes to files cmd didn't read out of a batch. New files in
+// the directories it read from stay, cmd may pick them up, and so do
+// overflows, which may have hidden anything. Inputs that are gone stop
+// being inputs.
+// Returns 1 if cmd should run for the changes left in rest
+static int drop_unread(input_tracer *tracer, const ggyl_batch *batch,
+                       ggyl_batch *rest) {
+    *rest = *batch;
+    pthread_mutex_lock(&tracer->lock);
+    if (!tracer->traced) {
+        pthread_mutex_unlock(&tracer->lock);
+        return 1;
+    }
+    if (batch->count > tracer->capacity) {
+        tracer->capacity = batch->count * 2;
+        tracer->changes = (ggyl_change *)realloc(
+            tracer->changes, tracer->capacity * sizeof(ggyl_change));
+    }
+    size_t kept = 0;
+    char dir[MAX_LEN];
+    for (size_t i = 0; i < batch->count; i++) {
+        const ggyl_change *change = &batch->changes[i];
+        path_set_entry *input = find_entry(&tracer->inputs, change->path);
+        int keep = is_overflow(change) ||
+                   (input != NULL && (input->flags & TRACE_INPUT));
+        if (keep && input != NULL && (change->kind & GGYL_DELETED) &&
+            access(change->path, F_OK) != 0) {
+            input->flags &= ~TRACE_INPUT;
+            tracer->num_files--;
+            tracer->traced = tracer->num_files > 0;
+            tracer->narrowed = tracer->narrowed && tracer->traced;
+        }
+        if (!keep && (change->kind & (GGYL_CREATED | GGYL_DELETED |
+                                      GGYL_DIR)) == GGYL_CREATED) {
+            snprintf(dir, sizeof(dir), "%s", change->path);
+            char *slash = strrchr(dir, '/');
+            if (slash != NULL) {
+                *slash = '\0';
+                keep = path_flags(&tracer->inputs, dir) & TRACE_DIR;
+            }
+        }
+        if (keep) {
+            tracer->changes[kept++] = *change;
+        }
+    }
+    pthread_mutex_unlock(&tracer->lock);
+    rest->changes = tracer->changes;
+    rest->count = kept;
+    return kept > 0;
+}
+
+// Check if a batch drop_unread() left has a new file that isn't an input,
+// or an overflow that may have hidden one. The inputs alone don't tell what
+// cmd reads then, as it may pick the file up.
+static int has_new_files(input_tracer *tracer, const ggyl_batch *batch) {
+    int found = 0;
+    pthread_mutex_lock(&tracer->lock);
+    for (size_t i = 0; i < batch->count && !found; i++) {
+        const ggyl_change *change = &batch->changes[i];
+        if (is_overflow(change)) {
+            found = 1;
+        } else if (change->kind & GGYL_CREATED) {
+            int flags = path_flags(&tracer->inputs, change->path);
+            found = !(flags & TRACE_INPUT);
+        }
+    }
+    pthread_mutex_unlock(&tracer->lock);
+    return found;
+}
+
+/* ------------------------------ Fingerprints ---------------------------- */
+
+// Scramble the bits of a hash
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+// Add bytes to a 64 bit FNV-1a hash
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+// Hash the contents of a file
+// Returns 0 if the file can't be read
+static int hash_file(const char *path, uint64_t *hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    static char buf[HASH_CHUNK];
+    *hash = HASH_SEED;
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        *hash = hash_bytes(*hash, buf, len);
+    }
+    close(fd);
+    return len == 0;
+}
+
+// Hash a file of the inputs again if it changed since it was last hashed,
+// and keep the sum of the hashes of every file up to date
+// Returns the hash of the path and contents, 0 if it isn't a readable file
+static uint64_t update_file(fingerprint_cache *cache, const char *path) {
+    path_set_entry *entry = add_path(&cache->files, path, 0);
+    struct stat st;
+    uint64_t stamp = 0;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        stamp = mix64(st.st_ino ^ st.st_size);
+        stamp = mix64(stamp ^ timespec_ns(&st.st_mtim));
+        stamp = mix64(stamp ^ timespec_ns(&st.st_ctim)) | 1;
+    }
+    if (stamp == entry->stamp) {
+        return entry->hash;
+    }
+    uint64_t hash = 0, contents;
+    if (stamp != 0 && hash_file(path, &contents)) {
+        hash = mix64(hash_bytes(HASH_SEED, path, strlen(path)) ^ contents);
+    }
+    cache->sum += hash - entry->hash;
+    entry->stamp = stamp;
+    entry->hash = hash;
+    return hash;
+}
+
+// Check if the patterns take a file name
+static int is_input_name(fingerprint_cache *cache, const char *name) {
+    for (int i = 0; i < cache->num_patterns; i++) {
+        if (fnmatch(cache->patterns[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return cache->num_patterns == 0;
+}
+
+// Hash a file walk_tree() found if the patterns take it
+static void found_input(void *arg, const char *path, int len,
+                        const char *name) {
+    (void)len;
+    fingerprint_cache *cache = (fingerprint_cache *)arg;
+    if (is_input_name(cache, name)) {
+        update_file(cache, path);
+    }
+}
+
+// Hash the files the patterns take in a directory and below it
+static void scan_inputs(fingerprint_cache *cache, const char *path,
+                        int depth) {
+    walk_tree(path, depth, cache->max_depth, found_input, cache);
+}
+
+// Bring the hashes up to date with a batch, before anything is taken out
+// of it. The files known below a changed directory, which is the whole tree
+// for an overflow, are hashed again and the directory is scanned for new
+// ones.
+static void update_inputs(fingerprint_cache *cache, const ggyl_batch *batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        const ggyl_change *change = &batch->changes[i];
+        if (!(change->kind & GGYL_DIR)) {
+            update_file(cache, change->path);
+            continue;
+        }
+        size_t len = strlen(change->path);
+        for (size_t j = 0; j < cache->files.num_slots; j++) {
+            path_set_entry *entry = &cache->files.entries[j];
+            if (entry->path != NULL &&
+                strncmp(entry->path, change->path, len) == 0 &&
+                entry->path[len] == '/') {
+                update_file(cache, entry->path);
+            }
+        }
+        scan_inputs(cache, change->path, path_depth(cache->dir, change->path));
+    }
+}
+
+// Get the fingerprint of the inputs as they are now, mixed with the rule so
+// one cache file serves any number of them
+// Returns the fingerprint, 0 while --trace doesn't know the inputs yet
+static uint64_t current_fingerprint(fingerprint_cache *cache,
+                                    input_tracer *tracer) {
+    uint64_t sum = cache->sum;
+    if (tracer != NULL) {
+        pthread_mutex_lock(&tracer->lock);
+        if (!tracer->traced) {
+            pthread_mutex_unlock(&tracer->lock);
+            return 0;
+        }
+        sum = 0;
+        for (size_t i = 0; i < tracer->inputs.num_slots; i++) {
+            path_set_entry *entry = &tracer->inputs.entries[i];
+            if (entry->path != NULL && (entry->flags & TRACE_INPUT)) {
+                sum += update_file(cache, entry->path);
+            }
+        }
+        pthread_mutex_unlock(&tracer->lock);
+    }
+    uint64_t fingerprint = mix64(cache->rule ^ sum);
+    return fingerprint != 0 ? fingerprint : 1;
+}
+
+// Find the result of a fingerprint, -1 if there is none
+static int find_result(fingerprint_cache *cache, uint64_t fingerprint) {
+    for (int i = cache->num_results - 1; i >= 0; i--) {
+        if (cache->results[i].fingerprint == fingerprint) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Write the cache file, replacing it atomically
+static void save_fingerprints(fingerprint_cache *cache) {
+    char tmp[MAX_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror(tmp);
+        return;
+    }
+    for (int i = 0; i < cache->num_results; i++) {
+        fprintf(out, "%016llx %d\n",
+                (unsigned long long)cache->results[i].fingerprint,
+                cache->results[i].status);
+    }
+    if (fclose(out) != 0 || rename(tmp, cache->path) != 0) {
+        perror(cache->path);
+        unlink(tmp);
+    }
+}
+
+// Remember how cmd ended for a fingerprint, dropping the oldest result once
+// the cache is full
+static void record_result(fingerprint_cache *cache, uint64_t fingerprint,
+                          int status) {
+    int i = find_result(cache, fingerprint);
+    if (i < 0 && cache->num_results == FINGERPRINT_RESULTS) {
+        i = 0;
+    }
+    if (i >= 0) {
+        memmove(&cache->results[i], &cache->results[i + 1],
+                (cache->num_results - i - 1) * sizeof(fingerprint_result));
+        cache->num_results--;
+    }
+    cache->results[cache->num_results].fingerprint = fingerprint;
+    cache->results[cache->num_results].status = status;
+    cache->num_results++;
+    save_fingerprints(cache);
+}
+
+// Load the cache file and hash the inputs, which are found by --trace later
+// when there is a tracer
+// Returns the cache
+static fingerprint_cache *start_fingerprints(const char *path,
+                                             const ggyl_options *options,
+                                             const char *cmd, int traced) {
+    fingerprint_cache *cache =
+        (fingerprint_cache *)calloc(1, sizeof(fingerprint_cache));
+    if (cache == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(cache->path, sizeof(cache->path), "%s", path);
+    cache->dir = options->dir;
+    cache->max_depth = options->max_depth;
+    cache->patterns = options->patterns;
+    cache->num_patterns = options->num_patterns;
+
+    // The same inputs mean nothing to another command or tree
+    uint64_t rule = hash_bytes(HASH_SEED, options->dir,
+                               strlen(options->dir) + 1);
+    rule = hash_bytes(rule, cmd, strlen(cmd) + 1);
+    for (int i = 0; i < options->num_patterns; i++) {
+        rule = hash_bytes(rule, options->patterns[i],
+                          strlen(options->patterns[i]) + 1);
+    }
+    cache->rule = rule ^ traced;
+
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        unsigned long long fingerprint;
+        int status;
+        while (cache->num_results < FINGERPRINT_RESULTS &&
+               fscanf(in, "%llx %d", &fingerprint, &status) == 2) {
+            cache->results[cache->num_results].fingerprint = fingerprint;
+            cache->results[cache->num_results].status = status;
+            cache->num_results++;
+        }
+        fclose(in);
+    }
+    if (!traced) {
+        scan_inputs(cache, options->dir, 0);
+    }
+    return cache;
+}
+
+// Check if the inputs are the same as those of a run that succeeded, and
+// otherwise note the fingerprint for the result of the run. With --trace a
+// batch with new files always runs, as the fingerprint only covers what cmd
+// read before.
+// Returns 1 if cmd should run
+static int check_fingerprint(cli_t *cli, const ggyl_batch *batch) {
+    fingerprint_cache *cache = cli->fingerprints;
+    if (cli->tracer != NULL && has_new_files(cli->tracer, batch)) {
+        cache->pending = 0;
+        return 1;
+    }
+    uint64_t fingerprint = current_fingerprint(cache, cli->tracer);
+    int i = fingerprint != 0 ? find_result(cache, fingerprint) : -1;
+    if (i >= 0 && cache->results[i].status == 0) {
+        printf("ggyl: Inputs match a run that succeeded, skipping\n");
+        return 0;
+    }
+    cache->pending = fingerprint;
+    return 1;
+}
+
+// Stamp and hash what cmd is known to read right before it is spawned, as
+// a traced run is fingerprinted by what it read once it is done
+static void begin_fingerprint(cli_t *cli) {
+    fingerprint_cache *cache = cli->fingerprints;
+    if (cli->tracer != NULL) {
+        current_fingerprint(cache, cli->tracer);
+    }
+    clock_gettime(CLOCK_REALTIME, &cache->started);
+}
+
+// Get the fingerprint of what a traced run read as it was when cmd was
+// spawned. Inputs known before use the hashes begin_fingerprint() took,
+// and inputs the run was the first to read are only known as they were
+// when they haven't changed since.
+// Returns the fingerprint, 0 if an input changed while cmd ran
+static uint64_t started_fingerprint(fingerprint_cache *cache,
+                                    input_tracer *tracer) {
+    uint64_t sum = 0;
+    uint64_t started = timespec_ns(&cache->started);
+    int changed = 0;
+    pthread_mutex_lock(&tracer->lock);
+    for (size_t i = 0; i < tracer->inputs.num_slots; i++) {
+        path_set_entry *entry = &tracer->inputs.entries[i];
+        if (entry->path == NULL || !(entry->flags & TRACE_INPUT)) {
+            continue;
+        }
+        path_set_entry *file = find_entry(&cache->files, entry->path);
+        struct stat st;
+        if ((entry->flags & TRACE_NEW) || file == NULL) {
+            if (stat(entry->path, &st) == 0 &&
+                timespec_ns(&st.st_ctim) + SELF_SLACK_NS >= started) {
+                changed = 1;
+                break;
+            }
+            sum += update_file(cache, entry->path);
+        } else {
+            sum += file->hash;
+        }
+    }
+    int traced = tracer->traced;
+    pthread_mutex_unlock(&tracer->lock);
+    if (!traced || changed) {
+        return 0;
+    }
+    uint64_t fingerprint = mix64(cache->rule ^ sum);
+    return fingerprint != 0 ? fingerprint : 1;
+}
+
+// Keep the result of the run that just ended, under the fingerprint of
+// what it read when it was traced
+static void record_run(cli_t *cli, int status) {
+    fingerprint_cache *cache = cli->fingerprints;
+    uint64_t fingerprint = cli->tracer != NULL
+                               ? started_fingerprint(cache, cli->tracer)
+                               : cache->pending;
+    if (fingerprint != 0) {
+        record_result(cache, fingerprint, status);
+    }
+    cache->pending = 0;
+}
+
+/* ------------------------------ Include Graph --------------------------- */
+
+// Get what a file is to the include graph by its extension, 0 for nothing
+static int include_kind(const char *path) {
+    static const char *const units[] = {"c", "cc", "cpp", "cxx", "c++"};
+    static const char *const headers[] = {"h", "hh", "hpp", "hxx", "inc"};
+    const char *dot = strrchr(path, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        if (strcmp(dot + 1, units[i]) == 0) {
+            return INCLUDE_UNIT;
+        }
+    }
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        if (strcmp(dot + 1, headers[i]) == 0) {
+            return INCLUDE_HEADER;
         }
-        glob++;
     }
-    *p++ = '$'; // End-of-line anchor
-    *p = '\0';
+    return strcmp(dot + 1, "d") == 0 ? INCLUDE_DEPS : 0;
 }
 
-// Compile regex patterns and store them in the regex_entries array
-// Any invalid regex patterns will be marked as not compiled
-void compile_patterns(monitor_t *mon, char *glob) {
-    if (mon->num_patterns >= MAX_REGEX) {
-        fprintf(stderr, "Too many regex patterns, max is %d\n", MAX_REGEX);
-        return;
+// Normalize a path of len bytes relative to where ggyl runs, dropping "."
+// and empty components and resolving ".." where it can. Absolute paths
+// inside the current directory become relative.
+static void normalize_path(include_graph *graph, const char *path,
+                           size_t len, char *out, size_t size) {
+    size_t cwd_len = strlen(graph->cwd);
+    size_t n = 0;
+    if (len > 0 && path[0] == '/') {
+        if (len > cwd_len && strncmp(path, graph->cwd, cwd_len) == 0 &&
+            path[cwd_len] == '/') {
+            path += cwd_len;
+            len -= cwd_len;
+        } else {
+            out[n++] = '/';
+        }
     }
+    size_t root = n; // ".." never goes above this
+    const char *end = path + len;
+    while (path < end) {
+        const char *slash = memchr(path, '/', end - path);
+        size_t part = slash != NULL ? (size_t)(slash - path)
+                                    : (size_t)(end - path);
 
-    // Convert glob pattern to regex pattern
-    char regex[MAX_LEN];
-    glob_to_regex(glob, regex);
+        // ".." drops the last component, unless it is ".." too, and there
+        // is nothing above /
+        size_t last = n;
+        while (last > root && out[last - 1] != '/') {
+            last--;
+        }
+        int up = part == 2 && strncmp(path, "..", 2) == 0;
+        if (up && n > root &&
+            !(n - last == 2 && strncmp(out + last, "..", 2) == 0)) {
+            n = last > root ? last - 1 : root;
+        } else if (part > 0 && !(part == 1 && path[0] == '.') &&
+                   !(up && root > 0 && n == root) && n + part + 2 < size) {
+            if (n > root) {
+                out[n++] = '/';
+            }
+            memcpy(out + n, path, part);
+            n += part;
+        }
+        path += part + (slash != NULL);
+    }
+    out[n] = '\0';
+}
 
-    printf("Compiling regex %s\n", glob);
+// Check if a normalized path is below a normalized directory of len bytes,
+// everything is below the empty path ggyl runs in
+static int is_below(const char *path, const char *dir, size_t len) {
+    return len == 0 || (strncmp(path, dir, len) == 0 && path[len] == '/');
+}
 
-    // Allocate memory for the regex program
-    regex_t *regex_data = (regex_t *)malloc(sizeof(regex_t));
-    if (regex_data == NULL) {
-        perror("Error: compile_patterns -> malloc");
-        exit(EXIT_FAILURE);
+// Get the node of a normalized path, adding it if it isn't known yet
+static uint32_t get_node(include_graph *graph, const char *path) {
+    path_set_entry *entry = add_path(&graph->paths, path, 0);
+    if (entry->stamp != 0) {
+        return entry->stamp - 1;
+    }
+    if (graph->num_nodes == graph->capacity) {
+        graph->capacity = graph->capacity ? graph->capacity * 2 : 256;
+        graph->nodes = (include_node *)realloc(
+            graph->nodes, graph->capacity * sizeof(include_node));
     }
+    uint32_t id = graph->num_nodes++;
+    entry->stamp = id + 1;
+    include_node *node = &graph->nodes[id];
+    memset(node, 0, sizeof(include_node));
+    node->path = entry->path;
+    node->kind = include_kind(path);
+    node->unit = NO_NODE;
 
-    // Allocate memory for the regex entry
-    regex_entry *regex_entry_elem = (regex_entry *)malloc(sizeof(regex_entry));
-    mon->regex_entries[mon->num_patterns] = regex_entry_elem;
+    // Nodes of a name are chained for includes found by their suffix
+    const char *slash = strrchr(path, '/');
+    path_set_entry *name =
+        add_path(&graph->names, slash != NULL ? slash + 1 : path, 0);
+    node->next_same_name = name->stamp != 0 ? name->stamp - 1 : NO_NODE;
+    name->stamp = id + 1;
+    return id;
+}
 
-    // Compile the regex pattern and store it in the regex_entries array
-    if (regcomp(regex_data, regex, REG_EXTENDED | REG_NOSUB) != 0) {
-        fprintf(stderr, "Failed to compile regex %s", glob);
-        mon->regex_entries[mon->num_patterns]->compiled = 0;
-        free(regex_entry_elem);
-        free(regex_data);
-    } else {
-        mon->regex_entries[mon->num_patterns]->compiled = 1;
-        mon->regex_entries[mon->num_patterns]->regex = regex_data;
-        mon->num_patterns++;
+// Find the file an #include names, next to the file that includes it or
+// else any file of the tree whose path ends with it, as -I directories
+// aren't known. An include that isn't found gets a node next to the file,
+// which is the one a new file there gets.
+static uint32_t resolve_include(include_graph *graph, uint32_t from,
+                                const char *name, size_t len) {
+    char joined[2 * MAX_LEN], path[2 * MAX_LEN];
+    const char *from_path = graph->nodes[from].path;
+    const char *slash = strrchr(from_path, '/');
+    int dir_len = slash != NULL ? (int)(slash - from_path + 1) : 0;
+    int n = snprintf(joined, sizeof(joined), "%.*s%.*s", dir_len, from_path,
+                     (int)len, name);
+    normalize_path(graph, joined, n, path, sizeof(path));
+    path_set_entry *entry = find_entry(&graph->paths, path);
+    if (entry != NULL && graph->nodes[entry->stamp - 1].present) {
+        return entry->stamp - 1;
     }
+
+    // The path ends with the included name on a component boundary
+    const char *base = memrchr(name, '/', len);
+    base = base != NULL ? base + 1 : name;
+    char base_name[MAX_LEN];
+    snprintf(base_name, sizeof(base_name), "%.*s",
+             (int)(name + len - base), base);
+    path_set_entry *first = find_entry(&graph->names, base_name);
+    for (uint32_t id = first != NULL ? first->stamp - 1 : NO_NODE;
+         id != NO_NODE; id = graph->nodes[id].next_same_name) {
+        include_node *node = &graph->nodes[id];
+        size_t path_len = strlen(node->path);
+        if (node->present && path_len >= len &&
+            strncmp(node->path + path_len - len, name, len) == 0 &&
+            (path_len == len || node->path[path_len - len - 1] == '/')) {
+            return id;
+        }
+    }
+    return get_node(graph, path);
 }
 
-// Check if a filename matches any of the compiled regex patterns
-int check_patterns(monitor_t *mon, char *filename) {
-    for (int i = 0; i < mon->num_patterns; i++) {
-        if (mon->regex_entries[i]->compiled) {
-            if (regexec(mon->regex_entries[i]->regex, filename, 0, NULL, 0) ==
-                0) {
-                return 1; // Match
+// Replace the edges of a node, keeping the reverse edges of their targets
+// in step. The edges of a .d file point back at its translation unit.
+static void set_edges(include_graph *graph, uint32_t id, uint32_t unit,
+                      const uint32_t *edges, uint32_t count) {
+    include_node *node = &graph->nodes[id];
+    uint32_t owner = node->unit != NO_NODE ? node->unit : id;
+    for (uint32_t i = 0; i < node->num_edges; i++) {
+        include_node *target = &graph->nodes[node->edges[i]];
+        for (uint32_t j = 0; j < target->num_includers; j++) {
+            if (target->includers[j] == owner) {
+                target->includers[j] =
+                    target->includers[--target->num_includers];
+                break;
             }
         }
     }
+    graph->num_edges -= node->num_edges;
 
-    // No patterns, match everything
-    if (mon->num_patterns == 0) {
-        return 1;
+    node->unit = unit;
+    owner = unit != NO_NODE ? unit : id;
+    node->edges =
+        (uint32_t *)realloc(node->edges, (count + 1) * sizeof(uint32_t));
+    memcpy(node->edges, edges, count * sizeof(uint32_t));
+    node->num_edges = count;
+    graph->num_edges += count;
+    for (uint32_t i = 0; i < count; i++) {
+        include_node *target = &graph->nodes[edges[i]];
+        if (target->num_includers == target->includers_capacity) {
+            target->includers_capacity = target->includers_capacity
+                                             ? target->includers_capacity * 2
+                                             : 4;
+            target->includers = (uint32_t *)realloc(
+                target->includers,
+                target->includers_capacity * sizeof(uint32_t));
+        }
+        target->includers[target->num_includers++] = owner;
+    }
+}
+
+// Add an edge of the file being parsed
+static void add_found(include_graph *graph, uint32_t *count, uint32_t id) {
+    if (*count == graph->found_capacity) {
+        graph->found_capacity = graph->found_capacity
+                                    ? graph->found_capacity * 2
+                                    : 64;
+        graph->found = (uint32_t *)realloc(
+            graph->found, graph->found_capacity * sizeof(uint32_t));
     }
+    graph->found[(*count)++] = id;
+}
 
-    return 0; // No match
+// Read a whole file into the text buffer, NUL terminated
+// Returns the length, -1 if it can't be read
+static ssize_t read_text(include_graph *graph, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t len = 0;
+    ssize_t n;
+    do {
+        if (len + HASH_CHUNK + 1 > graph->text_capacity) {
+            graph->text_capacity = (len + HASH_CHUNK + 1) * 2;
+            graph->text = (char *)realloc(graph->text, graph->text_capacity);
+        }
+        n = read(fd, graph->text + len, HASH_CHUNK);
+        len += n > 0 ? n : 0;
+    } while (n > 0);
+    close(fd);
+    graph->text[len] = '\0';
+    return n == 0 ? (ssize_t)len : -1;
 }
 
-// Free the regex entries of the monitor
-void free_regex_entries(monitor_t *mon) {
-    for (int i = 0; i < mon->num_patterns; i++) {
-        // Find compiled regex patterns and free them
-        if (mon->regex_entries[i]->compiled) {
-            regfree(mon->regex_entries[i]->regex);
-            free(mon->regex_entries[i]->regex);
+// Get the edges of a source file from its #include lines
+static uint32_t parse_includes(include_graph *graph, uint32_t id,
+                               size_t len) {
+    uint32_t count = 0;
+    for (char *line = graph->text; line < graph->text + len;) {
+        char *end = strchr(line, '\n');
+        end = end != NULL ? end : graph->text + len;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#') {
+            p += 1 + strspn(p + 1, " \t");
+            if (strncmp(p, "include", 7) == 0) {
+                p += 7 + strspn(p + 7, " \t");
+                char close = *p == '"' ? '"' : *p == '<' ? '>' : '\0';
+                char *name = p + 1;
+                char *name_end =
+                    close ? memchr(name, close, end - name) : NULL;
+                if (name_end != NULL && name_end > name) {
+                    add_found(graph, &count,
+                              resolve_include(graph, id, name,
+                                              name_end - name));
+                }
+            }
         }
-        // Free the regex entry
-        free(mon->regex_entries[i]);
+        line = end + 1;
     }
-    // Free the regex_entries array
-    free(mon->regex_entries);
+    return count;
 }
 
-// Build a tree of watch descriptors for the inotify events
-// This tree doesn't necessarily represent the directory structure.
-// I should probably make a watch_entry struct to store the watch descriptor and
-// the directory name to make it more clear but for now this does what I need it
-// to do.
-int_tree *build_watch_tree(monitor_t *mon, char *dir, node_t *parent) {
-    int_tree *wd_entries = mon->wd_entries;
-
-    // Add the watch descriptor to the tree
+// Get the edges of a .d file, the prerequisites of its first rule after
+// the translation unit, which is the first of them
+static uint32_t parse_deps(include_graph *graph, uint32_t *unit,
+                           size_t len) {
+    // Continued lines are one rule
+    char *text = graph->text;
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (text[i] == '\\' && text[i + 1] == '\n') {
+            text[i] = text[i + 1] = ' ';
+        }
+    }
+    char *end = strchr(text, '\n');
+    end = end != NULL ? end : text + len;
+    char *p = memchr(text, ':', end - text);
+    uint32_t count = 0;
+    *unit = NO_NODE;
+    char path[2 * MAX_LEN];
+    while (p != NULL && (p += 1 + strspn(p + 1, " \t\r")) < end) {
+        size_t word = strcspn(p, " \t\r\n");
+        normalize_path(graph, p, word, path, sizeof(path));
+        uint32_t id = get_node(graph, path);
+        if (*unit == NO_NODE) {
+            *unit = id;
+        } else {
+            add_found(graph, &count, id);
+        }
+        p += word - 1;
+    }
+    return count;
+}
 
-    // Open the directory
-    DIR *dp = opendir(dir);
-    if (dp == NULL) {
-        perror("opendir");
-        exit(EXIT_FAILURE);
+// Parse a file again, a file that is gone has no edges
+static void parse_node(include_graph *graph, uint32_t id) {
+    ssize_t len = read_text(graph, graph->nodes[id].path);
+    graph->nodes[id].present = len >= 0;
+    uint32_t count = 0, unit = NO_NODE;
+    if (len >= 0 && graph->nodes[id].kind == INCLUDE_DEPS) {
+        count = parse_deps(graph, &unit, len);
+    } else if (len >= 0) {
+        count = parse_includes(graph, id, len);
     }
+    set_edges(graph, id, unit, graph->found, count);
+}
 
-    // Block signals during the creation of the node to avoid leaking memory on
-    // close
-    sigset_t set, oldset;
-    sigemptyset(&set);
-    sigaddset(&set, SIGINT);
-    sigaddset(&set, SIGTERM);
-    sigaddset(&set, SIGSEGV);
-    sigprocmask(SIG_BLOCK, &set, &oldset);
+// Queue a node of a scan or a walk
+static void queue_node(include_graph *graph, size_t *count, uint32_t id) {
+    if (*count == graph->queue_capacity) {
+        graph->queue_capacity =
+            graph->queue_capacity ? graph->queue_capacity * 2 : 256;
+        graph->queue = (uint32_t *)realloc(
+            graph->queue, graph->queue_capacity * sizeof(uint32_t));
+    }
+    graph->queue[(*count)++] = id;
+}
 
-    // Create a new node and figure out if it's the root node or not
-    node_t *node = create_node(NULL);
-    if (wd_entries->root == NULL) {
-        wd_entries->root = node;
-    } else {
-        _add_child(parent, node);
+// Add a C file walk_tree() found as a node, queued for the scan
+static void found_source(void *arg, const char *path, int len,
+                         const char *name) {
+    include_graph *graph = (include_graph *)arg;
+    if (include_kind(name) == 0) {
+        return;
     }
+    char normalized[MAX_LEN];
+    normalize_path(graph, path, len, normalized, sizeof(normalized));
+    uint32_t id = get_node(graph, normalized);
+    graph->nodes[id].present = 1;
+    queue_node(graph, &graph->num_queued, id);
+}
 
-    // Add the watch descriptor to the directory
-    int wd = inotify_add_watch(mon->fd, dir, mon->mask);
-    if (wd < 0) {
-        perror("inotify_add_watch");
-        exit(EXIT_FAILURE);
+// Parse every C file of a directory and below it, once they are all known
+// so includes find the files they name
+static void scan_sources(include_graph *graph, const char *dir, int depth) {
+    graph->num_queued = 0;
+    walk_tree(dir, depth, graph->max_depth, found_source, graph);
+    for (size_t i = 0; i < graph->num_queued; i++) {
+        parse_node(graph, graph->queue[i]);
     }
+}
 
-    // Add the watch descriptor to the node
-    node->data = &wd;
+// Parse the C files of a batch again, before anything is taken out of it.
+// Files below a removed directory lose their edges, and a changed directory
+// or an overflow, which changes the whole tree, is scanned for new files.
+static void update_graph(include_graph *graph, const ggyl_batch *batch) {
+    char path[MAX_LEN];
+    for (size_t i = 0; i < batch->count; i++) {
+        const ggyl_change *change = &batch->changes[i];
+        size_t len = strlen(change->path);
+        if (!(change->kind & GGYL_DIR)) {
+            if (include_kind(change->path) != 0) {
+                normalize_path(graph, change->path, len, path, sizeof(path));
+                parse_node(graph, get_node(graph, path));
+            }
+            continue;
+        }
 
-    // Unblock signals by restoring the old signal mask
-    sigprocmask(SIG_SETMASK, &oldset, NULL);
+        // What was below a removed directory has no edges anymore
+        normalize_path(graph, change->path, len, path, sizeof(path));
+        size_t path_len = strlen(path);
+        for (uint32_t id = 0; id < graph->num_nodes; id++) {
+            include_node *node = &graph->nodes[id];
+            if (node->present && is_below(node->path, path, path_len) &&
+                access(node->path, F_OK) != 0) {
+                node->present = 0;
+                set_edges(graph, id, NO_NODE, NULL, 0);
+            }
+        }
+        scan_sources(graph, change->path,
+                     path_depth(graph->dir, change->path));
+    }
+}
 
-    // Read the directory entries
-    struct dirent *entry;
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_type == DT_DIR) {
-            // Skip the hidden, current, and parent directories
-            if (entry->d_name[0] == '.') {
-                continue;
+// Find the translation units the changes of a batch affect, the changed
+// ones and those including a changed file, directly or not, and put them
+// in GGYL_AFFECTED separated by newlines. A changed directory changes
+// every file below it, and an overflow may have hidden a change to any.
+// Returns the environment string
+static char *affected_units(include_graph *graph, const ggyl_batch *batch) {
+    graph->walk++;
+    size_t count = 0;
+    char path[MAX_LEN];
+    for (size_t i = 0; i < batch->count; i++) {
+        const ggyl_change *change = &batch->changes[i];
+        normalize_path(graph, change->path, strlen(change->path), path,
+                       sizeof(path));
+        if (change->kind & GGYL_DIR) {
+            size_t path_len = is_overflow(change) ? 0 : strlen(path);
+            for (uint32_t id = 0; id < graph->num_nodes; id++) {
+                if (graph->nodes[id].walk != graph->walk &&
+                    is_below(graph->nodes[id].path, path, path_len)) {
+                    graph->nodes[id].walk = graph->walk;
+                    queue_node(graph, &count, id);
+                }
+            }
+            continue;
+        }
+        path_set_entry *entry = find_entry(&graph->paths, path);
+        if (entry != NULL &&
+            graph->nodes[entry->stamp - 1].walk != graph->walk) {
+            graph->nodes[entry->stamp - 1].walk = graph->walk;
+            queue_node(graph, &count, entry->stamp - 1);
+        }
+    }
+
+    size_t size = sizeof("GGYL_AFFECTED=");
+    for (size_t i = 0; i < count; i++) {
+        include_node *node = &graph->nodes[graph->queue[i]];
+        if (node->kind == INCLUDE_UNIT && node->present) {
+            size += strlen(node->path) + 1;
+        }
+        for (uint32_t j = 0; j < node->num_includers; j++) {
+            include_node *includer = &graph->nodes[node->includers[j]];
+            if (includer->walk != graph->walk) {
+                includer->walk = graph->walk;
+                queue_node(graph, &count, node->includers[j]);
             }
+        }
+    }
+    if (size > graph->env_affected_capacity) {
+        graph->env_affected_capacity = size * 2;
+        graph->env_affected = (char *)realloc(graph->env_affected,
+                                              graph->env_affected_capacity);
+    }
+    char *p = stpcpy(graph->env_affected, "GGYL_AFFECTED=");
+    char *start = p;
+    for (size_t i = 0; i < count; i++) {
+        include_node *node = &graph->nodes[graph->queue[i]];
+        if (node->kind == INCLUDE_UNIT && node->present) {
+            p = stpcpy(p, node->path);
+            *p++ = '\n';
+        }
+    }
+    *(p > start ? p - 1 : p) = '\0';
+    return graph->env_affected;
+}
+
+// Build the graph of the C files of the tree
+// Returns the graph
+static include_graph *start_include_graph(const ggyl_options *options) {
+    include_graph *graph = (include_graph *)calloc(1, sizeof(include_graph));
+    if (graph == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    graph->dir = options->dir;
+    graph->max_depth = options->max_depth;
+    if (getcwd(graph->cwd, sizeof(graph->cwd)) == NULL) {
+        perror("getcwd");
+        exit(EXIT_FAILURE);
+    }
+    scan_sources(graph, options->dir, 0);
+    return graph;
+}
+
+/* ------------------------------- Command -------------------------------- */
+
+// Get the monotonic time in nanoseconds
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-            // Build the full path
-            char path[MAX_LEN];
-            snprintf(path, MAX_LEN, "%s/%s", dir, entry->d_name);
+// Build the environment of the command, ours with the changed paths in
+// GGYL_PATHS separated by newlines and the clock in GGYL_CLOCK, the shim
+// preloaded with --trace and the affected units with --includes. The buffers
+// are kept between runs, so once they have grown nothing is allocated.
+// Returns the environment, valid until the next batch
+static char **command_env(cli_t *cli, const ggyl_batch *batch) {
+    size_t size = sizeof("GGYL_PATHS=");
+    for (size_t i = 0; i < batch->count; i++) {
+        size += strlen(batch->changes[i].path) + 1;
+    }
+    if (size > cli->env_paths_capacity) {
+        cli->env_paths_capacity = size * 2;
+        cli->env_paths =
+            (char *)realloc(cli->env_paths, cli->env_paths_capacity);
+    }
+    char *p = stpcpy(cli->env_paths, "GGYL_PATHS=");
+    for (size_t i = 0; i < batch->count; i++) {
+        p = stpcpy(p, batch->changes[i].path);
+        *p++ = '\n';
+    }
+    *(batch->count > 0 ? p - 1 : p) = '\0';
+    snprintf(cli->env_clock, sizeof(cli->env_clock), "GGYL_CLOCK=%s",
+             batch->clock_str);
 
-            build_watch_tree(mon, path, node);
+    // Our own environment minus the variables we set for cmd
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    if (count + 6 > cli->env_capacity) {
+        cli->env_capacity = (count + 6) * 2;
+        cli->env = (char **)realloc(cli->env, cli->env_capacity *
+                                                  sizeof(char *));
+    }
+    size_t n = 0;
+    input_tracer *tracer = cli->tracer;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "GGYL_PATHS=", 11) != 0 &&
+            strncmp(environ[i], "GGYL_CLOCK=", 11) != 0 &&
+            strncmp(environ[i], "GGYL_AFFECTED=", 14) != 0 &&
+            (tracer == NULL || (strncmp(environ[i], "LD_PRELOAD=", 11) != 0 &&
+                                strncmp(environ[i], "GGYL_TRACE=", 11) != 0))) {
+            cli->env[n++] = environ[i];
         }
     }
+    cli->env[n++] = cli->env_paths;
+    cli->env[n++] = cli->env_clock;
+    if (tracer != NULL) {
+        cli->env[n++] = tracer->env_preload;
+        cli->env[n++] = tracer->env_trace;
+    }
+    if (cli->includes != NULL) {
+        cli->env[n++] = affected_units(cli->includes, batch);
+    }
+    cli->env[n] = NULL;
+    return cli->env;
+}
 
-    // Close the directory
-    closedir(dp);
+// Run cmd with the shell and wait for it like system(), timing how long it
+// took to start since the batch was delivered at delivered_ns and how long
+// it ran
+static void spawn_command(cli_t *cli, char **env, uint64_t delivered_ns) {
+    // Like system(), ^C only stops the command while it runs
+    struct sigaction ignore, old_int, old_quit;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ignore, &old_int);
+    sigaction(SIGQUIT, &ignore, &old_quit);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    char *argv[] = {"sh", "-c", cli->cmd, NULL};
+    if (cli->self != NULL) {
+        begin_self_run(cli->self);
+    }
+    if (cli->tracer != NULL) {
+        begin_trace(cli->tracer);
+    }
+    if (cli->fingerprints != NULL) {
+        begin_fingerprint(cli);
+    }
+    int spawned = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, env) == 0;
+    int result = -1;
+    if (cli->self != NULL) {
+        spawned_self_run(cli->self, spawned ? pid : 0);
+    }
+    if (spawned) {
+        uint64_t started_ns = monotonic_ns();
+        GGYL_PROBE3(spawn, pid, delivered_ns, started_ns);
+        ggyl_record_latency(cli->watcher, GGYL_STAGE_SPAWN,
+                            started_ns - delivered_ns);
 
-    return wd_entries;
+        // SIGUSR1 interrupts the wait
+        int status = -1;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        uint64_t exited_ns = monotonic_ns();
+        GGYL_PROBE4(exit, pid, status, started_ns, exited_ns);
+        ggyl_record_latency(cli->watcher, GGYL_STAGE_RUN,
+                            exited_ns - started_ns);
+        ggyl_count_run(cli->watcher,
+                       !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+        result = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    } else {
+        ggyl_count_run(cli->watcher, 1);
+    }
+    if (cli->self != NULL) {
+        end_self_run(cli->self);
+    }
+    if (cli->tracer != NULL) {
+        read_trace(cli->tracer);
+    }
+    if (cli->fingerprints != NULL) {
+        record_run(cli, result);
+    }
+    posix_spawnattr_destroy(&attr);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
 }
 
-// Monitor directory and subdirectories for any inotify events on the pipe file
-// descriptor This function will be called in an infinite loop to execute the
-// command once an event occurs. The monitor->wd_entries tree will be rebuilt if
-// destructive IN_ISDIR events occur.
-void monitor_directory(monitor_t *mon) {
+// Run the command for the batch of changes, the changed paths are passed to
+// the command in GGYL_PATHS separated by newlines
+static void run_command(ggyl_watcher *watcher, const ggyl_batch *batch,
+                        void *arg) {
+    (void)watcher;
+    cli_t *cli = (cli_t *)arg;
+    uint64_t delivered_ns = monotonic_ns();
+    if (cli->stream != STREAM_NONE) {
+        stream_batch(cli, batch);
+        return;
+    }
+    if (cli->plugin != NULL) {
+        queue_plugin_batch(cli->plugin, batch);
+        return;
+    }
+    if (cli->fingerprints != NULL && cli->tracer == NULL) {
+        update_inputs(cli->fingerprints, batch);
+    }
+    if (cli->includes != NULL) {
+        update_graph(cli->includes, batch);
+    }
 
-    // Begin monitoring (only interrupted by signal handler)
-    const int buffer_size = 1024 * (sizeof(struct inotify_event) + 16);
-    char buffer[buffer_size];
-    while (1) {
+    // Changes cmd made itself don't run it again
+    ggyl_batch rest;
+    if (cli->self != NULL) {
+        if (!drop_self_writes(cli->self, batch, &rest)) {
+            return;
+        }
+        batch = &rest;
+    }
 
-        // Assign temp file descriptor to the inotify file descriptor
-        fd_set fds;
-        struct timeval tv;
-
-        FD_ZERO(&fds);
-        FD_SET(mon->fd, &fds);
-
-        int debounce_delay = 1;
-        tv.tv_sec = debounce_delay;
-        tv.tv_usec = 0;
-
-        // Wait for inotify events on the file descriptor
-        int ret = select(mon->fd + 1, &fds, NULL, NULL, &tv);
-        if (ret < 0) {
-            fprintf(stderr, "Failed to select inotify event: %s",
-                    strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-        // If select returns successfully
-        // Read to clear the inotify buffer and ignore specifics
-        if (ret > 0) {
-            // Read to clear the inotify buffer and ignore specifics
-            read(mon->fd, buffer, buffer_size);
-
-            while (1) {
-                FD_ZERO(&fds);
-                FD_SET(mon->fd, &fds);
-                tv.tv_sec = 0;
-                tv.tv_usec = 20000;
-
-                // Wait for inotify events on the file descriptor
-                ret = select(mon->fd + 1, &fds, NULL, NULL, &tv);
-                if (ret < 0) {
-                    fprintf(stderr, "Failed to select inotify event: %s",
-                            strerror(errno));
-                    break;
-                }
+    // With --trace only changes to what cmd read run it again
+    ggyl_batch read;
+    if (cli->tracer != NULL) {
+        if (!drop_unread(cli->tracer, batch, &read)) {
+            return;
+        }
+        batch = &read;
+    }
 
-                // Read file descriptor to buffer
-                read(mon->fd, buffer, buffer_size);
-
-                // get an inotify event from the buffer
-                struct inotify_event *event = (struct inotify_event *)buffer;
-                if (event->len) {
-
-                    // Rebuid the watch tree if a directory change is noted
-                    if (event->mask & IN_ISDIR &&
-                        (event->mask & IN_CREATE || event->mask & IN_DELETE ||
-                         event->mask & IN_MOVE)) {
-                        free_tree(mon->wd_entries);
-                        mon->wd_entries = create_tree(
-                            int, free_int, compare_int, int_to_str, print_int);
-                        mon->wd_entries = build_watch_tree(mon, mon->dir, NULL);
-                        system("clear");
-                        system(mon->cmd);
-                        break;
-                    }
-
-                    // If the event is a modify event, check if the event name
-                    // matches any of the regex patterns
-                    if (event->mask & IN_MODIFY) {
-                        if (check_patterns(mon, event->name)) {
-                            system("clear");
-                            system(mon->cmd);
-                            break;
-                        }
-                    }
-                }
-            }
+    // Inputs that are the same as those of a run that succeeded are done
+    if (cli->fingerprints != NULL && !check_fingerprint(cli, batch)) {
+        return;
+    }
+
+    // The watcher holds the next batch until the dispatcher ran this one,
+    // so the environment is left alone meanwhile
+    dispatcher_t *dispatcher = cli->dispatcher;
+    if (dispatcher != NULL) {
+        ggyl_hold(watcher);
+        command_env(cli, batch);
+        pthread_mutex_lock(&dispatcher->lock);
+        dispatcher->pending = 1;
+        dispatcher->delivered_ns = delivered_ns;
+        pthread_cond_signal(&dispatcher->wake);
+        pthread_mutex_unlock(&dispatcher->lock);
+        return;
+    }
+
+    system("clear");
+    spawn_command(cli, command_env(cli, batch), delivered_ns);
+}
+
+// Run cmd for every batch handed over by run_command(), and release the
+// watcher once it is done
+static void *run_dispatcher(void *arg) {
+    cli_t *cli = (cli_t *)arg;
+    dispatcher_t *dispatcher = cli->dispatcher;
+    while (1) {
+        pthread_mutex_lock(&dispatcher->lock);
+        while (!dispatcher->pending && !dispatcher->stopping) {
+            pthread_cond_wait(&dispatcher->wake, &dispatcher->lock);
         }
+        if (dispatcher->stopping) {
+            pthread_mutex_unlock(&dispatcher->lock);
+            return NULL;
+        }
+        uint64_t delivered_ns = dispatcher->delivered_ns;
+        pthread_mutex_unlock(&dispatcher->lock);
+
+        system("clear");
+        spawn_command(cli, cli->env, delivered_ns);
+
+        pthread_mutex_lock(&dispatcher->lock);
+        dispatcher->pending = 0;
+        pthread_mutex_unlock(&dispatcher->lock);
+        ggyl_release(cli->watcher);
+    }
+}
+
+// Start the thread that runs cmd, signals are left to the main thread
+// Returns the dispatcher, exits if its thread can't be started
+static dispatcher_t *start_dispatcher(cli_t *cli) {
+    dispatcher_t *dispatcher = (dispatcher_t *)calloc(1, sizeof(dispatcher_t));
+    if (dispatcher == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&dispatcher->lock, NULL);
+    pthread_cond_init(&dispatcher->wake, NULL);
+    cli->dispatcher = dispatcher;
+    if (start_thread(&dispatcher->thread, run_dispatcher, cli) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    return dispatcher;
+}
+
+// Join the dispatcher once the run of cmd in progress, if any, is done, so
+// it no longer releases the watcher
+static void stop_dispatcher(dispatcher_t *dispatcher) {
+    if (dispatcher == NULL) {
+        return;
     }
+    pthread_mutex_lock(&dispatcher->lock);
+    dispatcher->stopping = 1;
+    pthread_cond_signal(&dispatcher->wake);
+    pthread_mutex_unlock(&dispatcher->lock);
+    pthread_join(dispatcher->thread, NULL);
+    pthread_mutex_destroy(&dispatcher->lock);
+    pthread_cond_destroy(&dispatcher->wake);
+    free(dispatcher);
+}
+
+// Print an error the watcher worked around
+static void print_log(const char *message, void *arg) {
+    (void)arg;
+    fprintf(stderr, "%s\n", message);
+}
+
+// Ask for the latencies to be printed between polls
+static void request_latency(int sig) {
+    (void)sig;
+    cli.print_latency = 1;
+}
+
+// Ask the polling loop to stop, main() frees everything once it has
+static void handle_signal(int sig) {
+    cli.stop_signal = sig;
 }
 
-// Free memory and exit
-void handle_signal(int sig) {
-    printf("\nggyl: Caught signal %d -> SIG%s\n", sig, sys_siglist[sig]);
-    free_regex_entries(&monitor);
-    free_tree(monitor.wd_entries);
-    close(monitor.fd);
-    exit(0);
+// Exit on a crash, nothing can be freed or saved from here
+static void handle_crash(int sig) {
+    (void)sig;
+    static const char msg[] = "\nggyl: Caught signal 11 -> Segmentation "
+                              "fault\n";
+    if (write(STDOUT_FILENO, msg, sizeof(msg) - 1) < 0) {
+        // Nothing left to report it to
+    }
+    _exit(EXIT_FAILURE);
 }
 
 // Program entry point
 int main(int argc, char *argv[]) {
 
+    // Queries are answered by a running ggyl
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return query_main(argc - 1, argv + 1);
+    }
+
+    // Clients run their command for the changes a daemon sends them
+    if (argc > 1 && strcmp(argv[1], "subscribe") == 0) {
+        return subscribe_main(argc - 1, argv + 1);
+    }
+
+    // Clients catch up on what changed while they weren't looking
+    if (argc > 1 && strcmp(argv[1], "since") == 0) {
+        return since_main(argc - 1, argv + 1);
+    }
+
+    // Scrapers read the counters of a running ggyl
+    if (argc > 1 && strcmp(argv[1], "metrics") == 0) {
+        return metrics_main(argc - 1, argv + 1);
+    }
+
+    ggyl_options options;
+    ggyl_options_init(&options);
+    options.log = print_log;
+    const char *plugin_path = NULL;
+    int self_runs = 0;
+    int trace = 0;
+    const char *fingerprint_path = NULL;
+    int includes = 0;
     int opt;
 
+    static struct option long_options[] = {
+        {"depth", required_argument, NULL, 'D'},
+        {"lazy", required_argument, NULL, 'L'},
+        {"snapshot", required_argument, NULL, 'S'},
+        {"socket", required_argument, NULL, 'Q'},
+        {"daemon", no_argument, NULL, 'M'},
+        {"debounce", required_argument, NULL, 'B'},
+        {"journal", required_argument, NULL, 'J'},
+        {"shm", required_argument, NULL, 'H'},
+        {"stream", required_argument, NULL, 'O'},
+        {"plugin", required_argument, NULL, 'P'},
+        {"record", required_argument, NULL, 'R'},
+        {"replay", required_argument, NULL, 'Y'},
+        {"replay-fast", no_argument, NULL, 'F'},
+        {"latency", no_argument, NULL, 'T'},
+        {"metrics", required_argument, NULL, 'E'},
+        {"threads", required_argument, NULL, 'N'},
+        {"shards", required_argument, NULL, 'A'},
+        {"ignore-self", no_argument, NULL, 'I'},
+        {"self-runs", required_argument, NULL, 'U'},
+        {"trace", no_argument, NULL, 'X'},
+        {"fingerprint", required_argument, NULL, 'G'},
+        {"includes", no_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}};
+
     // Parse command line options
-    while ((opt = getopt(argc, argv, "d:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'd':
-                strncpy(monitor.dir, optarg, MAX_LEN);
+                options.dir = optarg;
+                break;
+            case 'D':
+                options.max_depth = atoi(optarg);
+                if (options.max_depth < 0) {
+                    fprintf(stderr, "--depth must be 0 or more\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+                options.lazy_depth = atoi(optarg);
+                if (options.lazy_depth < 1) {
+                    fprintf(stderr, "--lazy must be 1 or more\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                options.snapshot_path = optarg;
+                break;
+            case 'Q':
+                options.socket_path = optarg;
+                break;
+            case 'M':
+                options.daemon = 1;
+                break;
+            case 'B':
+                options.debounce_ms = atoi(optarg);
+                if (options.debounce_ms < 0) {
+                    fprintf(stderr, "--debounce must be 0 or more\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'O':
+                if (strcmp(optarg, "json") == 0) {
+                    cli.stream = STREAM_JSON;
+                } else if (strcmp(optarg, "bin") == 0) {
+                    cli.stream = STREAM_BINARY;
+                } else {
+                    fprintf(stderr, "--stream must be json or bin\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                plugin_path = optarg;
+                break;
+            case 'R':
+                options.record_path = optarg;
+                break;
+            case 'Y':
+                options.replay_path = optarg;
+                break;
+            case 'F':
+                options.replay_fast = 1;
+                break;
+            case 'T':
+                options.latency = 1;
+                break;
+            case 'E':
+                options.metrics_path = optarg;
+                break;
+            case 'N':
+                options.threads = atoi(optarg);
+                if (options.threads < 1) {
+                    fprintf(stderr, "--threads must be 1 or more\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'A':
+                options.shards = atoi(optarg);
+                if (options.shards < 1 || options.shards > 16) {
+                    fprintf(stderr, "--shards must be 1 to 16\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'I':
+                self_runs = self_runs > 0 ? self_runs : SELF_RUNS;
+                break;
+            case 'U':
+                self_runs = atoi(optarg);
+                if (self_runs < 1) {
+                    fprintf(stderr, "--self-runs must be 1 or more\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'X':
+                trace = 1;
+                break;
+            case 'G':
+                fingerprint_path = optarg;
+                break;
+            case 'K':
+                includes = 1;
+                break;
+            case 'H':
+                options.ring_path = optarg;
+                break;
+            case 'J':
+                options.journal_size = atoi(optarg);
+                if (options.journal_size < 0) {
+                    fprintf(stderr, "--journal must be 0 or more\n");
+                    exit(EXIT_FAILURE);
+                }
                 break;
             default:
                 usage();
@@ -303,62 +2827,249 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // A daemon only serves the clients of its socket and ring, which bring
+    // their own commands and patterns
+    if (options.daemon && options.socket_path == NULL &&
+        options.ring_path == NULL) {
+        fprintf(stderr, "--daemon needs a --socket or --shm for its "
+                        "clients\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.daemon && cli.stream != STREAM_NONE) {
+        fprintf(stderr, "--daemon has no batches of its own to --stream\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.daemon && plugin_path != NULL) {
+        fprintf(stderr, "--daemon has no batches of its own for a "
+                        "--plugin\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cli.stream != STREAM_NONE && plugin_path != NULL) {
+        fprintf(stderr, "--stream and --plugin both replace cmd, pick one\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.replay_path != NULL &&
+        (options.record_path != NULL || options.snapshot_path != NULL)) {
+        fprintf(stderr, "--replay never touches the directory, so there is "
+                        "nothing to --record or --snapshot\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.replay_fast && options.replay_path == NULL) {
+        fprintf(stderr, "--replay-fast needs a --replay log\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.daemon && optind < argc) {
+        fprintf(stderr, "--daemon takes no command, clients subscribe with "
+                        "their own\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Streamed batches replace the command, so everything left are patterns
+    if (cli.stream != STREAM_NONE) {
+        redirect_stdout(&cli);
+    }
+
+    // A plugin replaces the command too
+    int has_cmd =
+        !options.daemon && cli.stream == STREAM_NONE && plugin_path == NULL;
+
+    if (self_runs > 0 && !has_cmd) {
+        fprintf(stderr, "--ignore-self and --self-runs need a cmd\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fingerprint_path != NULL && !has_cmd) {
+        fprintf(stderr, "--fingerprint keeps the results of cmd, and there "
+                        "is no cmd\n");
+        exit(EXIT_FAILURE);
+    }
+    if (includes && !has_cmd) {
+        fprintf(stderr, "--includes passes the affected units to cmd, and "
+                        "there is no cmd\n");
+        exit(EXIT_FAILURE);
+    }
+    if (trace && !has_cmd) {
+        fprintf(stderr, "--trace traces what cmd reads, and there is no "
+                        "cmd\n");
+        exit(EXIT_FAILURE);
+    }
+
     // If no command is provided, print usage and exit
-    if (optind >= argc) {
+    if (optind >= argc && has_cmd) {
         usage();
         fprintf(stderr, "Expected command after options\n");
         exit(EXIT_FAILURE);
     }
 
     // Get the command to execute
-    strncpy(monitor.cmd, argv[optind], strlen(argv[optind]));
-    optind++;
+    if (has_cmd) {
+        strncpy(cli.cmd, argv[optind], MAX_LEN - 1);
+        optind++;
+    }
 
-    // Allocate memory for the regex entries
-    monitor.regex_entries =
-        (regex_entry **)malloc(MAX_REGEX * sizeof(regex_entry *));
-    if (monitor.regex_entries == NULL) {
-        perror("malloc");
+    // Everything after the command are patterns
+    if (argc - optind > MAX_REGEX) {
+        fprintf(stderr, "Too many regex patterns, max is %d\n", MAX_REGEX);
         exit(EXIT_FAILURE);
     }
+    options.patterns = (const char *const *)argv + optind;
+    options.num_patterns = argc - optind;
+    for (int i = 0; i < options.num_patterns; i++) {
+        printf("Compiling regex %s\n", options.patterns[i]);
+    }
 
-    // Initialize the inotify watch entries array
-    monitor.wd_entries =
-        create_tree(int, free_int, compare_int, int_to_str, print_int);
-
-    // Get and compile the regex patterns
-    while (optind < argc) {
-        compile_patterns(&monitor, argv[optind]);
-        optind++;
+    // The plugin gets the first batch, which comes with the first poll
+    if (plugin_path != NULL) {
+        cli.plugin = start_plugin(plugin_path);
     }
 
-    // Initialize the monitor
-    monitor.fd = inotify_init();
-    if (monitor.fd < 0) {
-        perror("inotify_init");
+    cli.watcher = ggyl_new(&options, run_command, &cli);
+    if (cli.watcher == NULL) {
+        perror("ggyl_new");
         exit(EXIT_FAILURE);
     }
 
+    // Writes are told apart from the first run on
+    if (self_runs > 0) {
+        cli.self = start_self_tracker(options.dir, self_runs);
+    }
+    if (trace) {
+        cli.tracer = start_input_tracer(options.dir);
+    }
+    if (fingerprint_path != NULL) {
+        cli.fingerprints = start_fingerprints(fingerprint_path, &options,
+                                              cli.cmd, trace);
+    }
+    if (includes) {
+        cli.includes = start_include_graph(&options);
+    }
+
+    // With threads cmd runs on a thread of its own too
+    if (options.threads > 0 && has_cmd) {
+        start_dispatcher(&cli);
+    }
+
     // Initialize the inotify watch for anything in the directory (and
-    // subdirectories) Build a tree of inotify watch descriptors, rebuild the
-    // tree if the directory changes
-    monitor.wd_entries = build_watch_tree(&monitor, monitor.dir, NULL);
+    // subdirectories)
+    if (ggyl_start(cli.watcher) != 0) {
+        perror(options.replay_path != NULL ? options.replay_path
+                                           : options.dir);
+        exit(EXIT_FAILURE);
+    }
 
-    // Assign signal handlers for cleanup since we are using an infinite loop
+    // Signals end the infinite loop below, which cleans up after it
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
-    signal(SIGSEGV, handle_signal);
+    signal(SIGSEGV, handle_crash);
+
+    // Clients may hang up before their reply is written
+    signal(SIGPIPE, SIG_IGN);
+
+    // Latencies are printed on SIGUSR1 and on exit
+    if (options.latency) {
+        signal(SIGUSR1, request_latency);
+    }
 
-    printf("Monitoring %s\n", monitor.dir);
-    printf("Executing %s\n", monitor.cmd);
+    ggyl_stats stats;
+    ggyl_get_stats(cli.watcher, &stats);
+    if (options.replay_path != NULL) {
+        printf("Replaying %s %s\n", options.replay_path,
+               options.replay_fast ? "as fast as possible"
+                                   : "at recorded speed");
+    } else {
+        printf("Monitoring %s\n", options.dir);
+        printf("Watching %d directories (%zu bytes per directory)\n",
+               stats.num_dirs, stats.bytes / stats.num_dirs);
+    }
+    if (stats.snapshot_changes >= 0) {
+        printf("%d changes since last run\n", stats.snapshot_changes);
+    }
+    if (options.record_path != NULL) {
+        printf("Recording events to %s\n", options.record_path);
+    }
+    if (options.socket_path != NULL) {
+        printf("Serving clients on %s\n", options.socket_path);
+    }
+    if (options.ring_path != NULL) {
+        printf("Publishing changes to %s\n", options.ring_path);
+    }
+    if (options.metrics_path != NULL) {
+        printf("Writing metrics to %s\n", options.metrics_path);
+    }
+    if (options.threads > 0) {
+        printf("Reading events on %d threads\n", options.threads);
+    }
+    if (options.shards > 1) {
+        printf("Reading %d inotify instances\n", options.shards);
+    }
+    if (cli.stream != STREAM_NONE) {
+        printf("Streaming batches as %s\n",
+               cli.stream == STREAM_JSON ? "json" : "bin");
+    } else if (cli.plugin != NULL) {
+        printf("Calling plugin %s\n", cli.plugin->path);
+    } else if (!options.daemon) {
+        printf("Executing %s\n", cli.cmd);
+    }
+    if (cli.self != NULL) {
+        printf("Ignoring the changes of cmd, %d runs in a row at most\n",
+               cli.self->max_runs);
+    }
+    if (cli.tracer != NULL) {
+        printf("Tracing the files cmd reads\n");
+    }
+    if (cli.includes != NULL) {
+        printf("Following %zu #includes between %u C files\n",
+               cli.includes->num_edges, cli.includes->num_nodes);
+    }
+    if (cli.fingerprints != NULL) {
+        printf("Fingerprinting %s in %s\n",
+               cli.tracer != NULL ? "the files cmd reads" : "the matched files",
+               cli.fingerprints->path);
+    }
 
     ///////// Infinite loop to monitor the directory
-    monitor_directory(&monitor);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret;
+    while (!cli.stop_signal && (ret = ggyl_poll(cli.watcher, -1)) == 0) {
+        if (cli.print_latency) {
+            cli.print_latency = 0;
+            ggyl_print_latency(cli.watcher, stdout);
+        }
+        if (cli.tracer != NULL) {
+            narrow_watches(cli.tracer, cli.watcher);
+        }
+    }
+    if (!cli.stop_signal && ret < 0) {
+        perror("ggyl_poll");
+        exit(EXIT_FAILURE);
+    }
     ///////// Infinite loop to monitor the directory
 
-    // Standard cleanup (You should never reach this point)
-    free_regex_entries(&monitor);
-    free_tree(monitor.wd_entries);
+    // Only a replay ends without a signal
+    if (cli.stop_signal) {
+        printf("\nggyl: Caught signal %d -> %s\n", (int)cli.stop_signal,
+               strsignal(cli.stop_signal));
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds =
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        ggyl_get_stats(cli.watcher, &stats);
+        printf("Replayed %llu events in %.3fs (%.0f events/s)\n",
+               (unsigned long long)stats.replayed, seconds,
+               seconds > 0 ? stats.replayed / seconds : 0);
+    }
+    ggyl_print_latency(cli.watcher, stdout);
+
+    // Neither thread may touch the watcher once it is freed
+    stop_dispatcher(cli.dispatcher);
+    stop_plugin(cli.plugin);
+
+    // Saves the snapshot and removes the socket and ring
+    ggyl_free(cli.watcher);
+    stop_input_tracer(cli.tracer);
+    free(cli.stream_buf);
+    free(cli.env_paths);
+    free(cli.env);
 
     return 0;
 }
@@ -1,15 +1,20 @@
 #include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/select.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "libggyl.h"
+
 /*
  *  Author:     Kyle Lukaszek
  *  Date:       04/25/2024
@@ -79,22 +84,29 @@ DEFINE_TREE_STRUCT(float)
 
 #define MAX_LEN 1024
 #define MAX_REGEX 128
-#define MAX_WATCHES 1024
 
-typedef struct {
-    regex_t *regex;
-    int compiled;
-} regex_entry;
+/* ------------------------------ Event Log ------------------------------- */
+
+#define EVENT_LOG_MAGIC "GGYLEVTS"
+#define EVENT_LOG_VERSION 1
 
+// Start of an event log, everything is in host byte order
 typedef struct {
-    int fd;
-    char dir[MAX_LEN];
-    char cmd[MAX_LEN];
-    regex_entry **regex_entries;
-    int num_patterns;
-    int_tree *wd_entries;
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+} event_log_start;
+
+// Raw inotify event in the log, followed by the path of its directory
+// relative to the monitored directory and its name, neither terminated.
+// Records aren't aligned.
+typedef struct {
+    uint64_t time_ns; // Since recording started
     uint32_t mask;
-} monitor_t;
+    uint32_t cookie;
+    uint16_t dir_len;
+    uint16_t name_len;
+} event_log_record;
 
 /* -------------------------- Doubly-LList Macros ------------------------- */
 
@@ -464,7 +476,7 @@ Example: list_remove(list, &data) -> Removes the element with data pointer
 #define free_nodes(node, free_data) ({ _free_nodes(node, free_data); })
 
 // Helper function to free nodes since the a macro cannot recurse
-void _free_nodes(node_t *node, free_func free_data) {
+static inline void _free_nodes(node_t *node, free_func free_data) {
 
     if (node == NULL) {
         fprintf(stderr, "Error: free_nodes(node, free_data) -> NULL");
@@ -626,7 +638,8 @@ void _free_nodes(node_t *node, free_func free_data) {
 
 // Helper function to find a node with matching data
 // Returns a pointer to the node if found, NULL otherwise
-node_t *_find_node(node_t *node, void *target_data, compare_func compare) {
+static inline node_t *_find_node(node_t *node, void *target_data,
+                                 compare_func compare) {
     if (node == NULL) {
         return NULL;
     }
@@ -705,7 +718,8 @@ node_t *_find_node(node_t *node, void *target_data, compare_func compare) {
     })
 
 // Helper function to print the tree
-void _print_tree(tree_t *tree, node_t *node, int depth, print_func print) {
+static inline void _print_tree(tree_t *tree, node_t *node, int depth,
+                               print_func print) {
     if (node == NULL) {
         return;
     }
@@ -722,14 +736,14 @@ void _print_tree(tree_t *tree, node_t *node, int depth, print_func print) {
 /* -------------------------- Int Elem Functions ------------------------ */
 
 // Create an int pointer
-void *create_int(int i) {
+static inline void *create_int(int i) {
     int *i_ptr = (int *)malloc(sizeof(int));
     *i_ptr = i;
     return (void *)i_ptr;
 }
 
 // Compare int pointer data
-int compare_int(void *a, void *b) {
+static inline int compare_int(void *a, void *b) {
     if (a == NULL && b == NULL) {
         return 0;
     } else if (a == NULL) {
@@ -744,7 +758,7 @@ int compare_int(void *a, void *b) {
 }
 
 // Print int pointer data
-void print_int(void *ptr) {
+static inline void print_int(void *ptr) {
     if (ptr == NULL)
         return;
     fprintf(stdout, "%d", *(int *)ptr);
@@ -752,11 +766,11 @@ void print_int(void *ptr) {
 
 // Free int pointer data
 // Not needed since the data is a primitive type and can be passed with &...
-void free_int(void *ptr) { return; }
+static inline void free_int(void *ptr) { return; }
 
 // Convert int pointer data to string
 // Must free the returned string
-const char *int_to_str(void *i) {
+static inline const char *int_to_str(void *i) {
     char *str = (char *)malloc(12);
     sprintf(str, "%d", *(int *)i);
     return str;
@@ -765,7 +779,7 @@ const char *int_to_str(void *i) {
 /* -------------------------- Float Elem Functions ------------------------- */
 
 // Create a float pointer
-void *create_float(float f) {
+static inline void *create_float(float f) {
     float *f_ptr = (float *)malloc(sizeof(float));
     *f_ptr = f;
     return (void *)f_ptr;
@@ -773,7 +787,7 @@ void *create_float(float f) {
 
 // Compare float pointer data
 // Return 1 if equal, 0 if not equal
-int compare_float(void *a, void *b) {
+static inline int compare_float(void *a, void *b) {
     if (a == NULL && b == NULL) {
         return 0;
     } else if (a == NULL) {
@@ -788,14 +802,14 @@ int compare_float(void *a, void *b) {
 }
 
 // Print float pointer data
-void print_float(void *ptr) {
+static inline void print_float(void *ptr) {
     if (ptr == NULL)
         return;
     fprintf(stdout, "%f", *(float *)ptr);
 }
 
 // Free float pointer data
-void free_float(void *ptr) {
+static inline void free_float(void *ptr) {
     if (ptr == NULL)
         return;
     free(ptr);
@@ -803,10 +817,8 @@ void free_float(void *ptr) {
 
 // Convert float pointer data to to_string
 // Must free the returned string
-const char *float_to_str(float *f) {
+static inline const char *float_to_str(float *f) {
     char *str = (char *)malloc(12);
     sprintf(str, "%f", *f);
     return str;
 }
-
-/* -------------------------- Char Elem Functions ------------------------- */
@@ -0,0 +1,117 @@
+#ifndef GGYL_GLOB_H
+#define GGYL_GLOB_H
+
+#include <string.h>
+
+/*
+ *  File name patterns, as given to ggyl after cmd.
+ *
+ *  A pattern is turned into a regex by glob_to_regex(), * becomes .* and ?
+ *  becomes ., and everything else is left to the regex. Patterns that only
+ *  use * ? [...] and plain characters are matched by match_name() instead,
+ *  which never allocates, and has to agree with the regex on every name.
+ *  Classes are regex classes: [abc] and [a-z] match a member, [^abc]
+ *  negates and takes the regex, and the ! of [!abc] is only a member.
+ */
+
+// Check if a pattern only uses glob syntax, * ? [...] and plain characters,
+// so it can be matched by match_name() instead of a regex. Classes holding a
+// ^, [:alpha:] style names or characters that glob_to_regex() rewrites are
+// left to the regex.
+static inline int is_plain_glob(const char *glob) {
+    for (const char *p = glob; *p; p++) {
+        if (strchr("^$+(){}|\\", *p) != NULL) {
+            return 0;
+        }
+        if (*p == '[') {
+            // Classes have to be closed, and ']' right after '[' is a member
+            const char *end = p[1] != '\0' ? strchr(p + 2, ']') : NULL;
+            if (end == NULL) {
+                return 0;
+            }
+            for (p++; p < end; p++) {
+                if (strchr("*?.[^", *p) != NULL) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// Match a character against the class at pattern, [abc] or [a-z]
+// next is set to the rest of the pattern after the class
+static inline int match_class(const char *pattern, char c,
+                              const char **next) {
+    const char *p = pattern + 1;
+    int matched = 0;
+    do {
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            matched |= c >= p[0] && c <= p[2];
+            p += 3;
+        } else {
+            matched |= c == *p++;
+        }
+    } while (*p != ']');
+    *next = p + 1;
+    return matched;
+}
+
+// Match a file name against a plain glob without allocating or recursing, a
+// mismatch after a * retries with the * taking one more character
+static inline int match_name(const char *glob, const char *name) {
+    const char *star = NULL, *retry = NULL;
+    while (*name) {
+        if (*glob == '*') {
+            star = ++glob;
+            retry = name;
+            continue;
+        }
+        const char *next = glob + 1;
+        int matched = *glob == '['
+                          ? match_class(glob, *name, &next)
+                          : *glob != '\0' && (*glob == '?' || *glob == *name);
+        if (matched) {
+            glob = next;
+            name++;
+        } else if (star != NULL) {
+            glob = star;
+            name = ++retry;
+        } else {
+            return 0;
+        }
+    }
+    while (*glob == '*') {
+        glob++;
+    }
+    return *glob == '\0';
+}
+
+// Function to convert a glob pattern to a POSIX regex pattern
+static inline void glob_to_regex(const char *glob, char *regex) {
+    char *p = regex;
+    *p++ = '^'; // Start-of-line anchor
+    while (*glob) {
+        switch (*glob) {
+            case '*':
+                *p++ = '.';
+                *p++ = '*';
+                break;
+            case '?':
+                *p++ = '.';
+                break;
+            case '.':
+                *p++ = '\\';
+                *p++ = '.';
+                break;
+            default:
+                *p++ = *glob;
+                break;
+        }
+        glob++;
+    }
+    *p++ = '$'; // End-of-line anchor
+    *p = '\0';
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef GGYL_PLUGIN_H
+#define GGYL_PLUGIN_H
+
+#include "libggyl.h"
+
+/*
+ *  Plugins of ggyl (ggyl --plugin libhandler.so).
+ *
+ *  Instead of running a command, ggyl loads a shared object and calls its
+ *  entry point with every batch of changes. The calls come from a thread of
+ *  their own, one batch at a time, so a slow plugin never holds up watching.
+ *  ggyl reloads the plugin whenever the shared object is rebuilt, after
+ *  calling its unload function.
+ *
+ *      #include "ggyl_plugin.h"
+ *
+ *      void ggyl_plugin_v1(const ggyl_batch *batch) {
+ *          for (size_t i = 0; i < batch->count; i++) {
+ *              reload_asset(batch->changes[i].path);
+ *          }
+ *      }
+ *
+ *  Build it with gcc -shared -fPIC -o libhandler.so handler.c
+ */
+
+// Symbols ggyl looks up, only the entry point is required
+// The version is part of the name, so a plugin built against another version
+// of this header isn't loaded.
+#define GGYL_PLUGIN_ENTRY "ggyl_plugin_v1"
+#define GGYL_PLUGIN_LOAD "ggyl_plugin_load"
+#define GGYL_PLUGIN_UNLOAD "ggyl_plugin_unload"
+
+// Called with every batch, the batch is only valid during the call
+typedef void (*ggyl_plugin_fn)(const ggyl_batch *batch);
+
+// Called once the plugin is loaded, anything but 0 refuses to load it
+typedef int (*ggyl_plugin_load_fn)(void);
+
+// Called before the plugin is unloaded to be reloaded
+typedef void (*ggyl_plugin_unload_fn)(void);
+
+void ggyl_plugin_v1(const ggyl_batch *batch);
+int ggyl_plugin_load(void);
+void ggyl_plugin_unload(void);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef GGYL_PROBES_H
+#define GGYL_PROBES_H
+
+/*
+ *  USDT probes on the way from an inotify event to the command it runs.
+ *
+ *  Built in with "make USDT=1", which needs sys/sdt.h (systemtap-sdt-dev).
+ *  A probe is a nop in the code and a note in the binary, so perf and
+ *  bpftrace attach to a running ggyl without rebuilding it, and cost nothing
+ *  until they do. Without USDT=1 the probes aren't compiled at all.
+ *
+ *      readelf -n ggyl | grep -A3 stapsdt
+ *      bpftrace -e 'usdt:./ggyl:ggyl:coalesce { @merged[arg3] = count(); }'
+ *      perf buildid-cache --add ./ggyl && perf record -e sdt_ggyl:debounce
+ *
+ *  Probes of the provider ggyl and their arguments, times are
+ *  CLOCK_MONOTONIC nanoseconds:
+ *
+ *      read      path ID of the directory, inotify mask, name, read time
+ *      match     path ID, change kind, 1 if the command wants it, read time
+ *      coalesce  path ID, change kind, clock, 1 if it was merged into an
+ *                earlier change of the batch, read time
+ *      debounce  changes in the batch, clock, time of the first change or 0
+ *                when not timed, delivery time
+ *      spawn     pid of the command, delivery time, start time
+ *      exit      pid of the command, wait status, start time, exit time
+ *
+ *  Path IDs are the indices of the --shm path table, see ggyl_ring_path().
+ */
+
+#ifdef GGYL_USDT
+#include <sys/sdt.h>
+#define GGYL_PROBE3(name, a, b, c) DTRACE_PROBE3(ggyl, name, a, b, c)
+#define GGYL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(ggyl, name, a, b, c, d)
+#define GGYL_PROBE5(name, a, b, c, d, e)                                      \
+    DTRACE_PROBE5(ggyl, name, a, b, c, d, e)
+#else
+#define GGYL_PROBE3(name, a, b, c)                                            \
+    do {                                                                      \
+    } while (0)
+#define GGYL_PROBE4(name, a, b, c, d)                                         \
+    do {                                                                      \
+    } while (0)
+#define GGYL_PROBE5(name, a, b, c, d, e)                                      \
+    do {                                                                      \
+    } while (0)
+#endif
+
+#endif
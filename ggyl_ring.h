@@ -0,0 +1,232 @@
+#ifndef GGYL_RING_H
+#define GGYL_RING_H
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ *  Consumer side of the ggyl shared memory event feed (ggyl --shm file).
+ *
+ *  ggyl publishes every change it sees into a ring of fixed size records in
+ *  a shared file mapping, along with a copy of its path table, so a consumer
+ *  on the same host reads events without any syscalls. Every consumer keeps
+ *  its own position, and one that falls more than a ring behind is told it
+ *  missed events. Waiting for events uses a futex in the mapping, which ggyl
+ *  only wakes when somebody is waiting.
+ *
+ *      ggyl_ring_reader reader;
+ *      if (ggyl_ring_open(&reader, "/dev/shm/ggyl.ring") != 0) ...
+ *      while (1) {
+ *          ggyl_ring_record record;
+ *          int ret = ggyl_ring_next(&reader, &record);
+ *          if (ret == 0) {
+ *              ggyl_ring_wait(&reader, NULL);
+ *          } else if (ret < 0) {
+ *              // Events were missed, rescan
+ *          } else {
+ *              char path[4096];
+ *              ggyl_ring_path(&reader, record.path, path, sizeof(path));
+ *          }
+ *      }
+ */
+
+#define GGYL_RING_MAGIC "GGYLRING"
+#define GGYL_RING_VERSION 1
+#define GGYL_RING_NO_PATH UINT32_MAX // The path didn't fit in the path table
+
+// Kinds of changes, the same bits as the change batches of ggyl
+#define GGYL_RING_CREATED 1
+#define GGYL_RING_MODIFIED 2
+#define GGYL_RING_DELETED 4
+#define GGYL_RING_DIR 8
+
+// Header at the start of the mapping, the tables follow at their offsets
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity; // Records in the ring, a power of two
+    uint64_t instance; // Changes every time ggyl starts
+    uint64_t records_offset;
+    uint64_t paths_offset;
+    uint64_t strings_offset;
+    uint32_t paths_capacity;
+    uint32_t strings_capacity;
+
+    // Written by ggyl, on their own cache line
+    _Alignas(64) _Atomic uint64_t head; // Records published so far
+    _Atomic uint32_t num_paths;         // Paths copied into the path table
+    _Atomic uint32_t wake_seq;          // Futex word, bumped on every wake
+
+    // Written by consumers
+    _Alignas(64) _Atomic uint32_t waiters;
+} ggyl_ring_header;
+
+// An event in the ring
+// seq is the position of the record + 1, and is cleared while the record is
+// being written, so a reader can tell when it was overwritten under it.
+typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t clock; // Logical clock of the change, see "ggyl since"
+    uint32_t kind;
+    uint32_t path; // Index into the path table
+} ggyl_ring_record;
+
+// A path in the path table, the root has the parent GGYL_RING_NO_PATH
+typedef struct {
+    uint32_t parent;
+    uint32_t name; // Offset of the name in the string table
+} ggyl_ring_entry;
+
+// A consumer's view of the ring
+typedef struct {
+    ggyl_ring_header *header;
+    const ggyl_ring_record *records;
+    const ggyl_ring_entry *paths;
+    const char *strings;
+    size_t size;
+    uint64_t tail; // Position of the next record to read
+} ggyl_ring_reader;
+
+// Map the ring published by ggyl, reading starts at the next event
+// Returns 0 on success, -1 if the file isn't a ring
+static inline int ggyl_ring_open(ggyl_ring_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(ggyl_ring_reader));
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(ggyl_ring_header)) {
+        close(fd);
+        return -1;
+    }
+
+    // Consumers only ever write the waiter count
+    void *map =
+        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    ggyl_ring_header *header = (ggyl_ring_header *)map;
+    if (memcmp(header->magic, GGYL_RING_MAGIC, 8) != 0 ||
+        header->version != GGYL_RING_VERSION) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    reader->header = header;
+    reader->records =
+        (const ggyl_ring_record *)((char *)map + header->records_offset);
+    reader->paths =
+        (const ggyl_ring_entry *)((char *)map + header->paths_offset);
+    reader->strings = (const char *)map + header->strings_offset;
+    reader->size = st.st_size;
+    reader->tail = atomic_load(&header->head);
+    return 0;
+}
+
+// Unmap the ring
+static inline void ggyl_ring_close(ggyl_ring_reader *reader) {
+    if (reader->header != NULL) {
+        munmap(reader->header, reader->size);
+    }
+    memset(reader, 0, sizeof(ggyl_ring_reader));
+}
+
+// Read the next record
+// Returns 1 if a record was read, 0 if there is none yet, and -1 if the
+// reader fell behind and missed events. Reading continues at the oldest
+// record still in the ring after a miss.
+static inline int ggyl_ring_next(ggyl_ring_reader *reader,
+                                 ggyl_ring_record *record) {
+    ggyl_ring_header *header = reader->header;
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    if (reader->tail == head) {
+        return 0;
+    }
+    if (head - reader->tail > header->capacity) {
+        reader->tail = head - header->capacity;
+        return -1;
+    }
+
+    // Copy the record and check it wasn't overwritten while we did
+    const ggyl_ring_record *slot =
+        &reader->records[reader->tail & (header->capacity - 1)];
+    uint64_t seq = atomic_load_explicit(
+        (_Atomic uint64_t *)&slot->seq, memory_order_acquire);
+    record->clock = slot->clock;
+    record->kind = slot->kind;
+    record->path = slot->path;
+    atomic_thread_fence(memory_order_acquire);
+    if (seq != reader->tail + 1 ||
+        atomic_load_explicit((_Atomic uint64_t *)&slot->seq,
+                             memory_order_relaxed) != seq) {
+        head = atomic_load(&header->head);
+        reader->tail = head > header->capacity ? head - header->capacity : 0;
+        return -1;
+    }
+    atomic_store_explicit(&record->seq, seq, memory_order_relaxed);
+    reader->tail++;
+    return 1;
+}
+
+// Wait until records are published, or until the timeout passes
+// Returns 0 once there is something to read, -1 on timeout or signals
+static inline int ggyl_ring_wait(ggyl_ring_reader *reader,
+                                 const struct timespec *timeout) {
+    ggyl_ring_header *header = reader->header;
+    uint32_t seq = atomic_load(&header->wake_seq);
+    if (atomic_load(&header->head) != reader->tail) {
+        return 0;
+    }
+    atomic_fetch_add(&header->waiters, 1);
+    syscall(SYS_futex, &header->wake_seq, FUTEX_WAIT, seq, timeout, NULL, 0);
+    atomic_fetch_sub(&header->waiters, 1);
+    return atomic_load(&header->head) != reader->tail ? 0 : -1;
+}
+
+// Build the path of a record, starting with the directory ggyl monitors
+// Returns the length of the path, -1 if it isn't known
+static inline int ggyl_ring_path(ggyl_ring_reader *reader, uint32_t path,
+                                 char *buf, int size) {
+    uint32_t num_paths = atomic_load_explicit(&reader->header->num_paths,
+                                              memory_order_acquire);
+    if (path >= num_paths || size <= 0) {
+        return -1;
+    }
+
+    // Walk up to the root, then copy the names back down
+    uint32_t chain[256];
+    int depth = 0;
+    for (uint32_t p = path; p != GGYL_RING_NO_PATH && depth < 256;
+         p = reader->paths[p].parent) {
+        chain[depth++] = p;
+    }
+    int len = 0;
+    for (int i = depth - 1; i >= 0; i--) {
+        const char *name = reader->strings + reader->paths[chain[i]].name;
+        int n = (int)strlen(name);
+        if (len + n + 2 > size) {
+            return -1;
+        }
+        if (i != depth - 1) {
+            buf[len++] = '/';
+        }
+        memcpy(buf + len, name, n);
+        len += n;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+#endif
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int __xstat(int ver, const char *path, struct stat *buf);
+int __lxstat(int ver, const char *path, struct stat *buf);
+int __fxstatat(int ver, int dir_fd, const char *path, struct stat *buf,
+               int flags);
+int __xstat64(int ver, const char *path, struct stat64 *buf);
+int __lxstat64(int ver, const char *path, struct stat64 *buf);
+int __fxstatat64(int ver, int dir_fd, const char *path, struct stat64 *buf,
+                 int flags);
+
+/*
+ *  libggyl_trace.so, the LD_PRELOAD shim behind ggyl --trace.
+ *
+ *  Every file the command and its children open for reading is appended to
+ *  the file named by GGYL_TRACE, one absolute path per line, resolved
+ *  through /proc/self/fd so relative paths, openat() and symlinks all come
+ *  out the same. Regular files looked up with stat() and its relatives are
+ *  appended too, resolved with realpath(), since make only stats what it
+ *  doesn't have to rebuild. Lines are written with one write() to a file
+ *  opened with O_APPEND, so processes tracing at once never tear each
+ *  other's lines.
+ *
+ *  Only dynamically linked programs are traced, which covers compilers,
+ *  make and shells but not statically linked binaries. Without GGYL_TRACE
+ *  the shim only forwards the calls.
+ */
+
+static int trace_fd = -1;
+static __thread int resolving; // realpath() may stat through the shim
+
+// Get the next definition of a function, the one the shim stands in for
+static void *real_function(const char *name) {
+    void *fn = dlsym(RTLD_NEXT, name);
+    if (fn == NULL) {
+        fprintf(stderr, "libggyl_trace: %s not found\n", name);
+        abort();
+    }
+    return fn;
+}
+
+// Open the trace on first use
+// Returns its descriptor, -2 without GGYL_TRACE
+static int open_trace() {
+    if (trace_fd < 0) {
+        const char *path = getenv("GGYL_TRACE");
+        static int (*real_open)(const char *, int, ...);
+        if (real_open == NULL) {
+            real_open = real_function("open");
+        }
+        trace_fd = path != NULL ? real_open(path, O_WRONLY | O_APPEND |
+                                                      O_CLOEXEC)
+                                : -2;
+    }
+    return trace_fd;
+}
+
+// Append the file behind a descriptor to the trace if it was opened for
+// reading and is a regular file, errno is left alone
+static void trace_open(int fd, int flags) {
+    if (fd < 0 || (flags & O_ACCMODE) != O_RDONLY) {
+        return;
+    }
+    int saved_errno = errno;
+    struct stat st;
+    if (open_trace() >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        char link[64], line[PATH_MAX + 1];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        ssize_t len = readlink(link, line, PATH_MAX);
+        if (len > 0 && line[0] == '/') {
+            line[len++] = '\n';
+            write(trace_fd, line, len);
+        }
+    }
+    errno = saved_errno;
+}
+
+// Append a file looked up by path relative to dir_fd to the trace if it is
+// a regular file, errno is left alone
+static void trace_lookup(int dir_fd, const char *path, mode_t mode) {
+    if (!S_ISREG(mode) || path[0] == '\0' || resolving) {
+        return;
+    }
+    int saved_errno = errno;
+    resolving = 1;
+    char full[PATH_MAX], line[PATH_MAX + 1];
+    size_t len = 0;
+    if (path[0] != '/' && dir_fd == AT_FDCWD) {
+        len = getcwd(full, sizeof(full)) != NULL ? strlen(full) : 0;
+    } else if (path[0] != '/') {
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+        ssize_t n = readlink(link, full, sizeof(full));
+        len = n > 0 && n < (ssize_t)sizeof(full) ? n : 0;
+    }
+    int ok = path[0] == '/' || len > 0;
+    if (ok && len + 1 + strlen(path) < sizeof(full)) {
+        snprintf(full + len, sizeof(full) - len, "%s%s",
+                 path[0] == '/' ? "" : "/", path);
+        if (open_trace() >= 0 && realpath(full, line) != NULL) {
+            len = strlen(line);
+            line[len++] = '\n';
+            write(trace_fd, line, len);
+        }
+    }
+    resolving = 0;
+    errno = saved_errno;
+}
+
+// Get the mode argument of an open, only passed when a file may be created
+#define OPEN_MODE(flags, last)                                                \
+    mode_t mode = 0;                                                          \
+    if ((flags) & (O_CREAT | O_TMPFILE)) {                                    \
+        va_list args;                                                         \
+        va_start(args, last);                                                 \
+        mode = va_arg(args, mode_t);                                          \
+        va_end(args);                                                         \
+    }
+
+int open(const char *path, int flags, ...) {
+    static int (*real)(const char *, int, ...);
+    if (real == NULL) {
+        real = real_function("open");
+    }
+    OPEN_MODE(flags, flags);
+    int fd = real(path, flags, mode);
+    trace_open(fd, flags);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...) {
+    static int (*real)(const char *, int, ...);
+    if (real == NULL) {
+        real = real_function("open64");
+    }
+    OPEN_MODE(flags, flags);
+    int fd = real(path, flags, mode);
+    trace_open(fd, flags);
+    return fd;
+}
+
+int openat(int dir_fd, const char *path, int flags, ...) {
+    static int (*real)(int, const char *, int, ...);
+    if (real == NULL) {
+        real = real_function("openat");
+    }
+    OPEN_MODE(flags, flags);
+    int fd = real(dir_fd, path, flags, mode);
+    trace_open(fd, flags);
+    return fd;
+}
+
+int openat64(int dir_fd, const char *path, int flags, ...) {
+    static int (*real)(int, const char *, int, ...);
+    if (real == NULL) {
+        real = real_function("openat64");
+    }
+    OPEN_MODE(flags, flags);
+    int fd = real(dir_fd, path, flags, mode);
+    trace_open(fd, flags);
+    return fd;
+}
+
+// What open() compiles to with _FORTIFY_SOURCE
+int __open_2(const char *path, int flags) {
+    static int (*real)(const char *, int);
+    if (real == NULL) {
+        real = real_function("__open_2");
+    }
+    int fd = real(path, flags);
+    trace_open(fd, flags);
+    return fd;
+}
+
+int __open64_2(const char *path, int flags) {
+    static int (*real)(const char *, int);
+    if (real == NULL) {
+        real = real_function("__open64_2");
+    }
+    int fd = real(path, flags);
+    trace_open(fd, flags);
+    return fd;
+}
+
+int __openat_2(int dir_fd, const char *path, int flags) {
+    static int (*real)(int, const char *, int);
+    if (real == NULL) {
+        real = real_function("__openat_2");
+    }
+    int fd = real(dir_fd, path, flags);
+    trace_open(fd, flags);
+    return fd;
+}
+
+int __openat64_2(int dir_fd, const char *path, int flags) {
+    static int (*real)(int, const char *, int);
+    if (real == NULL) {
+        real = real_function("__openat64_2");
+    }
+    int fd = real(dir_fd, path, flags);
+    trace_open(fd, flags);
+    return fd;
+}
+
+// stdio opens files inside libc, where open() isn't interposed
+FILE *fopen(const char *path, const char *mode) {
+    static FILE *(*real)(const char *, const char *);
+    if (real == NULL) {
+        real = real_function("fopen");
+    }
+    FILE *file = real(path, mode);
+    if (file != NULL && mode[0] == 'r' && strchr(mode, '+') == NULL) {
+        trace_open(fileno(file), O_RDONLY);
+    }
+    return file;
+}
+
+FILE *fopen64(const char *path, const char *mode) {
+    static FILE *(*real)(const char *, const char *);
+    if (real == NULL) {
+        real = real_function("fopen64");
+    }
+    FILE *file = real(path, mode);
+    if (file != NULL && mode[0] == 'r' && strchr(mode, '+') == NULL) {
+        trace_open(fileno(file), O_RDONLY);
+    }
+    return file;
+}
+
+int stat(const char *path, struct stat *buf) {
+    static int (*real)(const char *, struct stat *);
+    if (real == NULL) {
+        real = real_function("stat");
+    }
+    int result = real(path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int stat64(const char *path, struct stat64 *buf) {
+    static int (*real)(const char *, struct stat64 *);
+    if (real == NULL) {
+        real = real_function("stat64");
+    }
+    int result = real(path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int lstat(const char *path, struct stat *buf) {
+    static int (*real)(const char *, struct stat *);
+    if (real == NULL) {
+        real = real_function("lstat");
+    }
+    int result = real(path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int lstat64(const char *path, struct stat64 *buf) {
+    static int (*real)(const char *, struct stat64 *);
+    if (real == NULL) {
+        real = real_function("lstat64");
+    }
+    int result = real(path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int fstatat(int dir_fd, const char *path, struct stat *buf, int flags) {
+    static int (*real)(int, const char *, struct stat *, int);
+    if (real == NULL) {
+        real = real_function("fstatat");
+    }
+    int result = real(dir_fd, path, buf, flags);
+    if (result == 0) {
+        trace_lookup(dir_fd, path, buf->st_mode);
+    }
+    return result;
+}
+
+int fstatat64(int dir_fd, const char *path, struct stat64 *buf, int flags) {
+    static int (*real)(int, const char *, struct stat64 *, int);
+    if (real == NULL) {
+        real = real_function("fstatat64");
+    }
+    int result = real(dir_fd, path, buf, flags);
+    if (result == 0) {
+        trace_lookup(dir_fd, path, buf->st_mode);
+    }
+    return result;
+}
+
+int statx(int dir_fd, const char *path, int flags, unsigned int mask,
+          struct statx *buf) {
+    static int (*real)(int, const char *, int, unsigned int, struct statx *);
+    if (real == NULL) {
+        real = real_function("statx");
+    }
+    int result = real(dir_fd, path, flags, mask, buf);
+    if (result == 0 && (buf->stx_mask & STATX_TYPE)) {
+        trace_lookup(dir_fd, path, buf->stx_mode);
+    }
+    return result;
+}
+
+// What stat() and friends compile to with glibc before 2.33
+int __xstat(int ver, const char *path, struct stat *buf) {
+    static int (*real)(int, const char *, struct stat *);
+    if (real == NULL) {
+        real = real_function("__xstat");
+    }
+    int result = real(ver, path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int __lxstat(int ver, const char *path, struct stat *buf) {
+    static int (*real)(int, const char *, struct stat *);
+    if (real == NULL) {
+        real = real_function("__lxstat");
+    }
+    int result = real(ver, path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int __fxstatat(int ver, int dir_fd, const char *path, struct stat *buf,
+               int flags) {
+    static int (*real)(int, int, const char *, struct stat *, int);
+    if (real == NULL) {
+        real = real_function("__fxstatat");
+    }
+    int result = real(ver, dir_fd, path, buf, flags);
+    if (result == 0) {
+        trace_lookup(dir_fd, path, buf->st_mode);
+    }
+    return result;
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *buf) {
+    static int (*real)(int, const char *, struct stat64 *);
+    if (real == NULL) {
+        real = real_function("__xstat64");
+    }
+    int result = real(ver, path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int __lxstat64(int ver, const char *path, struct stat64 *buf) {
+    static int (*real)(int, const char *, struct stat64 *);
+    if (real == NULL) {
+        real = real_function("__lxstat64");
+    }
+    int result = real(ver, path, buf);
+    if (result == 0) {
+        trace_lookup(AT_FDCWD, path, buf->st_mode);
+    }
+    return result;
+}
+
+int __fxstatat64(int ver, int dir_fd, const char *path, struct stat64 *buf,
+                 int flags) {
+    static int (*real)(int, int, const char *, struct stat64 *, int);
+    if (real == NULL) {
+        real = real_function("__fxstatat64");
+    }
+    int result = real(ver, dir_fd, path, buf, flags);
+    if (result == 0) {
+        trace_lookup(dir_fd, path, buf->st_mode);
+    }
+    return result;
+}
@@ -0,0 +1,4246 @@
+#define _GNU_SOURCE
+#include "libggyl_internal.h"
+#include "ggyl_glob.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+static void expand_watch(monitor_t *mon, int32_t row, int eager_limit);
+static uint32_t intern_path(path_store *store, uint32_t parent,
+                            const char *name);
+static void expand_watch_from_snapshot(monitor_t *mon, int32_t row,
+                                       int eager_limit);
+static int find_snapshot_child(snapshot_t *snap, int index, const char *name);
+static int at_max_depth(monitor_t *mon, int depth);
+static void end_request(monitor_t *mon, int i);
+static void send_reply(monitor_t *mon, int i);
+static uint64_t match_subscribers(subscriptions *subs, const char *name);
+static void notify_subscribers(monitor_t *mon, uint64_t clients,
+                               uint32_t path, uint32_t kind, uint64_t clock);
+static void add_subscriber(monitor_t *mon, int fd, char *args);
+static void remove_subscriber(monitor_t *mon, int i);
+static void flush_subscribers(monitor_t *mon);
+static long next_due(monitor_t *mon);
+static void add_poll_fd(monitor_t *mon, int fd, uint32_t tag);
+static void flush_due(monitor_t *mon);
+static size_t dir_table_bytes(dir_table *table);
+
+// Tell the host about an error the watcher works around, errno is kept
+static void log_error(monitor_t *mon, const char *format, ...) {
+    if (mon->log == NULL) {
+        return;
+    }
+    int saved_errno = errno;
+    char message[MAX_LEN * 2];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    mon->log(message, mon->log_arg);
+    errno = saved_errno;
+}
+
+// Compile regex patterns and store them in the regex_entries array
+// Invalid patterns are reported and left out.
+// Returns 0 on success, -1 if the pattern couldn't be allocated
+static int compile_patterns(monitor_t *mon, const char *glob) {
+    if (mon->num_patterns >= MAX_REGEX) {
+        log_error(mon, "Too many regex patterns, max is %d", MAX_REGEX);
+        return 0;
+    }
+    if (strlen(glob) >= MAX_LEN) {
+        log_error(mon, "Pattern too long, max is %d characters", MAX_LEN - 1);
+        return 0;
+    }
+
+    // Allocate memory for the regex entry
+    regex_entry *regex_entry_elem =
+        (regex_entry *)calloc(1, sizeof(regex_entry));
+    if (regex_entry_elem == NULL) {
+        return -1;
+    }
+
+    // Plain globs are matched as they are, which never allocates
+    if (is_plain_glob(glob)) {
+        regex_entry_elem->glob = strdup(glob);
+        if (regex_entry_elem->glob == NULL) {
+            free(regex_entry_elem);
+            return -1;
+        }
+        regex_entry_elem->compiled = 1;
+        mon->regex_entries[mon->num_patterns++] = regex_entry_elem;
+        return 0;
+    }
+
+    // Convert glob pattern to regex pattern, every character may take two
+    // plus the anchors
+    char regex[MAX_LEN * 2 + 3];
+    glob_to_regex(glob, regex);
+
+    // Allocate memory for the regex program
+    regex_t *regex_data = (regex_t *)malloc(sizeof(regex_t));
+    if (regex_data == NULL) {
+        free(regex_entry_elem);
+        return -1;
+    }
+
+    // Compile the regex pattern and store it in the regex_entries array
+    if (regcomp(regex_data, regex, REG_EXTENDED | REG_NOSUB) != 0) {
+        log_error(mon, "Failed to compile regex %s", glob);
+        free(regex_entry_elem);
+        free(regex_data);
+    } else {
+        regex_entry_elem->compiled = 1;
+        regex_entry_elem->regex = regex_data;
+        mon->regex_entries[mon->num_patterns++] = regex_entry_elem;
+    }
+    return 0;
+}
+
+// Check if a filename matches any of the compiled regex patterns
+static int check_patterns(monitor_t *mon, char *filename) {
+    for (int i = 0; i < mon->num_patterns; i++) {
+        regex_entry *entry = mon->regex_entries[i];
+        if (entry->glob != NULL ? match_name(entry->glob, filename)
+                                : entry->compiled &&
+                                      regexec(entry->regex, filename, 0, NULL,
+                                              0) == 0) {
+            return 1; // Match
+        }
+    }
+
+    // No patterns, match everything
+    if (mon->num_patterns == 0) {
+        return 1;
+    }
+
+    return 0; // No match
+}
+
+// Free the regex entries of the monitor
+static void free_regex_entries(monitor_t *mon) {
+    for (int i = 0; i < mon->num_patterns; i++) {
+        // Find compiled regex patterns and free them
+        if (mon->regex_entries[i]->regex != NULL) {
+            regfree(mon->regex_entries[i]->regex);
+            free(mon->regex_entries[i]->regex);
+        }
+        free(mon->regex_entries[i]->glob);
+        // Free the regex entry
+        free(mon->regex_entries[i]);
+    }
+    // Free the regex_entries array
+    free(mon->regex_entries);
+}
+
+// Start a thread with every signal blocked, signals are left to the thread
+// of the caller
+// Returns 0 on success, -1 if the thread can't be created
+static int start_thread(pthread_t *thread, void *(*run)(void *), void *arg) {
+    sigset_t signals, previous;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &previous);
+    int ret = pthread_create(thread, NULL, run, arg);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+/* ------------------------- Interned Path Store ------------------------- */
+
+// FNV-1a hash of a string
+static uint32_t hash_str(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    }
+    return hash;
+}
+
+// Hash of a (parent, name) pair
+static uint32_t hash_path(uint32_t parent, uint32_t name) {
+    return (parent * 2654435761u) ^ (name * 2246822519u);
+}
+
+// Initialize a path store with the root path as ROOT_PATH
+static void init_path_store(path_store *store, const char *root) {
+    memset(store, 0, sizeof(path_store));
+    intern_path(store, NO_PATH, root);
+}
+
+// Free everything owned by a path store
+static void free_path_store(path_store *store) {
+    free(store->names);
+    free(store->name_slots);
+    free(store->paths);
+    free(store->path_slots);
+    memset(store, 0, sizeof(path_store));
+}
+
+// Find the slot of a name, the slot is empty if the name isn't interned
+static uint32_t find_name_slot(path_store *store, const char *name) {
+    uint32_t mask = store->num_name_slots - 1;
+    uint32_t slot = hash_str(name) & mask;
+    while (store->name_slots[slot] &&
+           strcmp(store->names + store->name_slots[slot] - 1, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Add a name to the name arena if it isn't already there
+// Returns the offset of the name
+static uint32_t intern_name(path_store *store, const char *name) {
+    // Keep the table at most half full
+    if ((store->num_names + 1) * 2 > store->num_name_slots) {
+        uint32_t *old_slots = store->name_slots;
+        uint32_t old_num = store->num_name_slots;
+        store->num_name_slots = old_num ? old_num * 2 : 1024;
+        store->name_slots =
+            (uint32_t *)calloc(store->num_name_slots, sizeof(uint32_t));
+        for (uint32_t i = 0; i < old_num; i++) {
+            if (old_slots[i]) {
+                uint32_t slot =
+                    find_name_slot(store, store->names + old_slots[i] - 1);
+                store->name_slots[slot] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    uint32_t slot = find_name_slot(store, name);
+    if (store->name_slots[slot]) {
+        return store->name_slots[slot] - 1;
+    }
+
+    uint32_t len = strlen(name) + 1;
+    while (store->names_size + len > store->names_capacity) {
+        store->names_capacity =
+            store->names_capacity ? store->names_capacity * 2 : 4096;
+        store->names = (char *)realloc(store->names, store->names_capacity);
+    }
+    uint32_t offset = store->names_size;
+    memcpy(store->names + offset, name, len);
+    store->names_size += len;
+    store->name_slots[slot] = offset + 1;
+    store->num_names++;
+    return offset;
+}
+
+// Find the slot of a (parent, name) pair, the slot is empty if the path isn't
+// interned
+static uint32_t find_path_slot(path_store *store, uint32_t parent,
+                               uint32_t name) {
+    uint32_t mask = store->num_path_slots - 1;
+    uint32_t slot = hash_path(parent, name) & mask;
+    while (store->path_slots[slot]) {
+        path_entry *entry = &store->paths[store->path_slots[slot] - 1];
+        if (entry->parent == parent && entry->name == name) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Get the ID of the path name below parent, interning it if it's new
+static uint32_t intern_path(path_store *store, uint32_t parent,
+                            const char *name) {
+    uint32_t name_offset = intern_name(store, name);
+
+    // Keep the table at most half full
+    if ((store->num_paths + 1) * 2 > store->num_path_slots) {
+        free(store->path_slots);
+        store->num_path_slots =
+            store->num_path_slots ? store->num_path_slots * 2 : 1024;
+        store->path_slots =
+            (uint32_t *)calloc(store->num_path_slots, sizeof(uint32_t));
+        for (uint32_t id = 0; id < store->num_paths; id++) {
+            uint32_t slot = find_path_slot(store, store->paths[id].parent,
+                                           store->paths[id].name);
+            store->path_slots[slot] = id + 1;
+        }
+    }
+
+    uint32_t slot = find_path_slot(store, parent, name_offset);
+    if (store->path_slots[slot]) {
+        return store->path_slots[slot] - 1;
+    }
+
+    if (store->num_paths == store->paths_capacity) {
+        store->paths_capacity =
+            store->paths_capacity ? store->paths_capacity * 2 : 1024;
+        store->paths = (path_entry *)realloc(
+            store->paths, store->paths_capacity * sizeof(path_entry));
+    }
+    uint32_t id = store->num_paths++;
+    store->paths[id].parent = parent;
+    store->paths[id].name = name_offset;
+    store->path_slots[slot] = id + 1;
+    return id;
+}
+
+// Get the ID of the path name below parent without interning it
+// Returns NO_PATH if the path was never interned
+static uint32_t find_path(path_store *store, uint32_t parent,
+                          const char *name) {
+    if (store->num_name_slots == 0) {
+        return NO_PATH;
+    }
+    uint32_t slot = find_name_slot(store, name);
+    if (!store->name_slots[slot]) {
+        return NO_PATH;
+    }
+    slot = find_path_slot(store, parent, store->name_slots[slot] - 1);
+    return store->path_slots[slot] ? store->path_slots[slot] - 1 : NO_PATH;
+}
+
+// Get the last component of a path
+static const char *path_name(path_store *store, uint32_t id) {
+    return store->names + store->paths[id].name;
+}
+
+// Build the full path string of a path ID by walking up to the root
+// Returns the length of the path
+static int path_string(path_store *store, uint32_t id, char *buf, int size) {
+    int len = 0;
+    if (store->paths[id].parent != NO_PATH) {
+        len = path_string(store, store->paths[id].parent, buf, size);
+        if (len < size - 1) {
+            buf[len++] = '/';
+            buf[len] = '\0';
+        }
+    }
+    len += snprintf(buf + len, size - len, "%s", path_name(store, id));
+    return len < size ? len : size - 1;
+}
+
+// Bytes held by the path store
+static size_t path_store_bytes(path_store *store) {
+    return store->names_capacity +
+           store->num_name_slots * sizeof(uint32_t) +
+           store->paths_capacity * sizeof(path_entry) +
+           store->num_path_slots * sizeof(uint32_t);
+}
+
+/* --------------------------- Change Batches --------------------------- */
+
+// Add a change to the batch, or merge it into the path's earlier change
+// Returns 1 if it was merged
+static int add_change(change_batch *batch, uint32_t path, uint32_t kind,
+                      uint64_t clock) {
+    batch->clock = clock;
+    if (path >= batch->num_batch_slots) {
+        uint32_t num = batch->num_batch_slots ? batch->num_batch_slots : 1024;
+        while (num <= path) {
+            num *= 2;
+        }
+        batch->batch_slots = (uint32_t *)realloc(batch->batch_slots,
+                                                 num * sizeof(uint32_t));
+        memset(batch->batch_slots + batch->num_batch_slots, 0,
+               (num - batch->num_batch_slots) * sizeof(uint32_t));
+        batch->num_batch_slots = num;
+    }
+
+    if (batch->batch_slots[path]) {
+        batch->changes[batch->batch_slots[path] - 1].kind |= kind;
+        batch->changes[batch->batch_slots[path] - 1].clock = clock;
+        return 1;
+    }
+
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        batch->changes = (change_event *)realloc(
+            batch->changes, batch->capacity * sizeof(change_event));
+    }
+    batch->changes[batch->count].path = path;
+    batch->changes[batch->count].kind = kind;
+    batch->changes[batch->count].clock = clock;
+    batch->batch_slots[path] = ++batch->count;
+    return 0;
+}
+
+// Empty the batch, only the slots of paths in the batch are cleared
+static void clear_batch(change_batch *batch) {
+    for (uint32_t i = 0; i < batch->count; i++) {
+        batch->batch_slots[batch->changes[i].path] = 0;
+    }
+    batch->count = 0;
+}
+
+// Join the paths of a batch with newlines, leaving extra bytes free at the end
+// size is set to the length of the string
+// Returns the string, which the caller frees
+static char *batch_paths(path_store *store, change_batch *batch, size_t *size,
+                         size_t extra) {
+    size_t len = 0, capacity = MAX_LEN + extra;
+    char *paths = (char *)malloc(capacity);
+    paths[0] = '\0';
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (capacity - len < MAX_LEN + 1 + extra) {
+            capacity *= 2;
+            paths = (char *)realloc(paths, capacity);
+        }
+        if (len > 0) {
+            paths[len++] = '\n';
+        }
+        len += path_string(store, batch->changes[i].path, paths + len, MAX_LEN);
+    }
+    *size = len;
+    return paths;
+}
+
+// Set when a batch is due, delay_us after now
+static void set_due(struct timespec *due, const struct timespec *now,
+                    int delay_us) {
+    due->tv_sec = now->tv_sec + delay_us / 1000000;
+    due->tv_nsec = now->tv_nsec + (long)(delay_us % 1000000) * 1000;
+    if (due->tv_nsec >= 1000000000) {
+        due->tv_sec++;
+        due->tv_nsec -= 1000000000;
+    }
+}
+
+// Get the microseconds from now until due, negative once it has passed
+static long usec_until(const struct timespec *due, const struct timespec *now) {
+    return (due->tv_sec - now->tv_sec) * 1000000 +
+           (due->tv_nsec - now->tv_nsec) / 1000;
+}
+
+// Free everything owned by a batch
+static void free_batch(change_batch *batch) {
+    free(batch->changes);
+    free(batch->batch_slots);
+    memset(batch, 0, sizeof(change_batch));
+}
+
+// Get the change kind of an inotify event mask
+static uint32_t change_kind(uint32_t mask) {
+    uint32_t kind = 0;
+    if (mask & (IN_CREATE | IN_MOVED_TO))
+        kind |= CHANGE_CREATED;
+    if (mask & IN_MODIFY)
+        kind |= CHANGE_MODIFIED;
+    if (mask & (IN_DELETE | IN_MOVED_FROM))
+        kind |= CHANGE_DELETED;
+    if (mask & IN_ISDIR)
+        kind |= CHANGE_DIR;
+    return kind;
+}
+
+/* -------------------------- Latency Histograms -------------------------- */
+
+static const char *stage_names[GGYL_NUM_STAGES] = {
+    "read->match", "match->coalesce", "debounce", "spawn", "command"};
+
+// Get a time in nanoseconds
+static uint64_t timespec_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Get the monotonic time in nanoseconds
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_ns(&ts);
+}
+
+// Get the bucket of a latency
+static int latency_bucket(uint64_t ns) {
+    int shift = 63 - __builtin_clzll(ns | 1) - LATENCY_SUB_BITS;
+    shift = shift > 0 ? shift : 0;
+    return shift * LATENCY_SUB_BUCKETS + (int)(ns >> shift);
+}
+
+// Get the highest latency that falls into a bucket
+static uint64_t bucket_latency(int bucket) {
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    shift = shift > 0 ? shift : 0;
+    uint64_t low = (uint64_t)(bucket - shift * LATENCY_SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+// Add a latency to a histogram
+static void add_latency(latency_histogram *hist, uint64_t ns) {
+    hist->buckets[latency_bucket(ns)]++;
+    hist->count++;
+    hist->max = ns > hist->max ? ns : hist->max;
+}
+
+// Get the latency that a fraction of the histogram is at or below
+static uint64_t latency_at(latency_histogram *hist, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * hist->count + 0.5);
+    rank = rank > 0 ? rank : 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t ns = bucket_latency(i);
+            return ns < hist->max ? ns : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// Format a latency with a unit that keeps it short
+static void format_latency(uint64_t ns, char *buf, int size) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+}
+
+/* -------------------------------- Metrics ------------------------------- */
+
+static const metric_info counter_metrics[NUM_COUNTERS] = {
+    {"ggyl_events_read", "Inotify events read, or played from a replay log."},
+    {"ggyl_events_matched",
+     "Events that changed something the command or a client sees."},
+    {"ggyl_events_dropped",
+     "Events nobody wanted, for unwatched directories or unmatched names."},
+    {"ggyl_changes_coalesced",
+     "Changes merged into an earlier change to the same path in a batch."},
+    {"ggyl_overflows", "Times the kernel dropped events and the tree was "
+                       "rescanned."},
+    {"ggyl_batches", "Batches delivered to the callback."},
+    {"ggyl_runs", "Runs of the command."},
+    {"ggyl_runs_failed", "Runs of the command that failed or exited with an "
+                         "error."},
+    {"ggyl_requests", "Requests answered on the control socket."},
+    {"ggyl_dirs_validated", "Snapshot directories checked against the "
+                            "disk."}};
+
+// Count n on a counter of the calling thread's block
+static void add_count(counter_block *block, int counter, uint64_t n) {
+    uint64_t value =
+        atomic_load_explicit(&block->values[counter], memory_order_relaxed);
+    atomic_store_explicit(&block->values[counter], value + n,
+                          memory_order_relaxed);
+}
+
+// Add up a counter over the blocks of every thread
+static uint64_t sum_counter(monitor_t *mon, int counter) {
+    uint64_t sum = 0;
+    for (int i = 0; i < COUNTER_BLOCKS; i++) {
+        sum += atomic_load_explicit(&mon->counters[i].values[counter],
+                                    memory_order_relaxed);
+    }
+    return sum;
+}
+
+// Write the metadata of a metric family
+static void write_metric_family(FILE *out, const char *name, const char *type,
+                                const char *unit, const char *help) {
+    fprintf(out, "# TYPE %s %s\n", name, type);
+    if (unit != NULL) {
+        fprintf(out, "# UNIT %s %s\n", name, unit);
+    }
+    fprintf(out, "# HELP %s %s\n", name, help);
+}
+
+// Write a gauge with a single value
+static void write_gauge(FILE *out, const char *name, const char *unit,
+                        const char *help, uint64_t value) {
+    write_metric_family(out, name, "gauge", unit, help);
+    fprintf(out, "%s %llu\n", name, (unsigned long long)value);
+}
+
+// Get the heap memory held by a batch and the lookup of its paths
+static size_t batch_bytes(change_batch *batch) {
+    return batch->capacity * sizeof(change_event) +
+           batch->num_batch_slots * sizeof(uint32_t);
+}
+
+// Write every counter and gauge in the OpenMetrics text format
+static void write_metrics(monitor_t *mon, FILE *out) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        write_metric_family(out, counter_metrics[i].name, "counter", NULL,
+                            counter_metrics[i].help);
+        fprintf(out, "%s_total %llu\n", counter_metrics[i].name,
+                (unsigned long long)sum_counter(mon, i));
+    }
+
+    // Listings are only read for snapshots and queries
+    dir_table *table = &mon->dirs;
+    uint64_t indexed = 0;
+    for (int32_t i = 0; i < table->num_dirs; i++) {
+        indexed += (table->dirs[i].flags & (DIR_LISTED | DIR_FREE)) ==
+                   DIR_LISTED;
+    }
+    write_gauge(out, "ggyl_watches", NULL, "Directories being watched.",
+                table->count);
+    write_gauge(out, "ggyl_directories_indexed", NULL,
+                "Watched directories with their files listed in memory.",
+                indexed);
+    write_gauge(out, "ggyl_paths", NULL, "Paths interned so far.",
+                mon->paths.num_paths);
+
+    // Queues between the kernel and whoever waits for changes
+    uint64_t queued = 0;
+    for (int i = 0; i < mon->num_shards; i++) {
+        int bytes = 0;
+        if (mon->fds[i] >= 0 && ioctl(mon->fds[i], FIONREAD, &bytes) == 0) {
+            queued += bytes;
+        }
+    }
+    uint64_t subscriber_pending = 0;
+    size_t subscriber_bytes =
+        mon->subs.capacity * sizeof(shared_pattern);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        subscriber_pending += mon->subs.clients[i].batch.count;
+        subscriber_bytes += batch_bytes(&mon->subs.clients[i].batch);
+    }
+    uint64_t reads = 0;
+    for (int i = 0; mon->pipeline != NULL && i < mon->pipeline->num_readers;
+         i++) {
+        shard_reader *reader = &mon->pipeline->readers[i];
+        reads += atomic_load(&reader->head) - atomic_load(&reader->tail);
+    }
+    write_gauge(out, "ggyl_inotify_queued_bytes", "bytes",
+                "Events waiting to be read from inotify.", queued);
+    write_gauge(out, "ggyl_pipeline_reads", NULL,
+                "Reads of the reader thread waiting to be handled.", reads);
+    write_gauge(out, "ggyl_batch_pending", NULL,
+                "Changes waiting for the debounce delay.", mon->batch.count);
+    write_gauge(out, "ggyl_subscriber_pending", NULL,
+                "Changes waiting to be sent to subscribers.",
+                subscriber_pending);
+    write_gauge(out, "ggyl_subscribers", NULL, "Connected subscribers.",
+                __builtin_popcountll(mon->subs.active));
+    write_gauge(out, "ggyl_journal_entries", NULL,
+                "Changes kept for since queries.", mon->journal.count);
+
+    // Heap memory, and the shared mapping of the ring
+    struct {
+        const char *subsystem;
+        size_t bytes;
+    } memory[] = {
+        {"watch_table", dir_table_bytes(table)},
+        {"paths", path_store_bytes(&mon->paths)},
+        {"batch", batch_bytes(&mon->batch) +
+                      mon->batch_view_capacity * sizeof(ggyl_change) +
+                      mon->batch_strings_capacity},
+        {"journal", mon->journal.capacity * sizeof(journal_entry)},
+        {"subscriptions", subscriber_bytes},
+        {"ring", mon->ring != NULL ? mon->ring->size : 0},
+        {"event_log", mon->record_capacity},
+        {"pipeline", mon->pipeline != NULL
+                         ? sizeof(pipeline) +
+                               mon->pipeline->num_readers * PIPELINE_SLOTS *
+                                   sizeof(pipeline_read) +
+                               PIPELINE_MAX_EVENTS *
+                                   (sizeof(struct inotify_event *) +
+                                    sizeof(event_match))
+                         : 0},
+        {"latency", mon->latency != NULL
+                        ? GGYL_NUM_STAGES * sizeof(latency_histogram)
+                        : 0}};
+    write_metric_family(out, "ggyl_memory_bytes", "gauge", "bytes",
+                        "Memory held by each subsystem.");
+    for (size_t i = 0; i < sizeof(memory) / sizeof(memory[0]); i++) {
+        fprintf(out, "ggyl_memory_bytes{subsystem=\"%s\"} %zu\n",
+                memory[i].subsystem, memory[i].bytes);
+    }
+    fprintf(out, "# EOF\n");
+}
+
+// Replace the metrics file, scrapers never see it half written
+static void write_metrics_file(monitor_t *mon) {
+    char tmp[MAX_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", mon->metrics_path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        log_error(mon, "%s: %s", tmp, strerror(errno));
+        return;
+    }
+    write_metrics(mon, out);
+    if (fclose(out) != 0 || rename(tmp, mon->metrics_path) != 0) {
+        log_error(mon, "%s: %s", mon->metrics_path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* ---------------------------- Change Journal ---------------------------- */
+
+// Initialize a journal keeping the latest capacity changes
+static void init_journal(change_journal *journal, uint32_t capacity) {
+    memset(journal, 0, sizeof(change_journal));
+    journal->capacity = capacity;
+    if (capacity > 0) {
+        journal->entries =
+            (journal_entry *)malloc(capacity * sizeof(journal_entry));
+    }
+    journal->instance = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+}
+
+// Free the entries of a journal
+static void free_journal(change_journal *journal) {
+    free(journal->entries);
+    journal->entries = NULL;
+    journal->capacity = 0;
+    journal->count = 0;
+}
+
+// Give a change the next clock and keep it in the journal, the oldest change
+// is compacted away once the journal is full
+// Returns the clock of the change
+static uint64_t record_change(change_journal *journal, uint32_t path,
+                              uint32_t kind) {
+    uint64_t clock = ++journal->clock;
+    if (journal->capacity == 0) {
+        journal->horizon = clock;
+        return clock;
+    }
+    if (journal->count == journal->capacity) {
+        journal->horizon = journal->entries[journal->head].clock;
+    } else {
+        journal->count++;
+    }
+    journal_entry *entry = &journal->entries[journal->head];
+    entry->clock = clock;
+    entry->path = path;
+    entry->kind = kind;
+    journal->head = (journal->head + 1) % journal->capacity;
+    return clock;
+}
+
+// Format a clock as "c:<instance>:<clock>"
+static void format_clock(change_journal *journal, uint64_t clock, char *buf,
+                         int size) {
+    snprintf(buf, size, "c:%llx:%llu", (unsigned long long)journal->instance,
+             (unsigned long long)clock);
+}
+
+// Parse a clock formatted by format_clock()
+// Returns 0 if the clock is malformed or from another instance
+static int parse_clock(change_journal *journal, const char *str,
+                       uint64_t *clock) {
+    unsigned long long instance, value;
+    int len = 0;
+    if (sscanf(str, "c:%llx:%llu%n", &instance, &value, &len) != 2 ||
+        str[len] != '\0' || instance != journal->instance) {
+        return 0;
+    }
+    *clock = value;
+    return 1;
+}
+
+// Changes to a path since a clock, kept while the journal is read
+typedef struct {
+    uint32_t path;
+    uint32_t first; // Kind of the first change
+    uint32_t last;  // Kind of the last change
+    uint32_t dir;
+} net_change;
+
+// Write the net changes made after a clock, one "<kind> <path>" per line
+// after a "clock <clock>" line. A path created and deleted again since is left
+// out, and one deleted and created again is modified. When the changes have
+// been compacted away, or the clock isn't one of ours, a single
+// "resync <clock>" line tells the client to start over.
+// Returns the number of changes written, -1 for a resync
+static int write_changes_since(monitor_t *mon, const char *since, FILE *out) {
+    change_journal *journal = &mon->journal;
+    char clock[64];
+    format_clock(journal, journal->clock, clock, sizeof(clock));
+
+    uint64_t from;
+    if (!parse_clock(journal, since, &from) || from < journal->horizon ||
+        from > journal->clock) {
+        fprintf(out, "resync %s\n", clock);
+        return -1;
+    }
+    fprintf(out, "clock %s\n", clock);
+
+    // The first and last kind of every path decide its net change
+    uint32_t *slots =
+        (uint32_t *)calloc(mon->paths.num_paths, sizeof(uint32_t));
+    net_change *changes = NULL;
+    uint32_t count = 0, capacity = 0;
+
+    // Clocks in the journal are consecutive, so the first change after from
+    // is found without a search
+    uint32_t skip = journal->count - (uint32_t)(journal->clock - from);
+    uint32_t start = journal->head + journal->capacity - journal->count;
+    for (uint32_t i = skip; i < journal->count; i++) {
+        journal_entry *entry =
+            &journal->entries[(start + i) % journal->capacity];
+        if (slots[entry->path] == 0) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                changes = (net_change *)realloc(changes,
+                                                capacity * sizeof(net_change));
+            }
+            changes[count].path = entry->path;
+            changes[count].first = entry->kind;
+            changes[count].dir = 0;
+            slots[entry->path] = ++count;
+        }
+        net_change *change = &changes[slots[entry->path] - 1];
+        change->last = entry->kind;
+        change->dir |= entry->kind & CHANGE_DIR;
+    }
+
+    int written = 0;
+    char buf[MAX_LEN];
+    for (uint32_t i = 0; i < count; i++) {
+        net_change *change = &changes[i];
+        const char *kind = "modified";
+        if (change->last & CHANGE_DELETED) {
+            if (change->first & CHANGE_CREATED) {
+                continue;
+            }
+            kind = "deleted";
+        } else if (change->first & CHANGE_CREATED) {
+            kind = "created";
+        }
+        path_string(&mon->paths, change->path, buf, MAX_LEN);
+        fprintf(out, "%s %s%s\n", kind, buf, change->dir ? "/" : "");
+        written++;
+    }
+    free(changes);
+    free(slots);
+    return written;
+}
+
+/* -------------------------- Shared Memory Ring -------------------------- */
+
+/*
+ * Every change is published into a ring of records in a shared file mapping
+ * for consumers on the same host, see ggyl_ring.h. The path table of the ring
+ * mirrors the path store, which only ever grows, so new paths are copied over
+ * before the first record that uses them is published.
+ */
+
+// Create the ring file and map it, an old ring is replaced so consumers still
+// mapping it never see a different run's records
+// Returns the ring, NULL with errno set if it can't be created
+static shm_ring *open_shm_ring(const char *path, uint64_t instance) {
+    size_t records_offset = 4096;
+    size_t paths_offset =
+        records_offset + RING_CAPACITY * sizeof(ggyl_ring_record);
+    size_t strings_offset =
+        paths_offset + RING_PATHS * sizeof(ggyl_ring_entry);
+    size_t size = strings_offset + RING_STRINGS;
+
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // The file is sparse, only the parts of the tables in use take memory
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(path);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    shm_ring *ring = (shm_ring *)calloc(1, sizeof(shm_ring));
+    ring->header = (ggyl_ring_header *)map;
+    ring->records = (ggyl_ring_record *)((char *)map + records_offset);
+    ring->paths = (ggyl_ring_entry *)((char *)map + paths_offset);
+    ring->strings = (char *)map + strings_offset;
+    ring->size = size;
+
+    ggyl_ring_header *header = ring->header;
+    header->version = GGYL_RING_VERSION;
+    header->capacity = RING_CAPACITY;
+    header->instance = instance;
+    header->records_offset = records_offset;
+    header->paths_offset = paths_offset;
+    header->strings_offset = strings_offset;
+    header->paths_capacity = RING_PATHS;
+    header->strings_capacity = RING_STRINGS;
+
+    // Consumers check the magic, so it goes in last
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, GGYL_RING_MAGIC, 8);
+    return ring;
+}
+
+// Copy the paths interned since the last record into the ring's path table
+static void mirror_paths(shm_ring *ring, path_store *store) {
+    ggyl_ring_header *header = ring->header;
+    uint32_t num_paths =
+        atomic_load_explicit(&header->num_paths, memory_order_relaxed);
+    if (store->num_paths == num_paths ||
+        store->names_size > header->strings_capacity) {
+        return;
+    }
+    memcpy(ring->strings + ring->strings_size,
+           store->names + ring->strings_size,
+           store->names_size - ring->strings_size);
+    ring->strings_size = store->names_size;
+
+    uint32_t end = store->num_paths < header->paths_capacity
+                       ? store->num_paths
+                       : header->paths_capacity;
+    for (uint32_t i = num_paths; i < end; i++) {
+        ring->paths[i].parent = store->paths[i].parent;
+        ring->paths[i].name = store->paths[i].name;
+    }
+    atomic_store_explicit(&header->num_paths, end, memory_order_release);
+}
+
+// Publish a change into the ring, consumers are only woken by
+// wake_ring_consumers() so a buffer of events costs at most one wakeup
+static void publish_ring_record(shm_ring *ring, path_store *store,
+                                uint64_t clock, uint32_t kind, uint32_t path) {
+    mirror_paths(ring, store);
+    ggyl_ring_header *header = ring->header;
+    if (path >= atomic_load_explicit(&header->num_paths,
+                                     memory_order_relaxed)) {
+        path = GGYL_RING_NO_PATH;
+    }
+
+    // Clear the sequence number while the record is rewritten, so readers
+    // racing with us see it was overwritten
+    uint64_t pos = atomic_load_explicit(&header->head, memory_order_relaxed);
+    ggyl_ring_record *record = &ring->records[pos & (RING_CAPACITY - 1)];
+    atomic_store_explicit(&record->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    record->clock = clock;
+    record->kind = kind;
+    record->path = path;
+    atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&header->head, pos + 1, memory_order_release);
+    ring->unwoken++;
+}
+
+// Wake the consumers waiting for records, the futex is only called when
+// somebody waits
+static void wake_ring_consumers(shm_ring *ring) {
+    if (ring->unwoken == 0) {
+        return;
+    }
+    ring->unwoken = 0;
+    atomic_fetch_add(&ring->header->wake_seq, 1);
+    if (atomic_load(&ring->header->waiters) > 0) {
+        syscall(SYS_futex, &ring->header->wake_seq, FUTEX_WAKE, INT_MAX, NULL,
+                NULL, 0);
+    }
+}
+
+// Unmap the ring
+static void close_shm_ring(shm_ring *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    munmap(ring->header, ring->size);
+    free(ring);
+}
+
+// Give a change the next clock, keep it in the journal and publish it into
+// the ring
+// Returns the clock of the change
+static uint64_t publish_change(monitor_t *mon, uint32_t path, uint32_t kind) {
+    uint64_t clock = record_change(&mon->journal, path, kind);
+    if (mon->ring != NULL) {
+        publish_ring_record(mon->ring, &mon->paths, clock, kind, path);
+    }
+    return clock;
+}
+
+/* ----------------------- Watched Directory Table ------------------------ */
+
+// Initialize an empty directory table with paths interned in store
+// File listings are only kept when keep_listings is set
+static void init_dir_table(dir_table *table, path_store *store,
+                           int keep_listings) {
+    memset(table, 0, sizeof(dir_table));
+    table->free_head = -1;
+    table->store = store;
+    table->keep_listings = keep_listings;
+}
+
+// Free the file listing of a directory
+static void free_file_listing(dir_listing *listing) {
+    free(listing->files);
+    listing->files = NULL;
+    listing->num_files = 0;
+}
+
+// Free everything owned by a directory table
+static void free_dir_table(dir_table *table) {
+    if (table->listings != NULL) {
+        for (int32_t i = 0; i < table->num_dirs; i++) {
+            free_file_listing(&table->listings[i]);
+        }
+    }
+    free(table->listings);
+    free(table->dirs);
+    free(table->wd_slots);
+    free(table->path_rows);
+    init_dir_table(table, table->store, table->keep_listings);
+}
+
+// Hash slot of a watch descriptor, the slot count is a power of two
+static uint32_t wd_slot_of(dir_table *table, int wd) {
+    return ((uint32_t)wd * 2654435761u) & (table->num_wd_slots - 1);
+}
+
+// Map a watch descriptor to a directory row
+static void set_wd_row(dir_table *table, int wd, int32_t row) {
+    // Keep the map at most half full
+    if ((table->num_wds + 1) * 2 > table->num_wd_slots) {
+        wd_slot *old_slots = table->wd_slots;
+        uint32_t old_num = table->num_wd_slots;
+        table->num_wd_slots = old_num ? old_num * 2 : 64;
+        table->wd_slots =
+            (wd_slot *)malloc(table->num_wd_slots * sizeof(wd_slot));
+        for (uint32_t i = 0; i < table->num_wd_slots; i++) {
+            table->wd_slots[i].wd = -1;
+        }
+        table->num_wds = 0;
+        for (uint32_t i = 0; i < old_num; i++) {
+            if (old_slots[i].wd >= 0) {
+                set_wd_row(table, old_slots[i].wd, old_slots[i].row);
+            }
+        }
+        free(old_slots);
+    }
+
+    uint32_t slot = wd_slot_of(table, wd);
+    while (table->wd_slots[slot].wd >= 0 && table->wd_slots[slot].wd != wd) {
+        slot = (slot + 1) & (table->num_wd_slots - 1);
+    }
+    if (table->wd_slots[slot].wd < 0) {
+        table->num_wds++;
+    }
+    table->wd_slots[slot].wd = wd;
+    table->wd_slots[slot].row = row;
+}
+
+// Find the row of the directory watched by wd, -1 if wd is not watched
+static int32_t find_wd(dir_table *table, int wd) {
+    if (table->num_wd_slots == 0) {
+        return -1;
+    }
+    uint32_t slot = wd_slot_of(table, wd);
+    while (table->wd_slots[slot].wd >= 0) {
+        if (table->wd_slots[slot].wd == wd) {
+            return table->wd_slots[slot].row;
+        }
+        slot = (slot + 1) & (table->num_wd_slots - 1);
+    }
+    return -1;
+}
+
+// Remove a watch descriptor from the map
+// Later slots of the probe run are shifted back so lookups never stop early
+static void clear_wd_row(dir_table *table, int wd) {
+    if (table->num_wd_slots == 0) {
+        return;
+    }
+    uint32_t mask = table->num_wd_slots - 1;
+    uint32_t slot = wd_slot_of(table, wd);
+    while (table->wd_slots[slot].wd != wd) {
+        if (table->wd_slots[slot].wd < 0) {
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    table->wd_slots[slot].wd = -1;
+    table->num_wds--;
+
+    uint32_t next = (slot + 1) & mask;
+    while (table->wd_slots[next].wd >= 0) {
+        uint32_t home = wd_slot_of(table, table->wd_slots[next].wd);
+        // Move the entry back if its home isn't between the hole and it
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            table->wd_slots[slot] = table->wd_slots[next];
+            table->wd_slots[next].wd = -1;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// Add a directory to the table as the first child of parent, -1 for the root
+// Rows of removed directories are reused before the table grows.
+// Returns the row of the directory
+static int32_t add_dir(dir_table *table, int32_t parent, int wd, uint32_t path,
+                       int depth) {
+    int32_t row;
+    if (table->free_head >= 0) {
+        row = table->free_head;
+        table->free_head = table->dirs[row].next_sibling;
+    } else {
+        if (table->num_dirs == table->capacity) {
+            table->capacity = table->capacity ? table->capacity * 2 : 64;
+            table->dirs = (watch_dir *)realloc(
+                table->dirs, table->capacity * sizeof(watch_dir));
+            if (table->keep_listings) {
+                table->listings = (dir_listing *)realloc(
+                    table->listings, table->capacity * sizeof(dir_listing));
+            }
+        }
+        row = table->num_dirs++;
+    }
+
+    watch_dir *dir = &table->dirs[row];
+    dir->parent = parent;
+    dir->first_child = -1;
+    dir->prev_sibling = -1;
+    dir->next_sibling = -1;
+    dir->wd = wd;
+    dir->path = path;
+    dir->snap_index = -1;
+    dir->depth = depth;
+    dir->flags = DIR_EXPANDED;
+
+    if (parent >= 0) {
+        dir->next_sibling = table->dirs[parent].first_child;
+        if (dir->next_sibling >= 0) {
+            table->dirs[dir->next_sibling].prev_sibling = row;
+        }
+        table->dirs[parent].first_child = row;
+    }
+    if (table->keep_listings) {
+        memset(&table->listings[row], 0, sizeof(dir_listing));
+    }
+
+    // Map the path ID to the row
+    if (path >= table->num_path_rows) {
+        uint32_t num = table->num_path_rows ? table->num_path_rows : 1024;
+        while (num <= path) {
+            num *= 2;
+        }
+        table->path_rows =
+            (int32_t *)realloc(table->path_rows, num * sizeof(int32_t));
+        for (uint32_t i = table->num_path_rows; i < num; i++) {
+            table->path_rows[i] = -1;
+        }
+        table->num_path_rows = num;
+    }
+    table->path_rows[path] = row;
+
+    set_wd_row(table, wd, row);
+    table->count++;
+    return row;
+}
+
+// Free the rows of a directory and everything below it
+static void free_dir_rows(dir_table *table, int32_t row) {
+    for (int32_t c = table->dirs[row].first_child; c >= 0;) {
+        int32_t next = table->dirs[c].next_sibling;
+        free_dir_rows(table, c);
+        c = next;
+    }
+    watch_dir *dir = &table->dirs[row];
+    if (find_wd(table, dir->wd) == row) {
+        clear_wd_row(table, dir->wd);
+    }
+    table->path_rows[dir->path] = -1;
+    if (table->keep_listings) {
+        free_file_listing(&table->listings[row]);
+    }
+    dir->flags = DIR_FREE;
+    dir->first_child = -1;
+    dir->next_sibling = table->free_head;
+    table->free_head = row;
+    table->count--;
+}
+
+// Remove a directory and everything below it from the table
+static void remove_dir(dir_table *table, int32_t row) {
+    watch_dir *dir = &table->dirs[row];
+    if (dir->prev_sibling >= 0) {
+        table->dirs[dir->prev_sibling].next_sibling = dir->next_sibling;
+    } else if (dir->parent >= 0) {
+        table->dirs[dir->parent].first_child = dir->next_sibling;
+    }
+    if (dir->next_sibling >= 0) {
+        table->dirs[dir->next_sibling].prev_sibling = dir->prev_sibling;
+    }
+    free_dir_rows(table, row);
+}
+
+// Get the name of a directory, the root is named after the monitored path
+static const char *dir_name(dir_table *table, int32_t row) {
+    return path_name(table->store, table->dirs[row].path);
+}
+
+// Find the row of the directory with a path ID, -1 if it isn't watched
+static int32_t find_dir(dir_table *table, uint32_t path) {
+    if (path >= table->num_path_rows) {
+        return -1;
+    }
+    return table->path_rows[path];
+}
+
+// Find a child of a directory by name, -1 if there is no such child
+// The child is looked up through the path store so wide directories don't
+// need their children scanned.
+static int32_t find_child_dir(dir_table *table, int32_t row, const char *name) {
+    uint32_t path = find_path(table->store, table->dirs[row].path, name);
+    return path == NO_PATH ? -1 : find_dir(table, path);
+}
+
+// Build the full path of a directory
+// Returns the length of the path
+static int dir_path(dir_table *table, int32_t row, char *path, int size) {
+    return path_string(table->store, table->dirs[row].path, path, size);
+}
+
+// Bytes held by the directory table, not counting file listings or paths
+static size_t dir_table_bytes(dir_table *table) {
+    size_t bytes = table->capacity * sizeof(watch_dir) +
+                   table->num_wd_slots * sizeof(wd_slot) +
+                   table->num_path_rows * sizeof(int32_t);
+    if (table->keep_listings) {
+        bytes += table->capacity * sizeof(dir_listing);
+    }
+    return bytes;
+}
+
+/* --------------------------- Subtree Queries --------------------------- */
+
+/*
+ * The path store is a trie over path components: a child is found by hashing
+ * its (parent, name) pair, and path_rows maps a path ID straight to its row.
+ * Resolving a path is one hash lookup per component, and the child and
+ * sibling links of the table then visit a subtree without touching anything
+ * outside of it, so every query here is O(depth + results).
+ */
+
+// Resolve a path relative to the monitored directory to a path ID without
+// interning anything. Empty and "." components are skipped.
+// Returns NO_PATH if the path isn't known
+static uint32_t lookup_path(path_store *store, const char *path) {
+    uint32_t id = ROOT_PATH;
+    char name[MAX_LEN];
+    while (*path) {
+        const char *end = strchr(path, '/');
+        size_t len = end != NULL ? (size_t)(end - path) : strlen(path);
+        if (len >= MAX_LEN) {
+            return NO_PATH;
+        }
+        if (len > 0 && !(len == 1 && path[0] == '.')) {
+            memcpy(name, path, len);
+            name[len] = '\0';
+            id = find_path(store, id, name);
+            if (id == NO_PATH) {
+                return NO_PATH;
+            }
+        }
+        path += end != NULL ? len + 1 : len;
+    }
+    return id;
+}
+
+// Find the deepest watched directory on a path relative to the monitored
+// directory. rest is set to the part of the path below that directory, which
+// is empty if the path itself is watched.
+// Returns the row of the directory
+static int32_t covering_dir(dir_table *table, const char *path,
+                            const char **rest) {
+    int32_t row = ROOT_DIR;
+    char name[MAX_LEN];
+    while (*path) {
+        const char *end = strchr(path, '/');
+        size_t len = end != NULL ? (size_t)(end - path) : strlen(path);
+        if (len > 0 && !(len == 1 && path[0] == '.')) {
+            if (len >= MAX_LEN) {
+                break;
+            }
+            memcpy(name, path, len);
+            name[len] = '\0';
+            int32_t child = find_child_dir(table, row, name);
+            if (child < 0) {
+                break;
+            }
+            row = child;
+        }
+        path += end != NULL ? len + 1 : len;
+    }
+    *rest = path;
+    return row;
+}
+
+// Check if events for a path are seen, which is when the path is a watched
+// directory or an entry of one
+static int is_covered(dir_table *table, const char *path) {
+    const char *rest;
+    covering_dir(table, path, &rest);
+    return strchr(rest, '/') == NULL;
+}
+
+/* ---------------------------- Watching ------------------------------- */
+
+// Check if a subdirectory of a directory should be watched, which is any of
+// them unless ggyl_watch_only() narrowed the watches
+static int is_wanted(monitor_t *mon, int32_t row, const char *name) {
+    if (mon->wanted == NULL) {
+        return 1;
+    }
+    uint32_t id = find_path(&mon->paths, mon->dirs.dirs[row].path, name);
+    return id < mon->num_wanted && mon->wanted[id];
+}
+
+// Build a tree of watched directories for the inotify events
+// Directories are watched recursively until either the --depth limit or the
+// eager limit is reached. Directories at the eager limit are left unexpanded
+// and get their subdirectories watched once activity is observed in them.
+// snap_index is the directory's record in mon->snapshot, -1 if it has none.
+// Returns the row of the watched directory, -1 if it could not be watched.
+static int32_t build_watch_tree(monitor_t *mon, const char *path,
+                                const char *name, int32_t parent, int depth,
+                                int eager_limit, int snap_index) {
+
+    // Add the watch descriptor to the directory, directories are spread
+    // over the inotify instances by path ID so a burst in one subtree fills
+    // every kernel queue instead of one
+    uint32_t parent_path =
+        parent >= 0 ? mon->dirs.dirs[parent].path : NO_PATH;
+    uint32_t path_id = intern_path(&mon->paths, parent_path, name);
+    int shard = path_id % mon->num_shards;
+    int wd = inotify_add_watch(mon->fds[shard], path, mon->mask);
+    if (wd < 0) {
+        // The root has to be watched, which ggyl_start() fails without,
+        // subdirectories may vanish before we get to them
+        if (parent >= 0) {
+            mon->failed_watches++;
+            log_error(mon, "inotify_add_watch %s: %s", path, strerror(errno));
+        }
+        return -1;
+    }
+
+    int32_t row = add_dir(&mon->dirs, parent, wd * mon->num_shards + shard,
+                          path_id, depth);
+    mon->dirs.dirs[row].snap_index = snap_index;
+
+    // Leave the subdirectories for later, this saves reading the directory
+    if (depth + 1 >= eager_limit && !at_max_depth(mon, depth)) {
+        mon->dirs.dirs[row].flags &= ~DIR_EXPANDED;
+        return row;
+    }
+
+    expand_watch(mon, row, eager_limit);
+
+    return row;
+}
+
+// Check if nothing below a directory at depth should be watched
+static int at_max_depth(monitor_t *mon, int depth) {
+    return mon->max_depth >= 0 && depth >= mon->max_depth;
+}
+
+// Compare file metadata by name for qsort_r, arg is the path store
+static int compare_file_meta(const void *a, const void *b, void *arg) {
+    path_store *store = (path_store *)arg;
+    return strcmp(store->names + ((file_meta *)a)->name,
+                  store->names + ((file_meta *)b)->name);
+}
+
+// Start a new file listing for a directory
+// The directory mtime is taken first so any change made while reading the
+// directory shows up as a changed mtime on the next start.
+static void begin_file_listing(dir_table *table, int32_t row, int dir_fd) {
+    dir_listing *listing = &table->listings[row];
+    free_file_listing(listing);
+    struct stat st;
+    if (fstat(dir_fd, &st) == 0) {
+        listing->mtime_sec = st.st_mtim.tv_sec;
+        listing->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+// Add a file to the listing of a directory
+static void add_file_listing(dir_table *table, int32_t row, int dir_fd,
+                             struct dirent *dirent, int *capacity) {
+    struct stat st;
+    if (fstatat(dir_fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return;
+    }
+    dir_listing *listing = &table->listings[row];
+    if (listing->num_files == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        listing->files =
+            (file_meta *)realloc(listing->files, *capacity * sizeof(file_meta));
+    }
+    file_meta *file = &listing->files[listing->num_files++];
+    file->name = intern_name(table->store, dirent->d_name);
+    file->type = dirent->d_type;
+    file->size = st.st_size;
+    file->mtime_sec = st.st_mtim.tv_sec;
+    file->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+// Finish a file listing by sorting the files by name
+static void end_file_listing(dir_table *table, int32_t row) {
+    dir_listing *listing = &table->listings[row];
+    qsort_r(listing->files, listing->num_files, sizeof(file_meta),
+            compare_file_meta, table->store);
+    table->dirs[row].flags |= DIR_LISTED;
+    table->dirs[row].flags &= ~DIR_DIRTY;
+}
+
+// Read the file listing of a watched directory again
+static void relist_watch(monitor_t *mon, int32_t row) {
+    char path[MAX_LEN];
+    dir_path(&mon->dirs, row, path, MAX_LEN);
+    DIR *dp = opendir(path);
+    if (dp == NULL) {
+        free_file_listing(&mon->dirs.listings[row]);
+        mon->dirs.dirs[row].flags &= ~DIR_LISTED;
+        return;
+    }
+    int capacity = 0;
+    begin_file_listing(&mon->dirs, row, dirfd(dp));
+    struct dirent *dirent;
+    while ((dirent = readdir(dp)) != NULL) {
+        if (dirent->d_type != DT_DIR) {
+            add_file_listing(&mon->dirs, row, dirfd(dp), dirent, &capacity);
+        }
+    }
+    end_file_listing(&mon->dirs, row);
+    closedir(dp);
+}
+
+// Watch the subdirectories of a watched directory up to the eager limit
+// When listings are kept the files of the directory are listed as well.
+static void expand_watch(monitor_t *mon, int32_t row, int eager_limit) {
+    dir_table *table = &mon->dirs;
+    table->dirs[row].flags |= DIR_EXPANDED;
+    int depth = table->dirs[row].depth;
+    int snap_index = table->dirs[row].snap_index;
+
+    // Reuse the snapshot when the directory hasn't changed since it was saved
+    if (mon->snapshot != NULL && snap_index >= 0 &&
+        mon->snapshot->valid[snap_index]) {
+        expand_watch_from_snapshot(mon, row, eager_limit);
+        return;
+    }
+
+    int keep_files = table->keep_listings;
+    int max_depth = at_max_depth(mon, depth);
+    if (max_depth && !keep_files) {
+        return;
+    }
+
+    // Open the directory
+    char path[MAX_LEN];
+    int len = dir_path(table, row, path, MAX_LEN);
+    DIR *dp = opendir(path);
+    if (dp == NULL) {
+        log_error(mon, "opendir %s: %s", path, strerror(errno));
+        return;
+    }
+
+    int capacity = 0;
+    if (keep_files) {
+        begin_file_listing(table, row, dirfd(dp));
+    }
+
+    // Read the directory entries
+    struct dirent *dirent;
+    while ((dirent = readdir(dp)) != NULL) {
+        if (dirent->d_type == DT_DIR) {
+            // Skip the hidden, current, and parent directories
+            if (dirent->d_name[0] == '.' || max_depth ||
+                !is_wanted(mon, row, dirent->d_name)) {
+                continue;
+            }
+
+            // The directory may already be watched if it was created while we
+            // were expanding lazily
+            if (find_child_dir(table, row, dirent->d_name) >= 0) {
+                continue;
+            }
+
+            // Build the full path
+            snprintf(path + len, MAX_LEN - len, "/%s", dirent->d_name);
+
+            build_watch_tree(mon, path, dirent->d_name, row, depth + 1,
+                             eager_limit,
+                             find_snapshot_child(mon->snapshot, snap_index,
+                                                 dirent->d_name));
+            path[len] = '\0';
+        } else if (keep_files) {
+            add_file_listing(table, row, dirfd(dp), dirent, &capacity);
+        }
+    }
+
+    if (keep_files) {
+        end_file_listing(table, row);
+    }
+
+    // Close the directory
+    closedir(dp);
+}
+
+// Get the eager limit used when expanding below a directory at depth
+static int eager_limit_below(monitor_t *mon, int depth) {
+    if (mon->lazy_depth < 0) {
+        return INT_MAX;
+    }
+    return depth + 1 + mon->lazy_depth;
+}
+
+// Remove the watches of a directory and everything below it
+static void unwatch_dirs(monitor_t *mon, int32_t row) {
+    for (int32_t c = mon->dirs.dirs[row].first_child; c >= 0;
+         c = mon->dirs.dirs[c].next_sibling) {
+        unwatch_dirs(mon, c);
+    }
+    // The kernel has already dropped the watch if the directory was deleted.
+    // A directory renamed between parents on different shards may have been
+    // watched under its new name first, which hands back the same watch of
+    // the same inode, so a watch another row took over is left alone.
+    int wd = mon->dirs.dirs[row].wd;
+    if (find_wd(&mon->dirs, wd) == row) {
+        inotify_rm_watch(mon->fds[wd % mon->num_shards], wd / mon->num_shards);
+    }
+}
+
+// Stop watching a subdirectory and everything below it
+static void remove_watch(monitor_t *mon, int32_t row) {
+    unwatch_dirs(mon, row);
+    remove_dir(&mon->dirs, row);
+}
+
+// Make a path relative to the monitored directory covered by a watch by
+// expanding the lazily watched directories above it
+// Returns the row of the deepest watched directory on the path
+static int32_t watch_path(monitor_t *mon, const char *path) {
+    const char *rest;
+    int32_t row = covering_dir(&mon->dirs, path, &rest);
+    while (*rest != '\0' && !(mon->dirs.dirs[row].flags & DIR_EXPANDED)) {
+        expand_watch(mon, row,
+                     eager_limit_below(mon, mon->dirs.dirs[row].depth));
+        row = covering_dir(&mon->dirs, path, &rest);
+    }
+    return row;
+}
+
+// Stop watching a directory relative to the monitored directory and
+// everything below it
+// Returns the number of directories no longer watched
+static int unwatch_path(monitor_t *mon, const char *path) {
+    uint32_t id = lookup_path(&mon->paths, path);
+    int32_t row = id == NO_PATH ? -1 : find_dir(&mon->dirs, id);
+    if (row <= ROOT_DIR) {
+        return 0;
+    }
+    int count = mon->dirs.count;
+    remove_watch(mon, row);
+    return count - mon->dirs.count;
+}
+
+// Rebuild the whole watch tree from the root directory, a root that can't
+// be watched anymore fails the next ggyl_poll()
+static void rebuild_watch_tree(monitor_t *mon) {
+    free_dir_table(&mon->dirs);
+    if (build_watch_tree(mon, mon->dir, mon->dir, -1, 0,
+                         eager_limit_below(mon, -1), -1) < 0) {
+        mon->error = errno;
+    }
+}
+
+// Remove the watches below a directory that aren't wanted, and watch the
+// wanted subdirectories that aren't watched yet
+static void narrow_watch(monitor_t *mon, int32_t row) {
+    for (int32_t c = mon->dirs.dirs[row].first_child; c >= 0;) {
+        int32_t next = mon->dirs.dirs[c].next_sibling;
+        uint32_t id = mon->dirs.dirs[c].path;
+        if (id < mon->num_wanted && mon->wanted[id]) {
+            narrow_watch(mon, c);
+        } else {
+            remove_watch(mon, c);
+        }
+        c = next;
+    }
+    expand_watch(mon, row, INT_MAX);
+}
+
+// Only watch the directories relative to the monitored directory in dirs
+// and the directories above them, NULL watches all of them again
+// Returns the number of directories watched
+static int watch_only(monitor_t *mon, const char *const *dirs, size_t count) {
+    free(mon->wanted);
+    mon->wanted = NULL;
+    mon->num_wanted = 0;
+    if (dirs == NULL) {
+        if (mon->replay == NULL) {
+            rebuild_watch_tree(mon);
+        }
+        return mon->dirs.count;
+    }
+
+    // Intern every directory on the way, so new ones are known when they
+    // get created
+    uint32_t *ids = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    size_t num_ids = 0;
+    char name[MAX_LEN];
+    for (size_t i = 0; i < count; i++) {
+        uint32_t id = ROOT_PATH;
+        for (const char *path = dirs[i]; *path;) {
+            const char *end = strchr(path, '/');
+            size_t len = end != NULL ? (size_t)(end - path) : strlen(path);
+            if (len > 0 && len < MAX_LEN && !(len == 1 && path[0] == '.')) {
+                memcpy(name, path, len);
+                name[len] = '\0';
+                id = intern_path(&mon->paths, id, name);
+            }
+            path += end != NULL ? len + 1 : len;
+        }
+        ids[num_ids++] = id;
+    }
+
+    // Mark the directories and everything above them
+    mon->num_wanted = mon->paths.num_paths;
+    mon->wanted = (unsigned char *)calloc(mon->num_wanted, 1);
+    for (size_t i = 0; i < num_ids; i++) {
+        for (uint32_t id = ids[i]; id != NO_PATH && !mon->wanted[id];
+             id = mon->paths.paths[id].parent) {
+            mon->wanted[id] = 1;
+        }
+    }
+    free(ids);
+
+    // A replayed tree is only ever what the log says
+    if (mon->replay == NULL && mon->dirs.count > 0) {
+        narrow_watch(mon, ROOT_DIR);
+    }
+    return mon->dirs.count;
+}
+
+// Add a change to the pending batch and push back when the batch is due,
+// timing it from when its event was matched
+static void batch_change(monitor_t *mon, uint32_t path, uint32_t kind,
+                         uint64_t clock, uint64_t match_ns) {
+    int merged = add_change(&mon->batch, path, kind, clock);
+    if (merged) {
+        add_count(&mon->counters[0], COUNTER_CHANGES_COALESCED, 1);
+    }
+    GGYL_PROBE5(coalesce, path, kind, clock, merged, mon->read_ns);
+    set_due(&mon->due, &mon->now, mon->debounce_us);
+    if (mon->latency != NULL) {
+        uint64_t ns = monotonic_ns();
+        add_latency(&mon->latency[GGYL_STAGE_COALESCE], ns - match_ns);
+        if (mon->batch_ns == 0) {
+            mon->batch_ns = ns;
+        }
+    }
+}
+
+// Update the watch tree for a single inotify event and add the change to the
+// batch if it should trigger the command, match is what the name matched when
+// the matchers worked it out ahead, or NULL
+static void handle_event(monitor_t *mon, struct inotify_event *event,
+                         const event_match *match) {
+    dir_table *table = &mon->dirs;
+
+    // Events were dropped by the kernel so we can't trust the tree anymore,
+    // a replayed tree is only ever what the log says
+    counter_block *counters = &mon->counters[0];
+    if (event->mask & IN_Q_OVERFLOW) {
+        add_count(counters, COUNTER_OVERFLOWS, 1);
+        if (mon->replay == NULL) {
+            rebuild_watch_tree(mon);
+        }
+        uint32_t kind = CHANGE_OVERFLOW;
+        uint64_t clock = publish_change(mon, ROOT_PATH, kind);
+        mon->journal.horizon = clock;
+        if (!mon->daemon) {
+            batch_change(mon, ROOT_PATH, kind, clock, mon->read_ns);
+        }
+        notify_subscribers(mon, mon->subs.active, ROOT_PATH, kind, clock);
+        return;
+    }
+
+    int32_t row = find_wd(table, event->wd);
+    if (row < 0) {
+        add_count(counters, COUNTER_EVENTS_DROPPED, 1);
+        return;
+    }
+    GGYL_PROBE4(read, table->dirs[row].path, event->mask,
+                event->len ? event->name : "", mon->read_ns);
+
+    // Activity in a lazily watched directory pulls in its subdirectories
+    if (!(table->dirs[row].flags & DIR_EXPANDED)) {
+        expand_watch(mon, row, eager_limit_below(mon, table->dirs[row].depth));
+    }
+
+    if (!event->len) {
+        add_count(counters, COUNTER_EVENTS_DROPPED, 1);
+        return;
+    }
+
+    // The file listing has to be read again before it is saved
+    table->dirs[row].flags |= DIR_DIRTY;
+
+    // Attribute changes only make the listing stale
+    uint32_t kind = change_kind(event->mask);
+    if (!(kind & ~CHANGE_DIR)) {
+        add_count(counters, COUNTER_EVENTS_DROPPED, 1);
+        return;
+    }
+
+    // Directory changes always trigger the command and every client. Only
+    // match against the name so paths nobody wants are never interned, unless
+    // the journal or the ring keep every change.
+    int local = !mon->daemon;
+    uint64_t clients = mon->subs.active;
+    uint64_t match_ns = mon->read_ns;
+    if (!(kind & CHANGE_DIR)) {
+        if (match != NULL) {
+            local = match->local;
+            clients = match->clients;
+        } else {
+            local = local && check_patterns(mon, event->name);
+            clients = match_subscribers(&mon->subs, event->name);
+        }
+        if (mon->latency != NULL) {
+            match_ns = monotonic_ns();
+            add_latency(&mon->latency[GGYL_STAGE_MATCH],
+                        match_ns - mon->read_ns);
+        }
+        if (!local && !clients && mon->journal.capacity == 0 &&
+            mon->ring == NULL) {
+            add_count(counters, COUNTER_EVENTS_DROPPED, 1);
+            return;
+        }
+    }
+    add_count(counters, COUNTER_EVENTS_MATCHED, 1);
+    uint32_t path =
+        intern_path(&mon->paths, table->dirs[row].path, event->name);
+    GGYL_PROBE4(match, path, kind, local, mon->read_ns);
+    uint64_t clock = publish_change(mon, path, kind);
+    if (local) {
+        batch_change(mon, path, kind, clock, match_ns);
+    }
+    notify_subscribers(mon, clients, path, kind, clock);
+
+    // Keep the watch tree in sync with directory changes
+    if (kind & CHANGE_DIR) {
+        int32_t child = find_child_dir(table, row, event->name);
+        int depth = table->dirs[row].depth;
+        if (kind & CHANGE_DELETED) {
+            if (child >= 0) {
+                remove_watch(mon, child);
+            }
+        } else if (kind & CHANGE_CREATED) {
+            if (child < 0 && !at_max_depth(mon, depth) &&
+                event->name[0] != '.' && mon->replay == NULL &&
+                is_wanted(mon, row, event->name)) {
+                char buf[MAX_LEN];
+                path_string(&mon->paths, path, buf, MAX_LEN);
+                build_watch_tree(mon, buf, event->name, row, depth + 1,
+                                 eager_limit_below(mon, depth), -1);
+            }
+        }
+    }
+}
+
+/* ----------------------------- File Queries ----------------------------- */
+
+// Match a path against a glob pattern
+// * and ? never match a '/', and ** matches across any number of directories
+static int glob_match(const char *pattern, const char *path) {
+    while (*pattern) {
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            pattern += 2;
+            // "**/" also matches no directories at all
+            if (*pattern == '/') {
+                pattern++;
+                for (const char *p = path;; p++) {
+                    if ((p == path || p[-1] == '/') && glob_match(pattern, p)) {
+                        return 1;
+                    }
+                    if (*p == '\0') {
+                        return 0;
+                    }
+                }
+            }
+            for (const char *p = path;; p++) {
+                if (glob_match(pattern, p)) {
+                    return 1;
+                }
+                if (*p == '\0') {
+                    return 0;
+                }
+            }
+        } else if (*pattern == '*') {
+            pattern++;
+            for (const char *p = path;; p++) {
+                if (glob_match(pattern, p)) {
+                    return 1;
+                }
+                if (*p == '\0' || *p == '/') {
+                    return 0;
+                }
+            }
+        } else if (*pattern == '?') {
+            if (*path == '\0' || *path == '/') {
+                return 0;
+            }
+        } else if (*pattern != *path) {
+            return 0;
+        }
+        pattern++;
+        path++;
+    }
+    return *path == '\0';
+}
+
+// State of a query walking the watched directories
+typedef struct {
+    monitor_t *mon;
+    const char *pattern;
+    int max_depth; // Components in the pattern, -1 if it contains **
+    int long_format;
+    int count;
+    FILE *out;
+} file_query;
+
+// Write a query result, the long format is "type size mtime path"
+static void write_query_result(file_query *query, char type, int64_t size,
+                               int64_t mtime, const char *path) {
+    if (query->long_format) {
+        fprintf(query->out, "%c %lld %lld %s\n", type, (long long)size,
+                (long long)mtime, path);
+    } else {
+        fprintf(query->out, "%s\n", path);
+    }
+    query->count++;
+}
+
+// Match the files and subdirectories of a directory against the query
+// rel holds the path of the directory relative to the monitored directory and
+// depth the number of components in it
+static void query_dir(file_query *query, int32_t row, char *rel, int len,
+                      int depth) {
+    monitor_t *mon = query->mon;
+    dir_table *table = &mon->dirs;
+
+    // Lazily watched directories are expanded on their first query
+    if (!(table->dirs[row].flags & DIR_EXPANDED)) {
+        expand_watch(mon, row, eager_limit_below(mon, table->dirs[row].depth));
+    }
+
+    // Only directories that changed since they were listed are read again
+    if ((table->dirs[row].flags & (DIR_LISTED | DIR_DIRTY)) != DIR_LISTED) {
+        relist_watch(mon, row);
+    }
+
+    dir_listing *listing = &table->listings[row];
+    for (int i = 0; i < listing->num_files; i++) {
+        file_meta *file = &listing->files[i];
+        snprintf(rel + len, MAX_LEN - len, "%s%s", len ? "/" : "",
+                 mon->paths.names + file->name);
+        if (glob_match(query->pattern, rel)) {
+            write_query_result(query, file->type == DT_LNK ? 'l' : 'f',
+                               file->size, file->mtime_sec, rel);
+        }
+    }
+
+    for (int32_t c = table->dirs[row].first_child; c >= 0;
+         c = table->dirs[c].next_sibling) {
+        int child_len = len + snprintf(rel + len, MAX_LEN - len, "%s%s",
+                                       len ? "/" : "", dir_name(table, c));
+        if (child_len >= MAX_LEN) {
+            continue;
+        }
+        if (glob_match(query->pattern, rel)) {
+            write_query_result(query, 'd', 0, 0, rel);
+        }
+        // Entries of the subdirectory are two components deeper
+        if (query->max_depth < 0 || depth + 2 <= query->max_depth) {
+            query_dir(query, c, rel, child_len, depth + 1);
+        }
+    }
+    rel[len] = '\0';
+}
+
+// Answer a query for the paths matching a glob pattern relative to the
+// monitored directory. Only the subtree below the pattern's literal prefix is
+// walked, and patterns without ** stop at their own depth.
+// Returns the number of results
+static int run_file_query(monitor_t *mon, const char *pattern, int long_format,
+                          FILE *out) {
+    file_query query = {mon, pattern, 0, long_format, 0, out};
+
+    // Split off the directories before the first wildcard
+    const char *wildcard = strpbrk(pattern, "*?");
+    int prefix_len = 0, prefix_depth = 0, depth = 1;
+    for (const char *p = pattern; *p; p++) {
+        if (*p != '/') {
+            continue;
+        }
+        if (wildcard == NULL || p < wildcard) {
+            prefix_len = p - pattern;
+            prefix_depth = depth;
+        }
+        depth++;
+    }
+    query.max_depth = strstr(pattern, "**") != NULL ? -1 : depth;
+
+    // The prefix has to be a watched directory for anything to match
+    char rel[MAX_LEN];
+    int len = snprintf(rel, MAX_LEN, "%.*s", prefix_len, pattern);
+    int32_t row = watch_path(mon, rel);
+    const char *rest;
+    covering_dir(&mon->dirs, rel, &rest);
+    if (*rest != '\0') {
+        return 0;
+    }
+
+    query_dir(&query, row, rel, len, prefix_depth);
+    return query.count;
+}
+
+/* ---------------------------- Control Socket ---------------------------- */
+
+// Open the Unix socket clients connect to, a stale socket is replaced
+// Returns the listening socket, -1 with errno set if it can't be opened
+static int open_control_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 16) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+// Answer the request of a client of the control socket
+// A client sends one request line and the reply ends when the socket closes:
+//
+//   query <pattern>        matching paths, one per line
+//   query-long <pattern>   "type size mtime path" per line
+//   since <clock>          see write_changes_since()
+//   subscribe ...          see add_subscriber(), the client stays connected
+//
+// The reply is rendered whole and sent as the client takes it, see
+// send_reply().
+static void handle_client(monitor_t *mon, int i) {
+    pending_request *request = &mon->requests[i];
+    add_count(&mon->counters[0], COUNTER_REQUESTS, 1);
+
+    // Subscribers stay connected
+    if (strncmp(request->line, "subscribe ", 10) == 0) {
+        int fd = request->fd;
+        end_request(mon, i);
+        add_subscriber(mon, fd, request->line + 10);
+        return;
+    }
+
+    FILE *out = open_memstream(&request->reply, &request->reply_len);
+    if (out == NULL) {
+        close(request->fd);
+        end_request(mon, i);
+        return;
+    }
+    if (strncmp(request->line, "query ", 6) == 0) {
+        run_file_query(mon, request->line + 6, 0, out);
+    } else if (strncmp(request->line, "query-long ", 11) == 0) {
+        run_file_query(mon, request->line + 11, 1, out);
+    } else if (strncmp(request->line, "since ", 6) == 0) {
+        write_changes_since(mon, request->line + 6, out);
+    } else if (strcmp(request->line, "metrics") == 0) {
+        write_metrics(mon, out);
+    } else {
+        fprintf(out, "error: unknown request\n");
+    }
+    if (fclose(out) != 0 || request->reply_len > MAX_REPLY) {
+        free(request->reply);
+        request->reply = strdup("error: reply too large\n");
+        if (request->reply == NULL) {
+            close(request->fd);
+            end_request(mon, i);
+            return;
+        }
+        request->reply_len = strlen(request->reply);
+    }
+    request->reply_sent = 0;
+
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.u32 = POLLED_REQUEST + i;
+    epoll_ctl(mon->epoll_fd, EPOLL_CTL_MOD, request->fd, &event);
+    send_reply(mon, i);
+}
+
+// Free the slot of a request that is no longer read or answered
+static void end_request(monitor_t *mon, int i) {
+    pending_request *request = &mon->requests[i];
+    epoll_ctl(mon->epoll_fd, EPOLL_CTL_DEL, request->fd, NULL);
+    request->fd = -1;
+    free(request->reply);
+    request->reply = NULL;
+}
+
+// Start reading the request of a client that just connected, the socket is
+// non-blocking so a client that is slow to send never stalls the watcher
+static void add_request(monitor_t *mon, int client) {
+    int slot = 0;
+    for (int i = 0; i < MAX_REQUESTS; i++) {
+        if (mon->requests[i].fd < 0) {
+            slot = i;
+            break;
+        }
+        if (mon->requests[i].accepted < mon->requests[slot].accepted) {
+            slot = i;
+        }
+    }
+    pending_request *request = &mon->requests[slot];
+    if (request->fd >= 0) {
+        close(request->fd);
+        end_request(mon, slot);
+    }
+    request->fd = client;
+    request->len = 0;
+    request->accepted = mon->accepted++;
+    add_poll_fd(mon, client, POLLED_REQUEST + slot);
+}
+
+// Read what a client sent of its request, and answer it once the line is
+// complete
+static void read_request(monitor_t *mon, int i) {
+    pending_request *request = &mon->requests[i];
+    ssize_t n = read(request->fd, request->line + request->len,
+                     MAX_LEN - 1 - request->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n > 0) {
+        char *end = memchr(request->line + request->len, '\n', n);
+        request->len += n;
+        if (end == NULL && request->len < MAX_LEN - 1) {
+            return;
+        }
+    }
+
+    // What a client sent before hanging up is answered too
+    request->line[request->len] = '\0';
+    request->line[strcspn(request->line, "\n")] = '\0';
+    handle_client(mon, i);
+}
+
+// Send as much of a reply as the client takes without blocking, the client
+// is closed once it has the whole reply or hangs up
+// A client that never reads only holds its slot, which goes to a newer
+// client once every slot is taken.
+static void send_reply(monitor_t *mon, int i) {
+    pending_request *request = &mon->requests[i];
+    while (request->reply_sent < request->reply_len) {
+        ssize_t n = send(request->fd, request->reply + request->reply_sent,
+                         request->reply_len - request->reply_sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            break;
+        }
+        request->reply_sent += n;
+    }
+    close(request->fd);
+    end_request(mon, i);
+}
+
+// Close every client whose request is still being read
+static void free_requests(monitor_t *mon) {
+    for (int i = 0; i < MAX_REQUESTS; i++) {
+        if (mon->requests[i].fd >= 0) {
+            close(mon->requests[i].fd);
+            end_request(mon, i);
+        }
+    }
+}
+
+/* ---------------------------- Subscriptions ----------------------------- */
+
+/*
+ * Clients of the daemon subscribe with their own patterns and debounce delay.
+ * Patterns are shared between clients, so every unique pattern is matched
+ * once per event and the clients it matches for come out as a bitmask.
+ */
+
+// Initialize an empty set of subscriptions
+static void init_subscriptions(subscriptions *subs) {
+    memset(subs, 0, sizeof(subscriptions));
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        subs->clients[i].fd = -1;
+    }
+}
+
+// Subscribe a client to a pattern, the pattern is only compiled the first
+// time a client subscribes with it
+// Returns 0 if the pattern doesn't compile
+static int add_shared_pattern(subscriptions *subs, const char *glob,
+                              int client) {
+    for (int i = 0; i < subs->num_patterns; i++) {
+        if (strcmp(subs->patterns[i].glob, glob) == 0) {
+            subs->patterns[i].clients |= 1ULL << client;
+            return 1;
+        }
+    }
+
+    if (subs->num_patterns == subs->capacity) {
+        subs->capacity = subs->capacity ? subs->capacity * 2 : 16;
+        subs->patterns = (shared_pattern *)realloc(
+            subs->patterns, subs->capacity * sizeof(shared_pattern));
+    }
+    shared_pattern *pattern = &subs->patterns[subs->num_patterns];
+    pattern->plain = is_plain_glob(glob);
+    if (!pattern->plain) {
+        char regex[MAX_LEN * 2 + 3];
+        glob_to_regex(glob, regex);
+        if (regcomp(&pattern->regex, regex, REG_EXTENDED | REG_NOSUB) != 0) {
+            return 0;
+        }
+    }
+    pattern->glob = strdup(glob);
+    pattern->clients = 1ULL << client;
+    subs->num_patterns++;
+    return 1;
+}
+
+// Match a file name against every unique pattern once
+// Returns the mask of the clients that want the change
+static uint64_t match_subscribers(subscriptions *subs, const char *name) {
+    uint64_t mask = subs->match_all;
+    for (int i = 0; i < subs->num_patterns; i++) {
+        shared_pattern *pattern = &subs->patterns[i];
+        // Skip patterns whose clients all matched already
+        if ((pattern->clients & ~mask) &&
+            (pattern->plain
+                 ? match_name(pattern->glob, name)
+                 : regexec(&pattern->regex, name, 0, NULL, 0) == 0)) {
+            mask |= pattern->clients;
+        }
+    }
+    return mask & subs->active;
+}
+
+// Add a change to the batch of every client in the mask
+static void notify_subscribers(monitor_t *mon, uint64_t clients, uint32_t path,
+                               uint32_t kind, uint64_t clock) {
+    while (clients) {
+        int i = __builtin_ctzll(clients);
+        clients &= clients - 1;
+        subscriber *client = &mon->subs.clients[i];
+        add_change(&client->batch, path, kind, clock);
+        set_due(&client->due, &mon->now, client->debounce_us);
+    }
+}
+
+// Disconnect a client and drop the patterns nobody else subscribed with
+static void remove_subscriber(monitor_t *mon, int i) {
+    subscriptions *subs = &mon->subs;
+    subscriber *client = &subs->clients[i];
+    epoll_ctl(mon->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free_batch(&client->batch);
+    free(client->out);
+    memset(client, 0, sizeof(subscriber));
+    client->fd = -1;
+
+    uint64_t bit = 1ULL << i;
+    subs->active &= ~bit;
+    subs->match_all &= ~bit;
+    for (int p = 0; p < subs->num_patterns;) {
+        shared_pattern *pattern = &subs->patterns[p];
+        pattern->clients &= ~bit;
+        if (pattern->clients) {
+            p++;
+            continue;
+        }
+        if (!pattern->plain) {
+            regfree(&pattern->regex);
+        }
+        free(pattern->glob);
+        *pattern = subs->patterns[--subs->num_patterns];
+    }
+}
+
+// Subscribe a client of the control socket, args is the rest of the request:
+//
+//   subscribe <debounce_ms>[\t<pattern>]...
+//
+// The client gets "ok <clock>" or an error line. Every time its batch
+// settles it gets a "clock <clock>" line, the changed paths one per line, and
+// an empty line.
+static void add_subscriber(monitor_t *mon, int fd, char *args) {
+    subscriptions *subs = &mon->subs;
+    int i = 0;
+    while (i < MAX_CLIENTS && subs->clients[i].fd >= 0) {
+        i++;
+    }
+    if (i == MAX_CLIENTS) {
+        dprintf(fd, "error: too many clients\n");
+        close(fd);
+        return;
+    }
+
+    subscriber *client = &subs->clients[i];
+    client->fd = fd;
+    client->debounce_us = atoi(args) * 1000;
+    subs->active |= 1ULL << i;
+
+    int num_patterns = 0;
+    for (char *glob = strchr(args, '\t'); glob != NULL;
+         glob = strchr(glob, '\t')) {
+        *glob++ = '\0';
+        char *end = strchr(glob, '\t');
+        if (end != NULL) {
+            *end = '\0';
+        }
+        if (!add_shared_pattern(subs, glob, i)) {
+            dprintf(fd, "error: failed to compile %s\n", glob);
+            remove_subscriber(mon, i);
+            return;
+        }
+        num_patterns++;
+        if (end != NULL) {
+            *end = '\t';
+        }
+    }
+    if (num_patterns == 0) {
+        subs->match_all |= 1ULL << i;
+    }
+
+    // Batches are sent without blocking from here on, see send_batch()
+    char clock[64];
+    format_clock(&mon->journal, mon->journal.clock, clock, sizeof(clock));
+    dprintf(fd, "ok %s\n", clock);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    add_poll_fd(mon, fd, POLLED_CLIENT + i);
+}
+
+// Append to the output of a client
+// Returns 0 on success, -1 if the output can't grow
+static int queue_output(subscriber *client, const char *data, size_t size) {
+    if (client->out_capacity - client->out_len < size) {
+        size_t capacity = client->out_capacity;
+        while (capacity - client->out_len < size) {
+            capacity = capacity ? capacity * 2 : 4096;
+        }
+        char *out = (char *)realloc(client->out, capacity);
+        if (out == NULL) {
+            return -1;
+        }
+        client->out = out;
+        client->out_capacity = capacity;
+    }
+    memcpy(client->out + client->out_len, data, size);
+    client->out_len += size;
+    return 0;
+}
+
+// Send as much of the output of a client as its socket takes, and wait for
+// EPOLLOUT when it takes less
+static void flush_output(monitor_t *mon, int i) {
+    subscriber *client = &mon->subs.clients[i];
+    while (client->out_sent < client->out_len) {
+        ssize_t n = send(client->fd, client->out + client->out_sent,
+                         client->out_len - client->out_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (n <= 0) {
+            remove_subscriber(mon, i);
+            return;
+        }
+        client->out_sent += n;
+    }
+    int pending = client->out_sent < client->out_len;
+    if (!pending) {
+        client->out_len = client->out_sent = 0;
+    }
+    if (pending != client->polling_out) {
+        struct epoll_event event;
+        event.events = pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.u32 = POLLED_CLIENT + i;
+        epoll_ctl(mon->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+        client->polling_out = pending;
+    }
+}
+
+// Send a client its batch of changes, a client that stopped reading is
+// dropped once it falls MAX_BACKLOG behind instead of stalling everyone, and
+// so is one whose output can't grow
+static void send_batch(monitor_t *mon, int i) {
+    subscriber *client = &mon->subs.clients[i];
+    char header[80];
+    char clock[64];
+    format_clock(&mon->journal, client->batch.clock, clock, sizeof(clock));
+    int header_len = snprintf(header, sizeof(header), "clock %s\n", clock);
+    size_t size;
+    char *paths = batch_paths(&mon->paths, &client->batch, &size, 0);
+    clear_batch(&client->batch);
+
+    if (client->out_len - client->out_sent + header_len + size + 2 >
+            MAX_BACKLOG ||
+        queue_output(client, header, header_len) != 0 ||
+        queue_output(client, paths, size) != 0 ||
+        queue_output(client, "\n\n", 2) != 0) {
+        free(paths);
+        remove_subscriber(mon, i);
+        return;
+    }
+    free(paths);
+    flush_output(mon, i);
+}
+
+// Send every batch that has settled for its client's debounce delay
+static void flush_subscribers(monitor_t *mon) {
+    for (uint64_t active = mon->subs.active; active; active &= active - 1) {
+        int i = __builtin_ctzll(active);
+        subscriber *client = &mon->subs.clients[i];
+        if (client->batch.count > 0 &&
+            usec_until(&client->due, &mon->now) <= 0) {
+            send_batch(mon, i);
+        }
+    }
+}
+
+// Get the time until the earliest pending batch is due
+// Returns the wait in microseconds, -1 if nothing is pending
+static long next_due(monitor_t *mon) {
+    long wait = -1;
+    if (mon->batch.count > 0 && !atomic_load(&mon->held)) {
+        wait = usec_until(&mon->due, &mon->now);
+    }
+    for (uint64_t active = mon->subs.active; active; active &= active - 1) {
+        subscriber *client = &mon->subs.clients[__builtin_ctzll(active)];
+        if (client->batch.count > 0) {
+            long until = usec_until(&client->due, &mon->now);
+            if (wait < 0 || until < wait) {
+                wait = until;
+            }
+        }
+    }
+    return wait < 0 ? -1 : wait > 0 ? wait : 0;
+}
+
+// Disconnect every client and free the combined matcher
+static void free_subscriptions(monitor_t *mon) {
+    for (uint64_t active = mon->subs.active; active; active &= active - 1) {
+        remove_subscriber(mon, __builtin_ctzll(active));
+    }
+    free(mon->subs.patterns);
+    mon->subs.patterns = NULL;
+    mon->subs.capacity = 0;
+}
+
+/* ------------------------------ Snapshots ------------------------------- */
+
+// Find the child record of a snapshot directory by name
+// Returns the index of the child, -1 if there is no such child
+static int find_snapshot_child(snapshot_t *snap, int index, const char *name) {
+    if (snap == NULL || index < 0) {
+        return -1;
+    }
+    for (int c = snap->dirs[index].first_child; c >= 0;
+         c = snap->dirs[c].next_sibling) {
+        if (strcmp(snap->strings + snap->dirs[c].name, name) == 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+// Find a file of a snapshot directory by name with a binary search
+// Returns the file record, NULL if the directory has no such file
+static snapshot_file *find_snapshot_file(snapshot_t *snap, snapshot_dir *dir,
+                                         const char *name) {
+    snapshot_file *files = &snap->files[dir->first_file];
+    int lo = 0, hi = (int)dir->num_files - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(snap->strings + files[mid].name, name);
+        if (cmp == 0) {
+            return &files[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+// Watch the subdirectories of an unchanged directory using the snapshot
+// instead of reading the directory
+static void expand_watch_from_snapshot(monitor_t *mon, int32_t row,
+                                       int eager_limit) {
+    dir_table *table = &mon->dirs;
+    snapshot_t *snap = mon->snapshot;
+    int snap_index = table->dirs[row].snap_index;
+    snapshot_dir *dir = &snap->dirs[snap_index];
+
+    // Copy the file listing out of the mapping
+    dir_listing *listing = &table->listings[row];
+    free_file_listing(listing);
+    listing->files = (file_meta *)malloc(dir->num_files * sizeof(file_meta));
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        snapshot_file *sfile = &snap->files[dir->first_file + i];
+        file_meta *file = &listing->files[i];
+        file->name = intern_name(table->store, snap->strings + sfile->name);
+        file->type = (unsigned char)sfile->type;
+        file->size = sfile->size;
+        file->mtime_sec = sfile->mtime_sec;
+        file->mtime_nsec = sfile->mtime_nsec;
+    }
+    listing->num_files = dir->num_files;
+    listing->mtime_sec = dir->mtime_sec;
+    listing->mtime_nsec = dir->mtime_nsec;
+    table->dirs[row].flags |= DIR_LISTED;
+    if (snap->dirty[snap_index]) {
+        table->dirs[row].flags |= DIR_DIRTY;
+    }
+
+    int depth = table->dirs[row].depth;
+    if (at_max_depth(mon, depth)) {
+        return;
+    }
+
+    char path[MAX_LEN];
+    int len = dir_path(table, row, path, MAX_LEN);
+    for (int c = dir->first_child; c >= 0; c = snap->dirs[c].next_sibling) {
+        const char *name = snap->strings + snap->dirs[c].name;
+        if (find_child_dir(table, row, name) >= 0) {
+            continue;
+        }
+        snprintf(path + len, MAX_LEN - len, "/%s", name);
+        build_watch_tree(mon, path, name, row, depth + 1, eager_limit, c);
+        path[len] = '\0';
+    }
+}
+
+// Unmap a snapshot and free its validation results
+static void free_snapshot(snapshot_t *snap) {
+    if (snap == NULL)
+        return;
+    munmap(snap->map, snap->map_size);
+    free(snap->valid);
+    free(snap->dirty);
+    free(snap);
+}
+
+// Check that every offset in a mapped snapshot stays inside of it
+static int check_snapshot(snapshot_t *snap) {
+    snapshot_header *header = snap->header;
+    if (header->strings_size == 0 ||
+        snap->strings[header->strings_size - 1] != '\0' ||
+        header->root >= header->strings_size || header->num_dirs == 0) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        snapshot_dir *dir = &snap->dirs[i];
+        if ((i == 0) != (dir->parent < 0) || dir->parent >= (int32_t)i ||
+            dir->first_child >= (int32_t)header->num_dirs ||
+            (dir->first_child >= 0 && dir->first_child <= (int32_t)i) ||
+            dir->next_sibling >= (int32_t)header->num_dirs ||
+            (dir->next_sibling >= 0 && dir->next_sibling <= (int32_t)i) ||
+            dir->name >= header->strings_size ||
+            dir->first_file > header->num_files ||
+            dir->num_files > header->num_files - dir->first_file) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->num_files; i++) {
+        if (snap->files[i].name >= header->strings_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Map the snapshot of the monitored directory
+// Returns NULL if there is no usable snapshot, ggyl then does a full crawl
+static snapshot_t *load_snapshot(monitor_t *mon) {
+    int fd = open(mon->snapshot_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_error(mon, "Ignoring snapshot %s: %s", mon->snapshot_path,
+                      strerror(errno));
+        }
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header)) {
+        log_error(mon, "Ignoring snapshot %s: too small", mon->snapshot_path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error(mon, "Ignoring snapshot %s: %s", mon->snapshot_path,
+                  strerror(errno));
+        return NULL;
+    }
+
+    snapshot_t *snap = (snapshot_t *)calloc(1, sizeof(snapshot_t));
+    if (snap == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    snap->map = map;
+    snap->map_size = st.st_size;
+    snap->header = (snapshot_header *)map;
+
+    // Check the header before trusting any of the counts
+    snapshot_header *header = snap->header;
+    uint64_t size = sizeof(snapshot_header) +
+                    (uint64_t)header->num_dirs * sizeof(snapshot_dir) +
+                    (uint64_t)header->num_files * sizeof(snapshot_file) +
+                    header->strings_size;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+        header->version != SNAPSHOT_VERSION || size != (uint64_t)st.st_size) {
+        log_error(mon, "Ignoring snapshot %s: bad header", mon->snapshot_path);
+        free_snapshot(snap);
+        return NULL;
+    }
+
+    snap->dirs = (snapshot_dir *)(header + 1);
+    snap->files = (snapshot_file *)(snap->dirs + header->num_dirs);
+    snap->strings = (const char *)(snap->files + header->num_files);
+
+    if (!check_snapshot(snap)) {
+        log_error(mon, "Ignoring snapshot %s: corrupt", mon->snapshot_path);
+        free_snapshot(snap);
+        return NULL;
+    }
+
+    if (strcmp(snap->strings + header->root, mon->dir) != 0) {
+        log_error(mon, "Ignoring snapshot %s: taken of %s", mon->snapshot_path,
+                  snap->strings + header->root);
+        free_snapshot(snap);
+        return NULL;
+    }
+
+    snap->valid = (unsigned char *)calloc(header->num_dirs, 1);
+    snap->dirty = (unsigned char *)calloc(header->num_dirs, 1);
+    if (snap->valid == NULL || snap->dirty == NULL) {
+        free_snapshot(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+// Change found while validating a snapshot, name is below the directory dir
+typedef struct {
+    uint32_t kind;
+    int32_t dir;
+    char *name;
+} snapshot_change;
+
+// Shared state of the snapshot validation threads
+// Paths are only read while the threads run so they can share the store
+typedef struct {
+    snapshot_t *snap;
+    path_store *store;
+    uint32_t *paths; // Path ID of each snapshot directory
+    unsigned char *missing;
+    int next;
+    int failed; // Some directory couldn't be compared for lack of memory
+} snapshot_validation;
+
+// A validation thread and the changes it found
+typedef struct {
+    pthread_t thread;
+    snapshot_validation *validation;
+    counter_block *counters; // Of this thread
+    snapshot_change *changes;
+    int num_changes;
+    int capacity;
+} snapshot_validator;
+
+// Record a change found while validating
+static void add_snapshot_change(snapshot_validator *validator, uint32_t kind,
+                                int32_t dir, const char *name) {
+    if (validator->num_changes == validator->capacity) {
+        int capacity = validator->capacity ? validator->capacity * 2 : 16;
+        snapshot_change *changes = (snapshot_change *)realloc(
+            validator->changes, capacity * sizeof(snapshot_change));
+        if (changes == NULL) {
+            __atomic_store_n(&validator->validation->failed, 1,
+                             __ATOMIC_RELAXED);
+            return;
+        }
+        validator->changes = changes;
+        validator->capacity = capacity;
+    }
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        __atomic_store_n(&validator->validation->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    snapshot_change *change = &validator->changes[validator->num_changes++];
+    change->kind = kind;
+    change->dir = dir;
+    change->name = copy;
+}
+
+// Check if a file changed since its snapshot record
+static int file_changed(snapshot_file *file, struct stat *st) {
+    return file->size != st->st_size || file->mtime_sec != st->st_mtim.tv_sec ||
+           file->mtime_nsec != st->st_mtim.tv_nsec;
+}
+
+// Validate one snapshot directory against the disk
+// A directory with the same mtime keeps its listing, but its files are still
+// checked for modifications since those don't touch the directory mtime.
+static void validate_snapshot_dir(snapshot_validator *validator, int index) {
+    snapshot_validation *v = validator->validation;
+    snapshot_t *snap = v->snap;
+    snapshot_dir *dir = &snap->dirs[index];
+    char path[MAX_LEN];
+    int len = path_string(v->store, v->paths[index], path, MAX_LEN);
+
+    // Stat the directory by path, it's only opened when its listing has to
+    // be read again
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        v->missing[index] = 1;
+        return;
+    }
+
+    // Lazily watched directories were never listed so they can't be compared
+    if (!(dir->flags & SNAPSHOT_LISTED)) {
+        return;
+    }
+
+    if (st.st_mtim.tv_sec == dir->mtime_sec &&
+        st.st_mtim.tv_nsec == dir->mtime_nsec) {
+        snap->valid[index] = 1;
+        for (uint32_t i = 0; i < dir->num_files; i++) {
+            snapshot_file *file = &snap->files[dir->first_file + i];
+            const char *name = snap->strings + file->name;
+            struct stat fst;
+            snprintf(path + len, MAX_LEN - len, "/%s", name);
+            if (lstat(path, &fst) != 0) {
+                add_snapshot_change(validator, CHANGE_DELETED, index, name);
+                snap->dirty[index] = 1;
+            } else if (file_changed(file, &fst)) {
+                add_snapshot_change(validator, CHANGE_MODIFIED, index, name);
+                snap->dirty[index] = 1;
+            }
+        }
+        return;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        v->missing[index] = 1;
+        return;
+    }
+
+    // The directory changed, compare what's there now to the snapshot
+    DIR *dp = fdopendir(fd);
+    if (dp == NULL) {
+        close(fd);
+        return;
+    }
+    unsigned char *seen = (unsigned char *)calloc(dir->num_files + 1, 1);
+    if (seen == NULL) {
+        __atomic_store_n(&v->failed, 1, __ATOMIC_RELAXED);
+        closedir(dp);
+        return;
+    }
+    struct dirent *dirent;
+    while ((dirent = readdir(dp)) != NULL) {
+        if (dirent->d_type == DT_DIR) {
+            if (dirent->d_name[0] != '.' &&
+                find_snapshot_child(snap, index, dirent->d_name) < 0) {
+                add_snapshot_change(validator, CHANGE_CREATED | CHANGE_DIR,
+                                    index, dirent->d_name);
+            }
+            continue;
+        }
+        snapshot_file *file = find_snapshot_file(snap, dir, dirent->d_name);
+        struct stat fst;
+        if (file == NULL) {
+            add_snapshot_change(validator, CHANGE_CREATED, index,
+                                dirent->d_name);
+        } else {
+            seen[file - &snap->files[dir->first_file]] = 1;
+            if (fstatat(fd, dirent->d_name, &fst, AT_SYMLINK_NOFOLLOW) == 0 &&
+                file_changed(file, &fst)) {
+                add_snapshot_change(validator, CHANGE_MODIFIED, index,
+                                    dirent->d_name);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        if (!seen[i]) {
+            add_snapshot_change(
+                validator, CHANGE_DELETED, index,
+                snap->strings + snap->files[dir->first_file + i].name);
+        }
+    }
+    free(seen);
+    closedir(dp);
+}
+
+// Validation thread, takes directories off the shared counter until none are
+// left
+static void *validate_snapshot_worker(void *arg) {
+    snapshot_validator *validator = (snapshot_validator *)arg;
+    snapshot_validation *v = validator->validation;
+    int num_dirs = (int)v->snap->header->num_dirs;
+    int index;
+    while ((index = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) <
+           num_dirs) {
+        validate_snapshot_dir(validator, index);
+        add_count(validator->counters, COUNTER_DIRS_VALIDATED, 1);
+    }
+    return NULL;
+}
+
+// Publish a change made since the last run and add it to the batch if it
+// should trigger the command
+static void report_snapshot_change(monitor_t *mon, uint32_t path,
+                                   uint32_t kind) {
+    uint64_t clock = publish_change(mon, path, kind);
+    if (kind & CHANGE_DIR ||
+        check_patterns(mon, (char *)path_name(&mon->paths, path))) {
+        add_change(&mon->batch, path, kind, clock);
+    }
+}
+
+// Validate every directory of the snapshot in parallel
+// The changes made since the snapshot was saved are counted, and the ones
+// that should trigger the command are added to the batch.
+// Returns 0 on success, -1 if the snapshot couldn't be validated, in which
+// case nothing was reported and the tree has to be crawled instead.
+static int validate_snapshot(monitor_t *mon, snapshot_t *snap) {
+    int num_dirs = (int)snap->header->num_dirs;
+
+    // Directories come before their children so paths can be interned in
+    // order
+    uint32_t *paths = (uint32_t *)malloc(num_dirs * sizeof(uint32_t));
+    unsigned char *missing = (unsigned char *)calloc(num_dirs, 1);
+    if (paths == NULL || missing == NULL) {
+        free(paths);
+        free(missing);
+        return -1;
+    }
+    paths[0] = ROOT_PATH;
+    for (int i = 1; i < num_dirs; i++) {
+        paths[i] = intern_path(&mon->paths, paths[snap->dirs[i].parent],
+                               snap->strings + snap->dirs[i].name);
+    }
+
+    snapshot_validation v = {snap, &mon->paths, paths, missing, 0, 0};
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > 16)
+        num_threads = 16;
+    if (num_threads > num_dirs)
+        num_threads = num_dirs;
+
+    // Threads that did start take over the directories of the ones that
+    // didn't, only none at all fails
+    snapshot_validator validators[16];
+    memset(validators, 0, sizeof(validators));
+    int started = 0;
+    for (int i = 0; i < num_threads; i++) {
+        validators[started].validation = &v;
+        validators[started].counters = &mon->counters[1 + started];
+        if (start_thread(&validators[started].thread,
+                         validate_snapshot_worker,
+                         &validators[started]) == 0) {
+            started++;
+        }
+    }
+    int num_changes = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(validators[i].thread, NULL);
+        num_changes += validators[i].num_changes;
+    }
+
+    if (started == 0 || v.failed) {
+        for (int i = 0; i < started; i++) {
+            for (int j = 0; j < validators[i].num_changes; j++) {
+                free(validators[i].changes[j].name);
+            }
+            free(validators[i].changes);
+        }
+        free(paths);
+        free(missing);
+        return -1;
+    }
+
+    // Only report the topmost directory of a deleted subtree
+    for (int i = 1; i < num_dirs; i++) {
+        if (missing[i] && !missing[snap->dirs[i].parent]) {
+            num_changes++;
+        }
+    }
+
+    mon->snapshot_changes = num_changes;
+    for (int i = 0; i < started; i++) {
+        for (int j = 0; j < validators[i].num_changes; j++) {
+            snapshot_change *change = &validators[i].changes[j];
+            report_snapshot_change(
+                mon,
+                intern_path(&mon->paths, paths[change->dir], change->name),
+                change->kind);
+            free(change->name);
+        }
+        free(validators[i].changes);
+    }
+    for (int i = 1; i < num_dirs; i++) {
+        if (missing[i] && !missing[snap->dirs[i].parent]) {
+            report_snapshot_change(mon, paths[i], CHANGE_DELETED | CHANGE_DIR);
+        }
+    }
+
+    free(paths);
+    free(missing);
+    return 0;
+}
+
+// String table used when writing a snapshot, equal names share an offset
+typedef struct {
+    char *data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t *slots; // Offset + 1 of each string, 0 for an empty slot
+    uint32_t num_slots;
+    uint32_t count;
+} snapshot_strings;
+
+// Add a string to the table if it isn't already there
+// Returns the offset of the string
+static uint32_t intern_snapshot_string(snapshot_strings *strings,
+                                       const char *str) {
+    // Keep the table at most half full
+    if (strings->count * 2 >= strings->num_slots) {
+        uint32_t num_slots = strings->num_slots ? strings->num_slots * 2 : 1024;
+        uint32_t *slots = (uint32_t *)calloc(num_slots, sizeof(uint32_t));
+        for (uint32_t i = 0; i < strings->num_slots; i++) {
+            if (strings->slots[i]) {
+                uint32_t j = hash_str(strings->data + strings->slots[i] - 1);
+                while (slots[j & (num_slots - 1)])
+                    j++;
+                slots[j & (num_slots - 1)] = strings->slots[i];
+            }
+        }
+        free(strings->slots);
+        strings->slots = slots;
+        strings->num_slots = num_slots;
+    }
+
+    uint32_t j = hash_str(str);
+    while (strings->slots[j & (strings->num_slots - 1)]) {
+        uint32_t offset = strings->slots[j & (strings->num_slots - 1)] - 1;
+        if (strcmp(strings->data + offset, str) == 0) {
+            return offset;
+        }
+        j++;
+    }
+
+    uint32_t len = strlen(str) + 1;
+    while (strings->size + len > strings->capacity) {
+        strings->capacity = strings->capacity ? strings->capacity * 2 : 4096;
+        strings->data = (char *)realloc(strings->data, strings->capacity);
+    }
+    uint32_t offset = strings->size;
+    memcpy(strings->data + offset, str, len);
+    strings->size += len;
+    strings->slots[j & (strings->num_slots - 1)] = offset + 1;
+    strings->count++;
+    return offset;
+}
+
+// Records of a snapshot being written
+typedef struct {
+    snapshot_dir *dirs;
+    uint32_t num_dirs;
+    uint32_t dirs_capacity;
+    snapshot_file *files;
+    uint32_t num_files;
+    uint32_t files_capacity;
+    snapshot_strings strings;
+} snapshot_writer;
+
+// Add a watched directory and everything below it to the snapshot in
+// pre-order
+static void write_snapshot_dirs(snapshot_writer *w, monitor_t *mon, int32_t row,
+                                int32_t parent) {
+    dir_table *table = &mon->dirs;
+
+    // Read the listing again if it changed since it was last read
+    if ((table->dirs[row].flags & (DIR_LISTED | DIR_DIRTY)) ==
+        (DIR_LISTED | DIR_DIRTY)) {
+        relist_watch(mon, row);
+    }
+
+    if (w->num_dirs == w->dirs_capacity) {
+        w->dirs_capacity = w->dirs_capacity ? w->dirs_capacity * 2 : 64;
+        w->dirs = (snapshot_dir *)realloc(w->dirs, w->dirs_capacity *
+                                                       sizeof(snapshot_dir));
+    }
+    int32_t index = (int32_t)w->num_dirs++;
+    snapshot_dir *dir = &w->dirs[index];
+    dir_listing *listing = &table->listings[row];
+    memset(dir, 0, sizeof(snapshot_dir));
+    dir->parent = parent;
+    dir->first_child = -1;
+    dir->next_sibling = -1;
+    dir->name = intern_snapshot_string(&w->strings, dir_name(table, row));
+    dir->flags = table->dirs[row].flags & DIR_LISTED ? SNAPSHOT_LISTED : 0;
+    dir->mtime_sec = listing->mtime_sec;
+    dir->mtime_nsec = listing->mtime_nsec;
+    dir->first_file = w->num_files;
+    dir->num_files = listing->num_files;
+
+    for (int i = 0; i < listing->num_files; i++) {
+        if (w->num_files == w->files_capacity) {
+            w->files_capacity = w->files_capacity ? w->files_capacity * 2 : 256;
+            w->files = (snapshot_file *)realloc(
+                w->files, w->files_capacity * sizeof(snapshot_file));
+        }
+        snapshot_file *file = &w->files[w->num_files++];
+        file->name = intern_snapshot_string(
+            &w->strings, mon->paths.names + listing->files[i].name);
+        file->type = listing->files[i].type;
+        file->size = listing->files[i].size;
+        file->mtime_sec = listing->files[i].mtime_sec;
+        file->mtime_nsec = listing->files[i].mtime_nsec;
+    }
+
+    // Link the children in the order they are written
+    int32_t last_child = -1;
+    for (int32_t c = table->dirs[row].first_child; c >= 0;
+         c = table->dirs[c].next_sibling) {
+        int32_t child = (int32_t)w->num_dirs;
+        write_snapshot_dirs(w, mon, c, index);
+        if (last_child < 0) {
+            w->dirs[index].first_child = child;
+        } else {
+            w->dirs[last_child].next_sibling = child;
+        }
+        last_child = child;
+    }
+}
+
+// Write the watch tree to the snapshot file
+// The snapshot is written to a temporary file first so a crash never leaves a
+// half written snapshot behind.
+static void save_snapshot(monitor_t *mon) {
+    if (mon->snapshot_path[0] == '\0' || mon->dirs.count == 0) {
+        return;
+    }
+
+    snapshot_writer w;
+    memset(&w, 0, sizeof(snapshot_writer));
+    snapshot_header header;
+    memset(&header, 0, sizeof(snapshot_header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.root = intern_snapshot_string(&w.strings, mon->dir);
+    write_snapshot_dirs(&w, mon, ROOT_DIR, -1);
+    header.num_dirs = w.num_dirs;
+    header.num_files = w.num_files;
+    header.strings_size = w.strings.size;
+
+    char tmp_path[MAX_LEN + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", mon->snapshot_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        log_error(mon, "Can't save snapshot %s: %s", tmp_path,
+                  strerror(errno));
+    } else {
+        int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                 fwrite(w.dirs, sizeof(snapshot_dir), w.num_dirs, fp) ==
+                     w.num_dirs &&
+                 fwrite(w.files, sizeof(snapshot_file), w.num_files, fp) ==
+                     w.num_files &&
+                 fwrite(w.strings.data, 1, w.strings.size, fp) ==
+                     w.strings.size;
+        if (fclose(fp) != 0 || !ok ||
+            rename(tmp_path, mon->snapshot_path) != 0) {
+            log_error(mon, "Can't save snapshot %s: %s", mon->snapshot_path,
+                      strerror(errno));
+            unlink(tmp_path);
+        }
+    }
+
+    free(w.dirs);
+    free(w.files);
+    free(w.strings.data);
+    free(w.strings.slots);
+}
+
+/* ------------------------------ Event Log ------------------------------- */
+
+/*
+ * With --record every inotify event is appended to a log along with when it
+ * was read, and --replay feeds a log through the same handling in place of
+ * inotify. Events name their directory by path rather than by watch
+ * descriptor, so a log plays back without the tree it was recorded on, and
+ * directories are added to the table as the log mentions them instead of
+ * being crawled. Played as fast as possible, the recorded times still decide
+ * which events share a batch, so a log gives the same batches every time.
+ */
+
+// Events played per poll when playing as fast as possible
+#define REPLAY_CHUNK 4096
+
+// Start a new event log
+// Returns 0 on success, -1 if the log can't be written
+static int open_event_log(monitor_t *mon) {
+    mon->record_fd = open(mon->record_path,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                          0644);
+    if (mon->record_fd < 0) {
+        return -1;
+    }
+    event_log_start start = {EVENT_LOG_MAGIC, EVENT_LOG_VERSION, 0};
+    if (write(mon->record_fd, &start, sizeof(start)) != sizeof(start)) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mon->record_start);
+    return 0;
+}
+
+// Add an event to the records of the current read, before it is handled so
+// its directory is looked up the same way handle_event() sees it
+static void log_event(monitor_t *mon, struct inotify_event *event,
+                      size_t *size) {
+    int32_t row = find_wd(&mon->dirs, event->wd);
+    if (row < 0 && !(event->mask & IN_Q_OVERFLOW)) {
+        return;
+    }
+    if (mon->record_capacity - *size < sizeof(event_log_record) + 2 * MAX_LEN) {
+        mon->record_capacity =
+            mon->record_capacity ? mon->record_capacity * 2 : 65536;
+        mon->record_buf =
+            (char *)realloc(mon->record_buf, mon->record_capacity);
+    }
+
+    // The path of the directory is stored without the monitored directory
+    event_log_record record;
+    char *out = mon->record_buf + *size + sizeof(event_log_record);
+    record.dir_len = 0;
+    if (row > ROOT_DIR) {
+        char path[MAX_LEN];
+        int len = dir_path(&mon->dirs, row, path, MAX_LEN);
+        int skip = strlen(mon->dir) + 1;
+        record.dir_len = len - skip;
+        memcpy(out, path + skip, record.dir_len);
+    }
+    record.name_len = event->len > 0 ? strnlen(event->name, event->len) : 0;
+    memcpy(out + record.dir_len, event->name, record.name_len);
+    record.time_ns =
+        (mon->now.tv_sec - mon->record_start.tv_sec) * 1000000000ULL +
+        mon->now.tv_nsec - mon->record_start.tv_nsec;
+    record.mask = event->mask;
+    record.cookie = event->cookie;
+    memcpy(mon->record_buf + *size, &record, sizeof(event_log_record));
+    *size += sizeof(event_log_record) + record.dir_len + record.name_len;
+}
+
+// Append the records of the current read to the log with a single write
+static void write_event_log(monitor_t *mon, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(mon->record_fd, mon->record_buf + written,
+                          size - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            log_error(mon, "Can't record to %s: %s", mon->record_path,
+                      strerror(errno));
+            return;
+        }
+        written += n;
+    }
+}
+
+// Map an event log to play in place of inotify
+// Returns 0 on success, -1 if the file isn't an event log
+static int open_event_replay(monitor_t *mon, int fast) {
+    int fd = open(mon->replay_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(event_log_start)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    char *data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    event_log_start start;
+    memcpy(&start, data, sizeof(start));
+    if (memcmp(start.magic, EVENT_LOG_MAGIC, 8) != 0 ||
+        start.version != EVENT_LOG_VERSION) {
+        munmap(data, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    event_replay *replay = (event_replay *)calloc(1, sizeof(event_replay));
+    replay->data = data;
+    replay->size = st.st_size;
+    replay->pos = sizeof(event_log_start);
+    replay->fast = fast;
+    replay->next_wd = 1;
+    replay->timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    clock_gettime(CLOCK_MONOTONIC, &replay->start);
+    mon->replay = replay;
+    return replay->timer_fd < 0 ? -1 : 0;
+}
+
+// Unmap the event log
+static void close_event_replay(event_replay *replay) {
+    munmap(replay->data, replay->size);
+    close(replay->timer_fd);
+    free(replay);
+}
+
+// Check if the whole log has been played
+static int replay_ended(event_replay *replay) {
+    return replay->pos >= replay->size;
+}
+
+// Get the recorded time of the next event
+// Returns 0 once the log has been played
+static int next_replay_time(event_replay *replay, uint64_t *time_ns) {
+    if (replay->pos + sizeof(event_log_record) > replay->size) {
+        replay->pos = replay->size;
+        return 0;
+    }
+    memcpy(time_ns, replay->data + replay->pos, sizeof(uint64_t));
+    return 1;
+}
+
+// Take the time events are handled at. While a log is played as fast as
+// possible this is the recorded time of the last event, and everything is
+// due once the log has been played.
+static void update_now(monitor_t *mon) {
+    event_replay *replay = mon->replay;
+    if (replay == NULL || !replay->fast) {
+        clock_gettime(CLOCK_MONOTONIC, &mon->now);
+        return;
+    }
+    uint64_t ns = replay->start.tv_nsec + replay->time_ns;
+    if (replay_ended(replay)) {
+        ns += 3600 * 1000000000ULL;
+    }
+    mon->now.tv_sec = replay->start.tv_sec + ns / 1000000000;
+    mon->now.tv_nsec = ns % 1000000000;
+}
+
+// Find the directory of a replayed event, adding it and the directories
+// above it to the table as the log mentions them
+// Returns the row of the directory
+static int32_t replay_dir(monitor_t *mon, const char *path, int len) {
+    dir_table *table = &mon->dirs;
+    int32_t row = ROOT_DIR;
+    char name[MAX_LEN];
+    for (int start = 0; start < len;) {
+        int end = start;
+        while (end < len && path[end] != '/') {
+            end++;
+        }
+        memcpy(name, path + start, end - start);
+        name[end - start] = '\0';
+        int32_t child = find_child_dir(table, row, name);
+        if (child < 0) {
+            uint32_t id = intern_path(&mon->paths, table->dirs[row].path, name);
+            child = add_dir(table, row, mon->replay->next_wd++, id,
+                            table->dirs[row].depth + 1);
+        }
+        row = child;
+        start = end + 1;
+    }
+    return row;
+}
+
+// Play the next event of the log. Played as fast as possible, the batches
+// that are due by its recorded time are delivered first.
+// Returns 0 once the log has been played
+static int replay_event(monitor_t *mon) {
+    event_replay *replay = mon->replay;
+    event_log_record record;
+    if (replay->pos + sizeof(record) > replay->size) {
+        replay->pos = replay->size;
+        return 0;
+    }
+    memcpy(&record, replay->data + replay->pos, sizeof(record));
+    const char *dir = replay->data + replay->pos + sizeof(record);
+    size_t next = replay->pos + sizeof(record) + record.dir_len +
+                  record.name_len;
+    if (next > replay->size || record.dir_len >= MAX_LEN ||
+        record.name_len >= MAX_LEN) {
+        log_error(mon, "%s is cut short", mon->replay_path);
+        replay->pos = replay->size;
+        return 0;
+    }
+
+    // Rebuild the inotify event, its name is terminated like the kernel's
+    char buffer[sizeof(struct inotify_event) + MAX_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event = (struct inotify_event *)buffer;
+    event->wd = -1;
+    if (!(record.mask & IN_Q_OVERFLOW)) {
+        // Adding the directory may move the table
+        int32_t row = replay_dir(mon, dir, record.dir_len);
+        event->wd = mon->dirs.dirs[row].wd;
+    }
+    event->mask = record.mask;
+    event->cookie = record.cookie;
+    event->len = record.name_len > 0 ? record.name_len + 1 : 0;
+    memcpy(event->name, dir + record.dir_len, record.name_len);
+    event->name[record.name_len] = '\0';
+
+    // Only the event's own time counts while it is played, even when it is
+    // the last one
+    replay->time_ns = record.time_ns;
+    if (replay->fast) {
+        flush_due(mon);
+    }
+    replay->pos = next;
+    replay->count++;
+    add_count(&mon->counters[0], COUNTER_EVENTS_READ, 1);
+    mon->read_ns =
+        mon->latency != NULL ? monotonic_ns() : timespec_ns(&mon->now);
+    handle_event(mon, event, NULL);
+    return 1;
+}
+
+static void arm_replay_timer(monitor_t *mon);
+
+// Play the events that are due and arm the timer for the next ones
+static void play_events(monitor_t *mon) {
+    event_replay *replay = mon->replay;
+    uint64_t time_ns;
+    if (replay->fast) {
+        // Time stands still while a batch is held, so a held batch doesn't
+        // swallow the ones that would have followed it
+        for (int i = 0;
+             i < REPLAY_CHUNK && !atomic_load(&mon->held) && replay_event(mon);
+             i++) {
+        }
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &mon->now);
+        uint64_t elapsed =
+            (mon->now.tv_sec - replay->start.tv_sec) * 1000000000ULL +
+            mon->now.tv_nsec - replay->start.tv_nsec;
+        while (next_replay_time(replay, &time_ns) && time_ns <= elapsed) {
+            replay_event(mon);
+        }
+    }
+    if (mon->ring != NULL) {
+        wake_ring_consumers(mon->ring);
+    }
+    arm_replay_timer(mon);
+}
+
+// Arm the timer for when the next event of the log is due. Played as fast as
+// possible the timer fires right away, so the descriptor of ggyl_fd() stays
+// readable until the log is played.
+static void arm_replay_timer(monitor_t *mon) {
+    event_replay *replay = mon->replay;
+    uint64_t time_ns;
+    if (!next_replay_time(replay, &time_ns) ||
+        (replay->fast && atomic_load(&mon->held))) {
+        return;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    int flags = 0;
+    if (replay->fast) {
+        spec.it_value.tv_nsec = 1;
+    } else {
+        uint64_t ns = replay->start.tv_nsec + time_ns;
+        spec.it_value.tv_sec = replay->start.tv_sec + ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+        flags = TFD_TIMER_ABSTIME;
+    }
+    timerfd_settime(replay->timer_fd, flags, &spec, NULL);
+}
+
+/* ------------------------------- Pipeline ------------------------------- */
+
+/*
+ * With the threads option events take a staged way from the kernel to the
+ * callback. A reader thread does nothing but read inotify into a ring of
+ * reads, so the kernel queue keeps draining while the polling thread crawls
+ * a new directory or runs the callback. The polling thread handles the reads
+ * in the order they were read, and when it falls behind the matcher threads
+ * match the names of the backlog between them first. Only the polling thread
+ * touches the tree, the batches and the clients, so changes and batches come
+ * out in the same order as without threads.
+ */
+
+// Work out what the name of an event matches, ahead of handle_event()
+static void match_event(monitor_t *mon, struct inotify_event *event,
+                        event_match *match) {
+    if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+        match->local = !mon->daemon && check_patterns(mon, event->name);
+        match->clients = match_subscribers(&mon->subs, event->name);
+    }
+}
+
+// Match slices of the events of the current job until none are left
+static void match_slices(monitor_t *mon) {
+    pipeline *pl = mon->pipeline;
+    int first;
+    while ((first = atomic_fetch_add(&pl->next_event, MATCH_SLICE)) <
+           pl->num_events) {
+        int last = first + MATCH_SLICE < pl->num_events ? first + MATCH_SLICE
+                                                        : pl->num_events;
+        for (int i = first; i < last; i++) {
+            match_event(mon, pl->events[i], &pl->matches[i]);
+        }
+    }
+}
+
+// Match the events of every job until the pipeline stops
+static void *run_matcher(void *arg) {
+    monitor_t *mon = (monitor_t *)arg;
+    pipeline *pl = mon->pipeline;
+    uint64_t job = 0;
+    pthread_mutex_lock(&pl->lock);
+    while (1) {
+        while (pl->job == job && !pl->stopping) {
+            pthread_cond_wait(&pl->start, &pl->lock);
+        }
+        if (pl->stopping) {
+            break;
+        }
+        job = pl->job;
+        pthread_mutex_unlock(&pl->lock);
+        match_slices(mon);
+        pthread_mutex_lock(&pl->lock);
+        if (--pl->busy == 0) {
+            pthread_cond_signal(&pl->done);
+        }
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+// Match the first count events of pl->events on the matchers, the polling
+// thread takes slices too, and wait for all of them
+static void match_events(monitor_t *mon, int count) {
+    pipeline *pl = mon->pipeline;
+    pthread_mutex_lock(&pl->lock);
+    pl->num_events = count;
+    atomic_store(&pl->next_event, 0);
+    pl->busy = pl->num_matchers;
+    pl->job++;
+    pthread_cond_broadcast(&pl->start);
+    pthread_mutex_unlock(&pl->lock);
+
+    match_slices(mon);
+    pthread_mutex_lock(&pl->lock);
+    while (pl->busy > 0) {
+        pthread_cond_wait(&pl->done, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+}
+
+// Handle the events of a read in order, matches holds what the matchers
+// worked out for them, or is NULL
+static void handle_events(monitor_t *mon, char *buffer, size_t len,
+                          const event_match *matches) {
+    // Walk every inotify event in the buffer
+    struct inotify_event *event;
+    size_t logged = 0;
+    int i = 0;
+    for (char *ptr = buffer; ptr < buffer + len;
+         ptr += sizeof(struct inotify_event) + event->len, i++) {
+        event = (struct inotify_event *)ptr;
+        add_count(&mon->counters[0], COUNTER_EVENTS_READ, 1);
+        if (mon->record_fd >= 0) {
+            log_event(mon, event, &logged);
+        }
+        handle_event(mon, event, matches != NULL ? &matches[i] : NULL);
+    }
+    if (logged > 0) {
+        write_event_log(mon, logged);
+    }
+    if (mon->ring != NULL) {
+        wake_ring_consumers(mon->ring);
+    }
+}
+
+// Add the events of a read to the ones for the matchers
+// Returns the number of events for the matchers
+static int gather_events(pipeline *pl, pipeline_read *slot, int count) {
+    struct inotify_event *event;
+    slot->num_events = 0;
+    for (char *ptr = slot->data; ptr < slot->data + slot->len;
+         ptr += sizeof(struct inotify_event) + event->len) {
+        event = (struct inotify_event *)ptr;
+        pl->events[count + slot->num_events++] = event;
+    }
+    return count + slot->num_events;
+}
+
+// Read an inotify instance into its ring until the pipeline stops
+static void *run_reader(void *arg) {
+    shard_reader *reader = (shard_reader *)arg;
+    struct pollfd readable[2] = {{reader->fd, POLLIN, 0},
+                                 {reader->stop_fd, POLLIN, 0}};
+    struct pollfd space[2] = {{reader->space_fd, POLLIN, 0},
+                              {reader->stop_fd, POLLIN, 0}};
+    uint64_t head = 0;
+    while (1) {
+        // A full ring holds the reader back, and the kernel queues meanwhile.
+        // The polling thread checks reader_waiting after moving the tail, so
+        // one of them always sees the other.
+        if (head - atomic_load(&reader->tail) == PIPELINE_SLOTS) {
+            atomic_store(&reader->reader_waiting, 1);
+            if (head - atomic_load(&reader->tail) == PIPELINE_SLOTS) {
+                poll(space, 2, -1);
+                if (space[1].revents & POLLIN) {
+                    break;
+                }
+                uint64_t wakes;
+                read(reader->space_fd, &wakes, sizeof(wakes));
+            }
+            atomic_store(&reader->reader_waiting, 0);
+            continue;
+        }
+
+        if (poll(readable, 2, -1) < 0) {
+            continue;
+        }
+        if (readable[1].revents & POLLIN) {
+            break;
+        }
+        pipeline_read *slot = &reader->reads[head % PIPELINE_SLOTS];
+        ssize_t len = read(reader->fd, slot->data, PIPELINE_READ_SIZE);
+        if (len <= 0) {
+            continue;
+        }
+        slot->time_ns = monotonic_ns();
+        slot->len = len;
+
+        // Watch descriptors of the instances overlap, the table knows them
+        // with the shard folded in
+        struct inotify_event *event;
+        for (char *ptr = slot->data; ptr < slot->data + len;
+             ptr += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)ptr;
+            if (event->wd >= 0) {
+                event->wd = event->wd * reader->num_shards + reader->shard;
+            }
+        }
+        atomic_store_explicit(&reader->head, ++head, memory_order_release);
+        uint64_t wake = 1;
+        write(reader->ready_fd, &wake, sizeof(wake));
+    }
+    return NULL;
+}
+
+// Find the reader whose next read was read first, -1 if none has one
+static int oldest_read(pipeline *pl, uint64_t *tails, uint64_t *heads) {
+    int oldest = -1;
+    uint64_t oldest_ns = 0;
+    for (int i = 0; i < pl->num_readers; i++) {
+        if (tails[i] == heads[i]) {
+            continue;
+        }
+        uint64_t ns = pl->readers[i].reads[tails[i] % PIPELINE_SLOTS].time_ns;
+        if (oldest < 0 || ns < oldest_ns) {
+            oldest = i;
+            oldest_ns = ns;
+        }
+    }
+    return oldest;
+}
+
+// Handle every read the readers published, oldest first across the readers
+static void drain_pipeline(monitor_t *mon) {
+    pipeline *pl = mon->pipeline;
+    uint64_t wakes;
+    read(pl->ready_fd, &wakes, sizeof(wakes));
+    uint64_t heads[MAX_SHARDS], tails[MAX_SHARDS];
+    for (int i = 0; i < pl->num_readers; i++) {
+        heads[i] = atomic_load_explicit(&pl->readers[i].head,
+                                        memory_order_acquire);
+        tails[i] = atomic_load_explicit(&pl->readers[i].tail,
+                                        memory_order_relaxed);
+    }
+
+    while (1) {
+        // Readers keep reads small while they keep up, so the backlog of
+        // reads is what gets split across the matchers
+        int count = 0;
+        int num_reads = 0;
+        int reader;
+        while ((reader = oldest_read(pl, tails, heads)) >= 0) {
+            pipeline_read *slot =
+                &pl->readers[reader].reads[tails[reader] % PIPELINE_SLOTS];
+            if (pl->num_matchers > 0) {
+                if (count + slot->len / sizeof(struct inotify_event) >
+                    PIPELINE_MAX_EVENTS) {
+                    break;
+                }
+                count = gather_events(pl, slot, count);
+            }
+            pl->order[num_reads++] = reader;
+            tails[reader]++;
+        }
+        if (num_reads == 0) {
+            return;
+        }
+        const event_match *matches = NULL;
+        if (count >= PARALLEL_MATCH_MIN) {
+            match_events(mon, count);
+            matches = pl->matches;
+        }
+
+        for (int i = 0; i < num_reads; i++) {
+            // Changes are timed from when they were read, not handled
+            shard_reader *r = &pl->readers[pl->order[i]];
+            uint64_t tail =
+                atomic_load_explicit(&r->tail, memory_order_relaxed);
+            pipeline_read *slot = &r->reads[tail % PIPELINE_SLOTS];
+            mon->read_ns = slot->time_ns;
+            mon->now.tv_sec = slot->time_ns / 1000000000;
+            mon->now.tv_nsec = slot->time_ns % 1000000000;
+            handle_events(mon, slot->data, slot->len, matches);
+            if (matches != NULL) {
+                matches += slot->num_events;
+            }
+
+            atomic_store(&r->tail, tail + 1);
+            if (atomic_load(&r->reader_waiting)) {
+                uint64_t wake = 1;
+                write(r->space_fd, &wake, sizeof(wake));
+            }
+        }
+    }
+}
+
+// Start a reader thread for every inotify instance and threads - 1
+// matchers, signals are left to the threads of the host
+// Returns 0 on success, -1 with errno set if a reader can't be started
+static int start_pipeline(monitor_t *mon, int threads) {
+    pipeline *pl = (pipeline *)calloc(1, sizeof(pipeline));
+    mon->pipeline = pl;
+    pl->events = (struct inotify_event **)malloc(
+        PIPELINE_MAX_EVENTS * sizeof(struct inotify_event *));
+    pl->matches =
+        (event_match *)malloc(PIPELINE_MAX_EVENTS * sizeof(event_match));
+    pl->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pl->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->start, NULL);
+    pthread_cond_init(&pl->done, NULL);
+    if (pl->ready_fd < 0 || pl->stop_fd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < mon->num_shards; i++) {
+        shard_reader *reader = &pl->readers[i];
+        reader->reads =
+            (pipeline_read *)malloc(PIPELINE_SLOTS * sizeof(pipeline_read));
+        reader->fd = mon->fds[i];
+        reader->shard = i;
+        reader->num_shards = mon->num_shards;
+        reader->ready_fd = pl->ready_fd;
+        reader->stop_fd = pl->stop_fd;
+        reader->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pl->num_readers++;
+        if (reader->reads == NULL || reader->space_fd < 0) {
+            return -1;
+        }
+    }
+    add_poll_fd(mon, pl->ready_fd, POLLED_PIPELINE);
+
+    for (int i = 0; i < pl->num_readers; i++) {
+        shard_reader *reader = &pl->readers[i];
+        if (start_thread(&reader->reader, run_reader, reader) != 0) {
+            return -1;
+        }
+        reader->reading = 1;
+    }
+
+    // Reads are matched on the polling thread without matchers
+    threads = threads - 1 < MAX_MATCHERS ? threads - 1 : MAX_MATCHERS;
+    while (pl->num_matchers < threads &&
+           start_thread(&pl->matchers[pl->num_matchers], run_matcher, mon) ==
+               0) {
+        pl->num_matchers++;
+    }
+    return 0;
+}
+
+// Stop the threads of the pipeline and free it
+static void stop_pipeline(pipeline *pl) {
+    uint64_t stop = 1;
+    write(pl->stop_fd, &stop, sizeof(stop));
+    for (int i = 0; i < pl->num_readers; i++) {
+        shard_reader *reader = &pl->readers[i];
+        if (reader->reading) {
+            pthread_join(reader->reader, NULL);
+        }
+        if (reader->space_fd >= 0) {
+            close(reader->space_fd);
+        }
+        free(reader->reads);
+    }
+    pthread_mutex_lock(&pl->lock);
+    pl->stopping = 1;
+    pthread_cond_broadcast(&pl->start);
+    pthread_mutex_unlock(&pl->lock);
+    for (int i = 0; i < pl->num_matchers; i++) {
+        pthread_join(pl->matchers[i], NULL);
+    }
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->start);
+    pthread_cond_destroy(&pl->done);
+    if (pl->ready_fd >= 0) {
+        close(pl->ready_fd);
+    }
+    if (pl->stop_fd >= 0) {
+        close(pl->stop_fd);
+    }
+    free(pl->events);
+    free(pl->matches);
+    free(pl);
+}
+
+/* ------------------------------- Watcher -------------------------------- */
+
+// Run the callback for the batch of changes
+// The changed paths are only turned into strings here.
+static void deliver_batch(monitor_t *mon) {
+    change_batch *batch = &mon->batch;
+    GGYL_PROBE4(debounce, batch->count, batch->clock, mon->batch_ns,
+                timespec_ns(&mon->now));
+    if (mon->batch_ns != 0) {
+        add_latency(&mon->latency[GGYL_STAGE_DEBOUNCE],
+                    monotonic_ns() - mon->batch_ns);
+        mon->batch_ns = 0;
+    }
+    if (batch->count > mon->batch_view_capacity) {
+        mon->batch_view_capacity = batch->count * 2;
+        mon->batch_view = (ggyl_change *)realloc(
+            mon->batch_view, mon->batch_view_capacity * sizeof(ggyl_change));
+    }
+
+    // Build the strings first, the pointers are only taken once the buffer
+    // is done growing
+    size_t size = 0;
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (mon->batch_strings_capacity - size < MAX_LEN) {
+            mon->batch_strings_capacity =
+                mon->batch_strings_capacity ? mon->batch_strings_capacity * 2
+                                            : 65536;
+            mon->batch_strings = (char *)realloc(mon->batch_strings,
+                                                 mon->batch_strings_capacity);
+        }
+        mon->batch_view[i].kind = batch->changes[i].kind;
+        mon->batch_view[i].path = (const char *)size;
+        size += path_string(&mon->paths, batch->changes[i].path,
+                            mon->batch_strings + size, MAX_LEN) +
+                1;
+    }
+    for (uint32_t i = 0; i < batch->count; i++) {
+        mon->batch_view[i].path =
+            mon->batch_strings + (size_t)mon->batch_view[i].path;
+    }
+
+    char clock[64];
+    format_clock(&mon->journal, batch->clock, clock, sizeof(clock));
+    ggyl_batch view = {mon->batch_view, batch->count, batch->clock, clock};
+    clear_batch(batch);
+    add_count(&mon->counters[0], COUNTER_BATCHES, 1);
+    if (mon->on_batch != NULL) {
+        mon->on_batch(mon, &view, mon->on_batch_arg);
+    }
+}
+
+// Watch a descriptor with the epoll instance, tag tells ggyl_poll() what it
+// is
+static void add_poll_fd(monitor_t *mon, int fd, uint32_t tag) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = tag;
+    epoll_ctl(mon->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Arm the timer for the earliest batch that is due, or disarm it
+static void arm_due_timer(monitor_t *mon) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    long wait = next_due(mon);
+    if (wait >= 0) {
+        // A zero it_value disarms the timer, so a due batch waits a tick
+        wait = wait > 0 ? wait : 1;
+        spec.it_value.tv_sec = wait / 1000000;
+        spec.it_value.tv_nsec = (wait % 1000000) * 1000;
+    }
+    timerfd_settime(mon->timer_fd, 0, &spec, NULL);
+}
+
+// Run the callback and send the batches that have settled
+static void flush_due(monitor_t *mon) {
+    update_now(mon);
+    if (mon->batch.count > 0 && !atomic_load(&mon->held) &&
+        usec_until(&mon->due, &mon->now) <= 0) {
+        deliver_batch(mon);
+        // Events read afterwards are timed from when the callback returned
+        update_now(mon);
+    }
+    flush_subscribers(mon);
+}
+
+// Read every inotify event that is ready and pass it to handle_event()
+static void read_events(monitor_t *mon) {
+    const int buffer_size = 1024 * (sizeof(struct inotify_event) + 16);
+    char buffer[buffer_size]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(mon->fds[0], buffer, buffer_size);
+    if (len <= 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mon->now);
+    mon->read_ns = timespec_ns(&mon->now);
+    handle_events(mon, buffer, len, NULL);
+}
+
+void ggyl_options_init(ggyl_options *options) {
+    memset(options, 0, sizeof(ggyl_options));
+    options->dir = ".";
+    options->max_depth = -1;
+    options->lazy_depth = -1;
+    options->debounce_ms = 20;
+    options->journal_size = JOURNAL_SIZE;
+    options->metrics_interval_ms = METRICS_INTERVAL_MS;
+}
+
+ggyl_watcher *ggyl_new(const ggyl_options *options, ggyl_batch_fn on_batch,
+                       void *arg) {
+    if (options->num_patterns > MAX_REGEX || options->debounce_ms < 0 ||
+        options->journal_size < 0 || strlen(options->dir) >= MAX_LEN ||
+        options->metrics_interval_ms <= 0 || options->threads < 0 ||
+        options->shards < 0 || options->shards > MAX_SHARDS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // A replayed tree is never on disk to be recorded or saved
+    if (options->replay_path != NULL &&
+        (options->record_path != NULL || options->snapshot_path != NULL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    monitor_t *mon = (monitor_t *)calloc(1, sizeof(monitor_t));
+    if (mon == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        mon->fds[i] = -1;
+    }
+    mon->num_shards = options->shards > 0 ? options->shards : 1;
+    mon->listen_fd = -1;
+    mon->epoll_fd = -1;
+    mon->timer_fd = -1;
+    mon->record_fd = -1;
+    mon->metrics_fd = -1;
+    mon->release_fd = -1;
+    mon->snapshot_changes = -1;
+    mon->mask = IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_ISDIR |
+                IN_MOVED_FROM | IN_MOVED_TO;
+    strcpy(mon->dir, options->dir);
+    mon->max_depth = options->max_depth;
+    mon->lazy_depth = options->lazy_depth;
+    mon->debounce_us = options->debounce_ms * 1000;
+    mon->journal_size = options->journal_size;
+    mon->daemon = options->daemon;
+    if (options->snapshot_path != NULL) {
+        strncpy(mon->snapshot_path, options->snapshot_path, MAX_LEN - 1);
+    }
+    if (options->socket_path != NULL) {
+        strncpy(mon->socket_path, options->socket_path, MAX_LEN - 1);
+    }
+    if (options->ring_path != NULL) {
+        strncpy(mon->ring_path, options->ring_path, MAX_LEN - 1);
+    }
+    if (options->record_path != NULL) {
+        strncpy(mon->record_path, options->record_path, MAX_LEN - 1);
+    }
+    if (options->replay_path != NULL) {
+        strncpy(mon->replay_path, options->replay_path, MAX_LEN - 1);
+    }
+    mon->replay_fast = options->replay_fast;
+    if (options->metrics_path != NULL) {
+        strncpy(mon->metrics_path, options->metrics_path, MAX_LEN - 1);
+    }
+    mon->metrics_interval_ms = options->metrics_interval_ms;
+    mon->threads = options->threads;
+    if (options->latency) {
+        mon->latency = (latency_histogram *)calloc(GGYL_NUM_STAGES,
+                                                   sizeof(latency_histogram));
+    }
+    mon->on_batch = on_batch;
+    mon->on_batch_arg = arg;
+    mon->log = options->log;
+    mon->log_arg = options->log_arg;
+
+    // Initialize the interned paths and the table of watched directories,
+    // file listings are kept for snapshots and queries
+    init_path_store(&mon->paths, mon->dir);
+    init_dir_table(&mon->dirs, &mon->paths,
+                   mon->snapshot_path[0] != '\0' ||
+                       mon->socket_path[0] != '\0');
+    init_subscriptions(&mon->subs);
+    for (int i = 0; i < MAX_REQUESTS; i++) {
+        mon->requests[i].fd = -1;
+    }
+
+    // Changes are only kept for "since" queries when there is a socket to
+    // ask them on
+    init_journal(&mon->journal,
+                 mon->socket_path[0] != '\0' ? mon->journal_size : 0);
+
+    // Compile the patterns
+    mon->regex_entries =
+        (regex_entry **)malloc(MAX_REGEX * sizeof(regex_entry *));
+    int compiled = mon->regex_entries != NULL ? 0 : -1;
+    for (int i = 0; i < options->num_patterns && compiled == 0; i++) {
+        compiled = compile_patterns(mon, options->patterns[i]);
+    }
+    if (compiled != 0) {
+        ggyl_free(mon);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return mon;
+}
+
+// Close everything a watcher opened so far, which is all of it once started
+// and some of it when ggyl_start() fails
+static void close_watcher(monitor_t *mon) {
+    free_subscriptions(mon);
+    free_requests(mon);
+    if (mon->pipeline != NULL) {
+        stop_pipeline(mon->pipeline);
+        mon->pipeline = NULL;
+    }
+    for (int i = 0; i < mon->num_shards; i++) {
+        if (mon->fds[i] >= 0) {
+            close(mon->fds[i]);
+            mon->fds[i] = -1;
+        }
+    }
+    int *fds[] = {&mon->epoll_fd, &mon->timer_fd, &mon->release_fd,
+                  &mon->metrics_fd, &mon->record_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+    if (mon->listen_fd >= 0) {
+        close(mon->listen_fd);
+        mon->listen_fd = -1;
+        unlink(mon->socket_path);
+    }
+    if (mon->ring != NULL) {
+        close_shm_ring(mon->ring);
+        unlink(mon->ring_path);
+        mon->ring = NULL;
+    }
+    if (mon->replay != NULL) {
+        close_event_replay(mon->replay);
+        mon->replay = NULL;
+    }
+    free_snapshot(mon->snapshot);
+    mon->snapshot = NULL;
+}
+
+// Undo a ggyl_start() that failed
+// Returns -1 with the errno of the failure
+static int fail_start(monitor_t *mon) {
+    int saved_errno = errno;
+    close_watcher(mon);
+    errno = saved_errno;
+    return -1;
+}
+
+int ggyl_start(ggyl_watcher *mon) {
+    mon->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    mon->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    mon->release_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mon->epoll_fd < 0 || mon->timer_fd < 0 || mon->release_fd < 0) {
+        return fail_start(mon);
+    }
+    add_poll_fd(mon, mon->timer_fd, POLLED_TIMER);
+    add_poll_fd(mon, mon->release_fd, POLLED_RELEASE);
+
+    if (mon->replay_path[0] != '\0') {
+        // The log stands in for the tree, which is never read
+        if (open_event_replay(mon, mon->replay_fast) != 0) {
+            return fail_start(mon);
+        }
+        add_poll_fd(mon, mon->replay->timer_fd, POLLED_REPLAY);
+        add_dir(&mon->dirs, -1, mon->replay->next_wd++,
+                intern_path(&mon->paths, NO_PATH, mon->dir), 0);
+    } else {
+        // Only the root has to be watchable, anything below may come and go
+        struct stat st;
+        if (stat(mon->dir, &st) != 0) {
+            return fail_start(mon);
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            return fail_start(mon);
+        }
+        for (int i = 0; i < mon->num_shards; i++) {
+            mon->fds[i] = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (mon->fds[i] < 0) {
+                return fail_start(mon);
+            }
+        }
+
+        // With a pipeline only the reader threads read inotify
+        if (mon->threads == 0 && mon->num_shards == 1) {
+            add_poll_fd(mon, mon->fds[0], POLLED_INOTIFY);
+        }
+        if (mon->record_path[0] != '\0' && open_event_log(mon) != 0) {
+            return fail_start(mon);
+        }
+    }
+
+    // Consumers of the ring see every change from here on
+    if (mon->ring_path[0] != '\0') {
+        mon->ring = open_shm_ring(mon->ring_path, mon->journal.instance);
+        if (mon->ring == NULL) {
+            return fail_start(mon);
+        }
+    }
+
+    if (mon->replay == NULL) {
+        // Map the snapshot from the last run and find out what changed
+        // since, the changes form the first batch
+        if (mon->snapshot_path[0] != '\0') {
+            mon->snapshot = load_snapshot(mon);
+            if (mon->snapshot != NULL &&
+                validate_snapshot(mon, mon->snapshot) != 0) {
+                free_snapshot(mon->snapshot);
+                mon->snapshot = NULL;
+            }
+        }
+
+        // Build a tree of inotify watch descriptors, the tree is updated as
+        // directories come and go
+        if (build_watch_tree(mon, mon->dir, mon->dir, -1, 0,
+                             eager_limit_below(mon, -1),
+                             mon->snapshot != NULL ? 0 : -1) < 0) {
+            return fail_start(mon);
+        }
+
+        // Unchanged directories have been copied out of the snapshot
+        free_snapshot(mon->snapshot);
+        mon->snapshot = NULL;
+
+        // Events of the crawl wait in the kernel until the readers start
+        if ((mon->threads > 0 || mon->num_shards > 1) &&
+            start_pipeline(mon, mon->threads) != 0) {
+            return fail_start(mon);
+        }
+    }
+
+    // Listen for queries once the tree is watched
+    if (mon->socket_path[0] != '\0') {
+        mon->listen_fd = open_control_socket(mon->socket_path);
+        if (mon->listen_fd < 0) {
+            return fail_start(mon);
+        }
+        add_poll_fd(mon, mon->listen_fd, POLLED_LISTEN);
+    }
+
+    // The metrics file is rewritten every interval, starting now
+    if (mon->metrics_path[0] != '\0') {
+        mon->metrics_fd =
+            timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (mon->metrics_fd < 0) {
+            return fail_start(mon);
+        }
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = mon->metrics_interval_ms / 1000;
+        spec.it_interval.tv_nsec = (mon->metrics_interval_ms % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(mon->metrics_fd, 0, &spec, NULL);
+        add_poll_fd(mon, mon->metrics_fd, POLLED_METRICS);
+        write_metrics_file(mon);
+    }
+
+    // Changes since the last run are due right away, a daemon's clients
+    // connect too late to see them
+    update_now(mon);
+    mon->due = mon->now;
+    if (mon->daemon) {
+        clear_batch(&mon->batch);
+    }
+    arm_due_timer(mon);
+    if (mon->replay != NULL) {
+        arm_replay_timer(mon);
+    }
+    mon->running = 1;
+    return 0;
+}
+
+int ggyl_fd(ggyl_watcher *mon) { return mon->epoll_fd; }
+
+// Check if the replay log has been played and every batch delivered
+static int replay_done(monitor_t *mon) {
+    return mon->replay != NULL && replay_ended(mon->replay) &&
+           !atomic_load(&mon->held) && next_due(mon) < 0;
+}
+
+int ggyl_poll(ggyl_watcher *mon, int timeout_ms) {
+    if (!mon->running || mon->error != 0) {
+        errno = mon->running ? mon->error : EINVAL;
+        return -1;
+    }
+
+    // The timer wakes us when the earliest batch is due
+    flush_due(mon);
+    arm_due_timer(mon);
+    if (replay_done(mon)) {
+        return 1;
+    }
+    struct epoll_event events[16];
+    int n = epoll_wait(mon->epoll_fd, events, 16, timeout_ms);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        uint32_t tag = events[i].data.u32;
+        if (tag == POLLED_INOTIFY) {
+            read_events(mon);
+        } else if (tag == POLLED_PIPELINE) {
+            drain_pipeline(mon);
+        } else if (tag == POLLED_RELEASE) {
+            // The held batch is delivered below if it is due
+            uint64_t releases;
+            read(mon->release_fd, &releases, sizeof(releases));
+            if (mon->replay != NULL) {
+                arm_replay_timer(mon);
+            }
+        } else if (tag == POLLED_TIMER) {
+            uint64_t expirations;
+            read(mon->timer_fd, &expirations, sizeof(expirations));
+        } else if (tag == POLLED_REPLAY) {
+            uint64_t expirations;
+            read(mon->replay->timer_fd, &expirations, sizeof(expirations));
+            play_events(mon);
+        } else if (tag == POLLED_METRICS) {
+            uint64_t expirations;
+            read(mon->metrics_fd, &expirations, sizeof(expirations));
+            write_metrics_file(mon);
+        } else if (tag == POLLED_LISTEN) {
+            // Answer queries between events, the listings are brought up
+            // to date by the query itself
+            int client = accept4(mon->listen_fd, NULL, NULL,
+                                 SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client >= 0) {
+                add_request(mon, client);
+            }
+        } else if (tag >= POLLED_REQUEST) {
+            int request = tag - POLLED_REQUEST;
+            if (mon->requests[request].reply != NULL) {
+                send_reply(mon, request);
+            } else {
+                read_request(mon, request);
+            }
+        } else {
+            // Clients only ever write their subscription, anything after it
+            // means they hung up
+            int client = tag - POLLED_CLIENT;
+            char discard[64];
+            if (events[i].events & EPOLLOUT &&
+                mon->subs.clients[client].fd >= 0) {
+                flush_output(mon, client);
+            }
+            if (events[i].events & ~EPOLLOUT &&
+                mon->subs.clients[client].fd >= 0) {
+                ssize_t n = read(mon->subs.clients[client].fd, discard,
+                                 sizeof(discard));
+                if (n == 0 || (n < 0 && errno != EAGAIN)) {
+                    remove_subscriber(mon, client);
+                }
+            }
+        }
+    }
+
+    flush_due(mon);
+    arm_due_timer(mon);
+    if (mon->error != 0) {
+        errno = mon->error;
+        return -1;
+    }
+    return replay_done(mon) ? 1 : 0;
+}
+
+void ggyl_stop(ggyl_watcher *mon) {
+    if (!mon->running) {
+        return;
+    }
+    mon->running = 0;
+    save_snapshot(mon);
+    if (mon->metrics_fd >= 0) {
+        write_metrics_file(mon);
+    }
+    close_watcher(mon);
+}
+
+void ggyl_free(ggyl_watcher *mon) {
+    if (mon == NULL) {
+        return;
+    }
+    ggyl_stop(mon);
+    free_regex_entries(mon);
+    free_dir_table(&mon->dirs);
+    free_path_store(&mon->paths);
+    free_batch(&mon->batch);
+    free_journal(&mon->journal);
+    free(mon->batch_view);
+    free(mon->batch_strings);
+    free(mon->record_buf);
+    free(mon->latency);
+    free(mon->wanted);
+    free(mon);
+}
+
+void ggyl_hold(ggyl_watcher *mon) { atomic_store(&mon->held, 1); }
+
+void ggyl_release(ggyl_watcher *mon) {
+    atomic_store(&mon->held, 0);
+    uint64_t release = 1;
+    write(mon->release_fd, &release, sizeof(release));
+}
+
+void ggyl_get_stats(ggyl_watcher *mon, ggyl_stats *stats) {
+    stats->num_dirs = mon->dirs.count;
+    stats->bytes = dir_table_bytes(&mon->dirs);
+    stats->path_bytes = path_store_bytes(&mon->paths);
+    stats->replayed = mon->replay != NULL ? mon->replay->count : 0;
+    stats->snapshot_changes = mon->snapshot_changes;
+    stats->failed_watches = mon->failed_watches;
+}
+
+int ggyl_is_watched(ggyl_watcher *mon, const char *path) {
+    return is_covered(&mon->dirs, path);
+}
+
+int ggyl_unwatch(ggyl_watcher *mon, const char *path) {
+    return unwatch_path(mon, path);
+}
+
+int ggyl_watch_only(ggyl_watcher *mon, const char *const *dirs,
+                    size_t count) {
+    return watch_only(mon, dirs, count);
+}
+
+void ggyl_count_run(ggyl_watcher *mon, int failed) {
+    add_count(&mon->counters[0], COUNTER_RUNS, 1);
+    if (failed) {
+        add_count(&mon->counters[0], COUNTER_RUNS_FAILED, 1);
+    }
+}
+
+void ggyl_write_metrics(ggyl_watcher *mon, FILE *out) {
+    write_metrics(mon, out);
+}
+
+void ggyl_record_latency(ggyl_watcher *mon, int stage, uint64_t ns) {
+    if (mon->latency != NULL && stage >= 0 && stage < GGYL_NUM_STAGES) {
+        add_latency(&mon->latency[stage], ns);
+    }
+}
+
+void ggyl_print_latency(ggyl_watcher *mon, FILE *out) {
+    if (mon->latency == NULL) {
+        return;
+    }
+    fprintf(out, "%-16s %10s %9s %9s %9s %9s\n", "Stage", "Count", "p50",
+            "p99", "p999", "Max");
+    for (int i = 0; i < GGYL_NUM_STAGES; i++) {
+        latency_histogram *hist = &mon->latency[i];
+        if (hist->count == 0) {
+            fprintf(out, "%-16s %10d %9s %9s %9s %9s\n", stage_names[i], 0,
+                    "-", "-", "-", "-");
+            continue;
+        }
+        char p50[16], p99[16], p999[16], max[16];
+        format_latency(latency_at(hist, 0.5), p50, sizeof(p50));
+        format_latency(latency_at(hist, 0.99), p99, sizeof(p99));
+        format_latency(latency_at(hist, 0.999), p999, sizeof(p999));
+        format_latency(hist->max, max, sizeof(max));
+        fprintf(out, "%-16s %10llu %9s %9s %9s %9s\n", stage_names[i],
+                (unsigned long long)hist->count, p50, p99, p999, max);
+    }
+    fflush(out);
+}
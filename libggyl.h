@@ -0,0 +1,184 @@
+#ifndef LIBGGYL_H
+#define LIBGGYL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ *  libggyl, the watcher behind ggyl as a library.
+ *
+ *  A watcher watches a directory tree with inotify and calls back with
+ *  batches of changes once they settle for the debounce delay. Everything it
+ *  waits on sits behind a single epoll descriptor, so it embeds in any event
+ *  loop: wait for ggyl_fd() to become readable and call ggyl_poll() with a
+ *  timeout of 0, or just call ggyl_poll() in a loop.
+ *
+ *      ggyl_options options;
+ *      ggyl_options_init(&options);
+ *      options.dir = "src";
+ *      ggyl_watcher *watcher = ggyl_new(&options, on_batch, NULL);
+ *      if (watcher == NULL || ggyl_start(watcher) != 0) ...
+ *      while (running) {
+ *          ggyl_poll(watcher, -1);
+ *      }
+ *      ggyl_free(watcher);
+ *
+ *  Hosts serving clients through socket_path should ignore SIGPIPE.
+ */
+
+// Kinds of changes, or'd together when a path changes more than once
+#define GGYL_CREATED 1
+#define GGYL_MODIFIED 2
+#define GGYL_DELETED 4
+#define GGYL_DIR 8
+
+// Kind of an overflow of the kernel queue, which may have hidden any change,
+// as a change of the watched directory itself. Directories are never
+// modified otherwise, so no other change has exactly this kind.
+#define GGYL_OVERFLOW (GGYL_MODIFIED | GGYL_DIR)
+
+// Stages between reading an event and the command it triggers finishing
+#define GGYL_STAGE_MATCH 0    // Reading the event to matching its name
+#define GGYL_STAGE_COALESCE 1 // Matching to adding it to the batch
+#define GGYL_STAGE_DEBOUNCE 2 // First change of a batch to delivering it
+#define GGYL_STAGE_SPAWN 3    // Delivering a batch to its command running
+#define GGYL_STAGE_RUN 4      // Running the command
+#define GGYL_NUM_STAGES 5
+
+typedef struct ggyl_watcher ggyl_watcher;
+
+// A changed path, starting with the watched directory
+typedef struct {
+    const char *path;
+    uint32_t kind;
+} ggyl_change;
+
+// A batch of changes, only valid during the callback
+typedef struct {
+    const ggyl_change *changes;
+    size_t count;
+    uint64_t clock;        // Logical clock of the latest change
+    const char *clock_str; // The clock as "ggyl since" takes it
+} ggyl_batch;
+
+// Called from ggyl_poll() for every batch that settled
+typedef void (*ggyl_batch_fn)(ggyl_watcher *watcher, const ggyl_batch *batch,
+                              void *arg);
+
+// Called with an error the watcher works around, like a directory it can't
+// watch or a snapshot it can't use, the message has no trailing newline.
+// The library never prints, this is how a host hears about such errors.
+typedef void (*ggyl_log_fn)(const char *message, void *arg);
+
+// What to watch and how, see ggyl_options_init() for the defaults
+typedef struct {
+    const char *dir;
+    const char *const *patterns; // Globs matched against file names
+    int num_patterns;            // 0 matches every file
+    int max_depth;               // Levels below dir to watch, -1 for all
+    int lazy_depth;              // Levels watched eagerly, -1 for all
+    int debounce_ms;
+    const char *snapshot_path; // Save and reuse the watched tree, or NULL
+    const char *socket_path;   // Serve queries and subscribers, or NULL
+    const char *ring_path;     // Publish changes into shared memory, or NULL
+    int journal_size;          // Changes kept for "since" queries
+    int daemon;                // Only serve clients, never call back
+    const char *record_path;   // Log every inotify event, or NULL
+    const char *replay_path;   // Play a log instead of watching, or NULL
+    int replay_fast;           // Play the log without its recorded pauses
+    int latency;               // Keep histograms of GGYL_STAGE_* latencies
+    const char *metrics_path;  // Write OpenMetrics text periodically, or NULL
+    int metrics_interval_ms;
+    int threads; // Read inotify on a thread of its own and match large reads
+                 // on threads - 1 more, 0 does it all in ggyl_poll()
+    int shards;  // inotify instances to spread directories over, each read
+                 // by a thread of its own when more than 1, up to 16
+    ggyl_log_fn log; // Told about errors worked around, or NULL
+    void *log_arg;
+} ggyl_options;
+
+// Counters of a watcher
+typedef struct {
+    int num_dirs;
+    size_t bytes;      // Memory held by the watch table
+    size_t path_bytes; // Memory held by the interned paths
+    uint64_t replayed; // Events played from the replay log
+    int snapshot_changes; // Changes found on start since the snapshot was
+                          // saved, -1 when there was no snapshot
+    int failed_watches;   // Directories that couldn't be watched, like when
+                          // fs.inotify.max_user_watches runs out
+} ggyl_stats;
+
+// Set the defaults, the current directory with no limits and 20ms debounce,
+// metrics are written every 10s when there is a metrics_path
+void ggyl_options_init(ggyl_options *options);
+
+// Create a watcher, nothing is watched until ggyl_start()
+// Returns the watcher, NULL with errno set if the options are invalid or it
+// can't be allocated
+ggyl_watcher *ggyl_new(const ggyl_options *options, ggyl_batch_fn on_batch,
+                       void *arg);
+
+// Watch the tree, and run the callback for what changed since the snapshot
+// on the first poll
+// Returns 0 on success, -1 with errno set if the tree can't be watched
+int ggyl_start(ggyl_watcher *watcher);
+
+// Get the descriptor that becomes readable when ggyl_poll() has work
+int ggyl_fd(ggyl_watcher *watcher);
+
+// Wait up to timeout_ms for events, -1 to wait until something happens,
+// then handle them and call back for every batch that settled
+// Returns 0 on success, 1 once the replay log has been played and every
+// batch delivered, and -1 with errno set on errors, like the directory no
+// longer being watchable after an overflow
+int ggyl_poll(ggyl_watcher *watcher, int timeout_ms);
+
+// Stop watching and save the snapshot, the watcher can't be started again
+void ggyl_stop(ggyl_watcher *watcher);
+
+// Stop the watcher if it runs and free it
+void ggyl_free(ggyl_watcher *watcher);
+
+// Hold back batches, changes keep coalescing into the pending batch until
+// ggyl_release(), like while the command of the last batch runs
+void ggyl_hold(ggyl_watcher *watcher);
+
+// Deliver batches again, may be called from any thread
+void ggyl_release(ggyl_watcher *watcher);
+
+// Get the counters of a watcher
+void ggyl_get_stats(ggyl_watcher *watcher, ggyl_stats *stats);
+
+// Check if changes to a path relative to dir are seen, which is when it is a
+// watched directory or an entry of one
+int ggyl_is_watched(ggyl_watcher *watcher, const char *path);
+
+// Add the latency of a stage the host runs, like GGYL_STAGE_SPAWN, which is
+// ignored unless the latency option is set
+void ggyl_record_latency(ggyl_watcher *watcher, int stage, uint64_t ns);
+
+// Write the count, p50, p99, p999 and max latency of every stage to out
+void ggyl_print_latency(ggyl_watcher *watcher, FILE *out);
+
+// Count a run of the command the host started for a batch
+void ggyl_count_run(ggyl_watcher *watcher, int failed);
+
+// Write the counters and gauges of a watcher in the OpenMetrics text format,
+// which the socket also serves for "ggyl metrics"
+void ggyl_write_metrics(ggyl_watcher *watcher, FILE *out);
+
+// Stop watching a directory relative to dir and everything below it
+// Returns the number of directories no longer watched
+int ggyl_unwatch(ggyl_watcher *watcher, const char *path);
+
+// Only watch the directories relative to dir in dirs, and the directories
+// above them so the ones that get removed are watched again once they are
+// created again. Every other directory is unwatched and new ones aren't
+// watched. NULL dirs watches the whole tree again.
+// Returns the number of directories watched
+int ggyl_watch_only(ggyl_watcher *watcher, const char *const *dirs,
+                    size_t count);
+
+#endif
@@ -0,0 +1,519 @@
+#ifndef LIBGGYL_INTERNAL_H
+#define LIBGGYL_INTERNAL_H
+
+#include "ggyl.h"
+#include "ggyl_probes.h"
+#include "ggyl_ring.h"
+
+/*
+ *  Internals of libggyl, only included by libggyl.c. Programs using the
+ *  library see a watcher through libggyl.h alone.
+ */
+
+/* ------------------------------- Patterns ------------------------------- */
+
+#define MAX_WATCHES 1024
+
+// A pattern of the command, plain globs are matched without the regex
+typedef struct {
+    regex_t *regex; // NULL for plain globs
+    int compiled;
+    char *glob; // Only for plain globs
+} regex_entry;
+
+/* ------------------------- Interned Path Store ------------------------- */
+
+/*
+ * Every path ggyl deals with is interned as a (parent, name) pair and handed
+ * around as a 32-bit path ID. Names are hash-consed into one arena so each
+ * distinct component name is stored once, and a path is only turned back into
+ * a string when something outside of ggyl needs it, like the command.
+ *
+ * Path IDs are never freed, so only paths that matter (watched directories and
+ * changes that matched a pattern, or every change while the journal or the
+ * ring keep them) are interned.
+ */
+#define ROOT_PATH 0
+#define NO_PATH UINT32_MAX
+
+typedef struct {
+    uint32_t parent; // NO_PATH for the root
+    uint32_t name;   // Offset of the name in the name arena
+} path_entry;
+
+typedef struct {
+    char *names;
+    uint32_t names_size;
+    uint32_t names_capacity;
+    uint32_t *name_slots; // Name offset + 1, 0 for an empty slot
+    uint32_t num_name_slots;
+    uint32_t num_names;
+    path_entry *paths;
+    uint32_t num_paths;
+    uint32_t paths_capacity;
+    uint32_t *path_slots; // Path ID + 1, 0 for an empty slot
+    uint32_t num_path_slots;
+} path_store;
+
+/* --------------------------- Change Batches --------------------------- */
+
+#define CHANGE_CREATED 1
+#define CHANGE_MODIFIED 2
+#define CHANGE_DELETED 4
+#define CHANGE_DIR 8
+#define CHANGE_OVERFLOW (CHANGE_MODIFIED | CHANGE_DIR) // See GGYL_OVERFLOW
+
+// A change to a path, kinds of repeated changes to a path are or'd together
+typedef struct {
+    uint32_t path;
+    uint32_t kind;
+    uint64_t clock; // Clock of the latest change to the path
+} change_event;
+
+// Changes coalesced while waiting for the debounce delay
+// batch_slots holds the index + 1 of each path's change in the batch, indexed
+// by path ID, so a path is only added once per batch.
+typedef struct {
+    change_event *changes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *batch_slots;
+    uint32_t num_batch_slots;
+    uint64_t clock; // Clock of the latest change in the batch
+} change_batch;
+
+/* ---------------------------- Change Journal ---------------------------- */
+
+#define JOURNAL_SIZE 65536 // Changes kept for "since" queries by default
+
+// A change as it was seen, before it was coalesced into any batch
+typedef struct {
+    uint64_t clock;
+    uint32_t path;
+    uint32_t kind;
+} journal_entry;
+
+// Every change gets the next tick of a logical clock, and the latest changes
+// are kept in a ring. Clocks are only comparable within the same instance.
+typedef struct {
+    journal_entry *entries;
+    uint32_t capacity; // 0 when no changes are kept
+    uint32_t head;     // Next entry to write
+    uint32_t count;
+    uint64_t clock;    // Clock of the latest change
+    uint64_t horizon;  // Every change after this clock is in the journal
+    uint64_t instance; // Tells the clocks of different runs apart
+} change_journal;
+
+/* -------------------------- Shared Memory Ring -------------------------- */
+
+#define RING_CAPACITY 65536      // Records in the ring, a power of two
+#define RING_PATHS (1 << 22)     // Paths the ring's path table holds
+#define RING_STRINGS (64 << 20)  // Bytes of names the ring's string table holds
+
+// Producer side of the ring, the layout is in ggyl_ring.h
+typedef struct {
+    ggyl_ring_header *header;
+    ggyl_ring_record *records;
+    ggyl_ring_entry *paths;
+    char *strings;
+    size_t size;
+    uint32_t strings_size; // Bytes of names copied so far
+    int unwoken;           // Records published since consumers were woken
+} shm_ring;
+
+// An event log being played back instead of reading inotify
+typedef struct {
+    char *data; // The mapped log
+    size_t size;
+    size_t pos; // Offset of the next record
+    int fast;   // Ignore the recorded times between events
+    int timer_fd;
+    int next_wd;        // Directories get made up watch descriptors
+    uint64_t time_ns;   // Recorded time of the last event played
+    uint64_t count;     // Events played so far
+    struct timespec start; // When playback started
+} event_replay;
+
+/* -------------------------- Latency Histograms -------------------------- */
+
+// Latencies below 2 * LATENCY_SUB_BUCKETS nanoseconds get a bucket each,
+// above that every power of two is split into LATENCY_SUB_BUCKETS buckets, so
+// a bucket is never wider than about 3% of what it holds
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((65 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+// Latencies of a stage in nanoseconds
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+/* -------------------------------- Metrics ------------------------------- */
+
+#define METRICS_INTERVAL_MS 10000 // How often --metrics is written by default
+
+// Counters of a watcher, see counter_metrics in libggyl.c for what they count
+#define COUNTER_EVENTS_READ 0
+#define COUNTER_EVENTS_MATCHED 1
+#define COUNTER_EVENTS_DROPPED 2
+#define COUNTER_CHANGES_COALESCED 3
+#define COUNTER_OVERFLOWS 4
+#define COUNTER_BATCHES 5
+#define COUNTER_RUNS 6
+#define COUNTER_RUNS_FAILED 7
+#define COUNTER_REQUESTS 8
+#define COUNTER_DIRS_VALIDATED 9
+#define NUM_COUNTERS 10
+
+// Every thread that counts gets a block of its own, the first belongs to the
+// thread that polls and the rest to the snapshot validators
+#define COUNTER_BLOCKS 17
+
+// Counters of a thread, only ever written by that thread, so counting is a
+// plain load and store. Scrapes add up the blocks of every thread.
+typedef struct {
+    _Alignas(64) _Atomic uint64_t values[NUM_COUNTERS];
+} counter_block;
+
+// Name and help text of a metric
+typedef struct {
+    const char *name;
+    const char *help;
+} metric_info;
+
+/* ------------------------------- Pipeline ------------------------------- */
+
+#define PIPELINE_SLOTS 64        // Reads the reader thread can be ahead
+#define PIPELINE_READ_SIZE 32768 // Bytes of events a single read takes
+#define PIPELINE_MAX_EVENTS (PIPELINE_READ_SIZE / sizeof(struct inotify_event))
+#define MAX_MATCHERS 15
+#define MAX_SHARDS 16 // inotify instances, each with a reader thread
+#define PARALLEL_MATCH_MIN 256 // Events worth splitting across matchers
+#define MATCH_SLICE 64         // Events a matcher takes at a time
+
+// A read of the reader thread
+typedef struct {
+    uint64_t time_ns; // When it was read
+    size_t len;
+    int num_events; // Counted by the polling thread for the matchers
+    char data[PIPELINE_READ_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+} pipeline_read;
+
+// What the name of an event matched, worked out ahead of handle_event()
+typedef struct {
+    int local; // The callback wants it
+    uint64_t clients;
+} event_match;
+
+// An inotify instance and the reader thread that drains it into a ring of
+// reads. The reader is the only producer of the ring and the polling thread
+// its only consumer, so head and tail are all they share, and they double as
+// sequence numbers of the reads.
+typedef struct {
+    pipeline_read *reads;               // PIPELINE_SLOTS of them
+    _Alignas(64) _Atomic uint64_t head; // Reads published by the reader
+    _Alignas(64) _Atomic uint64_t tail; // Reads handled by the polling thread
+    _Atomic int reader_waiting;         // The ring is full and the reader
+                                        // waits on space_fd
+    int fd;         // The inotify instance
+    int shard;      // Index of the instance
+    int num_shards; // Watch descriptors are wd * num_shards + shard
+    int ready_fd;   // Of the pipeline
+    int stop_fd;    // Of the pipeline
+    int space_fd;   // eventfd, written when a full ring has room again
+    int reading;    // The reader thread was started
+    pthread_t reader;
+} shard_reader;
+
+// Threads in front of the polling thread, a reader per inotify instance and
+// the matchers
+typedef struct {
+    shard_reader readers[MAX_SHARDS];
+    int num_readers;
+    int ready_fd; // eventfd, written by the readers after every read
+    int stop_fd;  // eventfd, stops the readers
+    uint8_t order[MAX_SHARDS * PIPELINE_SLOTS]; // Readers of the reads being
+                                                // handled, oldest read first
+    int num_matchers;
+    pthread_t matchers[MAX_MATCHERS];
+    pthread_mutex_t lock; // Guards the job
+    pthread_cond_t start; // A job was started or the matchers stop
+    pthread_cond_t done;  // Every matcher finished the job
+    uint64_t job;         // Jobs started so far
+    int busy;             // Matchers still working on the job
+    int stopping;
+    struct inotify_event **events; // Of the reads being matched
+    event_match *matches;          // Of events, by index
+    int num_events;
+    _Atomic int next_event; // First event no matcher took yet
+} pipeline;
+
+/* ---------------------------- Subscriptions ----------------------------- */
+
+// Clients are tracked in a 64 bit mask
+#define MAX_CLIENTS 64
+
+// Unsent output a client may fall behind by before it is dropped
+#define MAX_BACKLOG (4 << 20)
+
+// A pattern shared by every client that subscribed with it, so each unique
+// pattern is matched once per event
+typedef struct {
+    char *glob;
+    int plain; // Matched as a glob, the regex isn't compiled
+    regex_t regex;
+    uint64_t clients; // Clients subscribed with the pattern
+} shared_pattern;
+
+// A client of the daemon with its own debounce delay and batch of changes
+typedef struct {
+    int fd; // -1 when the slot is free
+    int debounce_us;
+    struct timespec due; // When the batch is sent, if it has changes
+    change_batch batch;
+    char *out; // Batches the socket didn't take yet, sent on EPOLLOUT
+    size_t out_len;
+    size_t out_sent; // Bytes of out already sent
+    size_t out_capacity;
+    int polling_out; // EPOLLOUT is on while out has unsent bytes
+} subscriber;
+
+// Subscribers and the combined matcher of their patterns
+typedef struct {
+    subscriber clients[MAX_CLIENTS];
+    uint64_t active;    // Connected clients
+    uint64_t match_all; // Clients without patterns
+    shared_pattern *patterns;
+    int num_patterns;
+    int capacity;
+} subscriptions;
+
+// Clients of the control socket that haven't sent their whole request or
+// been sent their whole reply yet, the one that connected first is dropped to
+// make room for another
+#define MAX_REQUESTS 16
+
+// Largest reply a client is sent, a bigger one is answered with an error
+#define MAX_REPLY (16 << 20)
+
+// A request line read as it arrives, then its reply as the client takes it
+typedef struct {
+    int fd;            // -1 when the slot is free
+    int len;           // Bytes of line read so far
+    uint64_t accepted; // Order in which the clients connected
+    char line[MAX_LEN];
+    char *reply; // Sent on EPOLLOUT once the line is answered, else NULL
+    size_t reply_len;
+    size_t reply_sent; // Bytes of reply already sent
+} pending_request;
+
+// Metadata of a file in a watched directory
+typedef struct {
+    uint32_t name; // Offset of the name in the path store
+    unsigned char type;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} file_meta;
+
+/* ---------------------- Watched Directory Table ------------------------ */
+
+/*
+ * Watched directories live in a flat table instead of a node_t tree. Each row
+ * links to its parent, first child, and next sibling by row index, and holds
+ * the path ID of the directory. The rows and watch descriptor map are each one
+ * allocation that grows by doubling, so walking the table is a scan over
+ * contiguous memory and freeing it is a handful of free() calls.
+ *
+ * Rows of removed directories are chained through next_sibling into a free
+ * list and reused before the table grows.
+ */
+#define ROOT_DIR 0
+
+#define DIR_EXPANDED 1 // Subdirectories are being watched
+#define DIR_LISTED 2   // The file listing was read, only with listings
+#define DIR_DIRTY 4    // Something changed since the file listing was read
+#define DIR_FREE 8     // Row is on the free list
+
+typedef struct {
+    int32_t parent;
+    int32_t first_child;
+    int32_t prev_sibling;
+    int32_t next_sibling;
+    int32_t wd;
+    uint32_t path;
+    int32_t snap_index;
+    uint16_t depth;
+    uint16_t flags;
+} watch_dir;
+
+// File listing of a watched directory, only kept for snapshots and queries
+typedef struct {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    file_meta *files;
+    int num_files;
+} dir_listing;
+
+// Slot of the open addressing map from watch descriptors to rows
+typedef struct {
+    int32_t wd; // -1 for an empty slot
+    int32_t row;
+} wd_slot;
+
+typedef struct {
+    watch_dir *dirs;
+    int32_t num_dirs; // Rows handed out, including free rows
+    int32_t capacity;
+    int32_t free_head;
+    int32_t count; // Directories being watched
+    path_store *store;
+    wd_slot *wd_slots;
+    uint32_t num_wd_slots;
+    uint32_t num_wds;
+    int32_t *path_rows; // Row of each path ID, -1 if it isn't watched
+    uint32_t num_path_rows;
+    dir_listing *listings; // Parallel to dirs when keep_listings is set
+    int keep_listings;
+} dir_table;
+
+/* -------------------------- Snapshot Definitions ------------------------- */
+
+/*
+ * A snapshot is laid out so it can be used straight from mmap:
+ *
+ * snapshot_header | snapshot_dir[num_dirs] | snapshot_file[num_files] | strings
+ *
+ * Directories are stored in pre-order so a parent always comes before its
+ * children. Names are offsets into the string table, and each directory's
+ * files are sorted by name so they can be searched with bsearch.
+ */
+#define SNAPSHOT_MAGIC "GGYLSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_LISTED 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t root;
+    uint32_t num_dirs;
+    uint32_t num_files;
+    uint32_t strings_size;
+    uint32_t pad;
+} snapshot_header;
+
+typedef struct {
+    int32_t parent;
+    int32_t first_child;
+    int32_t next_sibling;
+    uint32_t name;
+    uint32_t first_file;
+    uint32_t num_files;
+    uint32_t flags;
+    uint32_t pad;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} snapshot_dir;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} snapshot_file;
+
+// A snapshot mapped into memory along with the results of validating it
+typedef struct {
+    void *map;
+    size_t map_size;
+    snapshot_header *header;
+    snapshot_dir *dirs;
+    snapshot_file *files;
+    const char *strings;
+    unsigned char *valid; // Directory listing still matches the disk
+    unsigned char *dirty; // A file in the directory changed since the snapshot
+} snapshot_t;
+
+// What an epoll event of a watcher is for, subscribers are POLLED_CLIENT +
+// slot and requests being read are POLLED_REQUEST + slot
+#define POLLED_INOTIFY 0
+#define POLLED_TIMER 1
+#define POLLED_LISTEN 2
+#define POLLED_REPLAY 3
+#define POLLED_METRICS 4
+#define POLLED_PIPELINE 5
+#define POLLED_RELEASE 6
+#define POLLED_CLIENT 7
+#define POLLED_REQUEST (POLLED_CLIENT + MAX_CLIENTS)
+
+// State of a watcher, the handle of libggyl
+typedef struct ggyl_watcher {
+    int fds[MAX_SHARDS]; // inotify instances, directories are spread over
+    int num_shards;      // them by path ID
+    char dir[MAX_LEN];
+    regex_entry **regex_entries;
+    int num_patterns;
+    uint32_t mask;
+    int max_depth;  // Deepest directory level to watch, -1 for no limit
+    int lazy_depth; // Levels watched eagerly before going lazy, -1 for all
+    char snapshot_path[MAX_LEN]; // Empty when snapshots are disabled
+    snapshot_t *snapshot;        // Only mapped while building the watch tree
+    char socket_path[MAX_LEN];   // Empty when queries are disabled
+    int listen_fd;               // Control socket, -1 when queries are disabled
+    int daemon;                  // Only serve clients, never call back
+    int debounce_us;             // Quiet time before a batch is delivered
+    struct timespec now;         // Time the current events were read
+    struct timespec due;         // When the pending batch is delivered
+    subscriptions subs;
+    pending_request requests[MAX_REQUESTS];
+    uint64_t accepted; // Clients accepted so far
+    change_journal journal;
+    int journal_size; // Changes kept when the socket is enabled
+    char ring_path[MAX_LEN]; // Empty when the ring is disabled
+    shm_ring *ring;
+    ggyl_batch_fn on_batch;
+    void *on_batch_arg;
+    ggyl_log_fn log; // Errors worked around go here, never to stderr
+    void *log_arg;
+    int failed_watches; // Directories inotify_add_watch() failed on
+    ggyl_change *batch_view; // The batch as the callback sees it
+    uint32_t batch_view_capacity;
+    char *batch_strings; // Paths of batch_view
+    size_t batch_strings_capacity;
+    int epoll_fd; // Everything ggyl_poll() waits on
+    int timer_fd; // Fires when the earliest batch is due
+    int running;
+    int error; // errno of a failure ggyl_poll() reports, 0 if none
+    int snapshot_changes; // Found on start, -1 without a snapshot
+    char record_path[MAX_LEN]; // Empty when events aren't recorded
+    int record_fd;
+    struct timespec record_start;
+    char *record_buf; // Records of a read, written at once
+    size_t record_capacity;
+    char replay_path[MAX_LEN]; // Empty when events come from inotify
+    int replay_fast;
+    event_replay *replay;
+    latency_histogram *latency; // One per GGYL_STAGE_*, NULL when not timed
+    uint64_t read_ns;           // When the current events were read
+    uint64_t batch_ns; // When the pending batch got its first change, or 0
+    counter_block counters[COUNTER_BLOCKS];
+    char metrics_path[MAX_LEN]; // Empty when metrics aren't written to a file
+    int metrics_interval_ms;
+    int metrics_fd; // Fires when the metrics file is due
+    int threads;    // Reader and matcher threads to start
+    pipeline *pipeline; // NULL when the polling thread reads inotify itself
+    _Atomic int held;   // Batches are held back until ggyl_release()
+    int release_fd;     // eventfd, written by ggyl_release()
+    path_store paths;
+    dir_table dirs;
+    change_batch batch;
+    unsigned char *wanted; // By path ID, the only directories to watch after
+    uint32_t num_wanted;   // ggyl_watch_only(), NULL to watch all of them
+} monitor_t;
+
+#endif
@@ -1,7 +1,384 @@
-#include "ggyl.h"
+// The command line helpers are static, so ggyl.c is built in with its main
+// renamed
+#define main ggyl_main
+#include "ggyl.c"
+#undef main
+#include "ggyl_glob.h"
 
 void add_1(int *data) { *data += 1; }
 
+// Match every name against every plain glob both ways, match_name() has to
+// agree with the regex the pattern would otherwise compile to
+// Returns the number of disagreements
+int test_globs() {
+    const char *globs[] = {"*.c",    "a?c",     "[abc]x", "[!abc]x",
+                           "[a-c]*", "[]a]",    "[a-]b",  "*[0-9]*.txt",
+                           "**",     "*a*b*c*", "[!]x",   "x[z-]"};
+    const char *names[] = {"main.c", "main.h", "abc",     "a.c",   "ax",
+                           "dx",     "!x",     "]",       "a",     "-b",
+                           "ab",     "v2.txt", "v.txt",   "aXbYc", "x-",
+                           "xz",     "xy",     "ba.c.cc", "",      "[!]x"};
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(globs) / sizeof(globs[0]); i++) {
+        if (!is_plain_glob(globs[i])) {
+            fprintf(stderr, "%s should be a plain glob\n", globs[i]);
+            failures++;
+            continue;
+        }
+        char pattern[MAX_LEN];
+        regex_t regex;
+        glob_to_regex(globs[i], pattern);
+        if (regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            fprintf(stderr, "%s doesn't compile as %s\n", globs[i], pattern);
+            failures++;
+            continue;
+        }
+        for (size_t j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+            int glob = match_name(globs[i], names[j]);
+            int re = regexec(&regex, names[j], 0, NULL, 0) == 0;
+            if (glob != re) {
+                fprintf(stderr, "%s on \"%s\": glob %d, regex %d\n",
+                        globs[i], names[j], glob, re);
+                failures++;
+            }
+        }
+        regfree(&regex);
+    }
+
+    // Classes the regex reads differently are left to it
+    const char *regexes[] = {"[^a]x", "[.]c", "[*]", "[[:alpha:]]", "[a",
+                             "a|b",   "x["};
+    for (size_t i = 0; i < sizeof(regexes) / sizeof(regexes[0]); i++) {
+        if (is_plain_glob(regexes[i])) {
+            fprintf(stderr, "%s shouldn't be a plain glob\n", regexes[i]);
+            failures++;
+        }
+    }
+    printf("Glob tests: %d failures\n", failures);
+    return failures;
+}
+
+// Write the trace of a run of cmd, the files are relative to the watched
+// directory
+static void write_trace(input_tracer *tracer, const char *const *files,
+                        size_t count) {
+    FILE *file = fopen(tracer->path, "w");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(file, "%s/%s\n", tracer->root, files[i]);
+    }
+    fclose(file);
+}
+
+// Run a change through the input tracer
+// Returns 1 if it would run cmd
+static int runs_cmd(input_tracer *tracer, const char *path, uint32_t kind) {
+    ggyl_change change = {path, kind};
+    ggyl_batch batch = {&change, 1, 0, ""}, rest;
+    return drop_unread(tracer, &batch, &rest);
+}
+
+// Trace a build and then an incremental one that only stats the sources it
+// doesn't rebuild, a source only the first run read still has to run cmd
+// until it is deleted
+// Returns the number of failures
+int test_trace() {
+    char dir[] = "/tmp/ggyl_test_trace_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    input_tracer tracer;
+    memset(&tracer, 0, sizeof(tracer));
+    tracer.dir = dir;
+    tracer.narrowed = 1;
+    pthread_mutex_init(&tracer.lock, NULL);
+    strcpy(tracer.root, dir);
+    snprintf(tracer.path, sizeof(tracer.path), "%s.trace", dir);
+
+    const char *full[] = {"Makefile", "a.c", "src/b.c"};
+    const char *incremental[] = {"Makefile", "a.c"};
+    write_trace(&tracer, full, 3);
+    read_trace(&tracer);
+    write_trace(&tracer, incremental, 2);
+    read_trace(&tracer);
+
+    char a[MAX_LEN], b[MAX_LEN], c[MAX_LEN];
+    snprintf(a, sizeof(a), "%s/a.c", dir);
+    snprintf(b, sizeof(b), "%s/src/b.c", dir);
+    snprintf(c, sizeof(c), "%s/c.c", dir);
+    int failures = 0;
+    if (!runs_cmd(&tracer, b, GGYL_MODIFIED)) {
+        fprintf(stderr, "A source the last run didn't read was dropped\n");
+        failures++;
+    }
+    if (tracer.num_dirs != 2 || tracer.num_files != 3) {
+        fprintf(stderr, "Traced %zu directories and %zu files instead of 2 "
+                        "and 3\n",
+                tracer.num_dirs, tracer.num_files);
+        failures++;
+    }
+    if (runs_cmd(&tracer, c, GGYL_MODIFIED)) {
+        fprintf(stderr, "A file cmd never read ran it\n");
+        failures++;
+    }
+
+    // a.c never existed, so deleting it is final
+    if (!runs_cmd(&tracer, a, GGYL_DELETED) ||
+        runs_cmd(&tracer, a, GGYL_MODIFIED) || tracer.num_files != 2) {
+        fprintf(stderr, "A deleted input is still an input\n");
+        failures++;
+    }
+
+    unlink(tracer.path);
+    rmdir(dir);
+    free(tracer.changes);
+    printf("Trace tests: %d failures\n", failures);
+    return failures;
+}
+
+// Write a file of the watched directory
+static void write_file(const char *dir, const char *name, const char *text) {
+    char path[MAX_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *file = fopen(path, "w");
+    fputs(text, file);
+    fclose(file);
+}
+
+// Run a change through the input tracer and the fingerprints
+// Returns 1 if it would run cmd
+static int runs_fingerprinted(cli_t *run, const char *path, uint32_t kind) {
+    ggyl_change change = {path, kind};
+    ggyl_batch batch = {&change, 1, 0, ""}, rest;
+    return drop_unread(run->tracer, &batch, &rest) &&
+           check_fingerprint(run, &rest);
+}
+
+// Fingerprint traced runs that have their inputs edited while they run, the
+// results have to be kept under the inputs as cmd found them. New files next
+// to the inputs aren't covered by them, so they always run cmd.
+// Returns the number of failures
+int test_fingerprints() {
+    char dir[] = "/tmp/ggyl_test_fingerprints_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    input_tracer tracer;
+    memset(&tracer, 0, sizeof(tracer));
+    tracer.dir = dir;
+    tracer.narrowed = 1;
+    pthread_mutex_init(&tracer.lock, NULL);
+    strcpy(tracer.root, dir);
+    snprintf(tracer.path, sizeof(tracer.path), "%s.trace", dir);
+    char cache_path[MAX_LEN];
+    snprintf(cache_path, sizeof(cache_path), "%s.fingerprints", dir);
+    ggyl_options options;
+    ggyl_options_init(&options);
+    options.dir = dir;
+    cli_t run;
+    memset(&run, 0, sizeof(run));
+    run.tracer = &tracer;
+    run.fingerprints = start_fingerprints(cache_path, &options, "make", 1);
+
+    // a.c is edited while the run that read it goes on
+    const char *first[] = {"a.c"};
+    write_file(dir, "a.c", "1");
+    write_trace(&tracer, first, 1);
+    read_trace(&tracer);
+    begin_fingerprint(&run);
+    write_file(dir, "a.c", "22");
+    record_run(&run, 0);
+    char path[MAX_LEN];
+    snprintf(path, sizeof(path), "%s/a.c", dir);
+    int failures = 0;
+    if (!runs_fingerprinted(&run, path, GGYL_MODIFIED)) {
+        fprintf(stderr, "An edit made while cmd ran was taken as seen\n");
+        failures++;
+    }
+
+    // b.c is read for the first time and edited while the run goes on, so
+    // nobody knows what it read
+    const char *second[] = {"a.c", "b.c"};
+    write_file(dir, "b.c", "1");
+    begin_fingerprint(&run);
+    write_file(dir, "b.c", "22");
+    write_trace(&tracer, second, 2);
+    read_trace(&tracer);
+    int num_results = run.fingerprints->num_results;
+    record_run(&run, 0);
+    if (run.fingerprints->num_results != num_results) {
+        fprintf(stderr, "A run that read a file edited meanwhile was kept\n");
+        failures++;
+    }
+
+    // Nothing changes during the next one, which is kept
+    begin_fingerprint(&run);
+    read_trace(&tracer);
+    record_run(&run, 0);
+    if (runs_fingerprinted(&run, path, GGYL_MODIFIED)) {
+        fprintf(stderr, "A run with nothing edited meanwhile wasn't kept\n");
+        failures++;
+    }
+
+    // c.c is new next to the inputs, and an overflow may have hidden one,
+    // while the inputs still sum to the run that was kept
+    write_file(dir, "c.c", "1");
+    snprintf(path, sizeof(path), "%s/c.c", dir);
+    if (!runs_fingerprinted(&run, path, GGYL_CREATED)) {
+        fprintf(stderr, "A new file next to the inputs was skipped\n");
+        failures++;
+    }
+    if (!runs_fingerprinted(&run, dir, GGYL_OVERFLOW)) {
+        fprintf(stderr, "An overflow was skipped\n");
+        failures++;
+    }
+    if (runs_fingerprinted(&run, path, GGYL_MODIFIED)) {
+        fprintf(stderr, "A file cmd never read ran it\n");
+        failures++;
+    }
+
+    const char *names[] = {"a.c", "b.c", "c.c"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        unlink(path);
+    }
+    unlink(cache_path);
+    unlink(tracer.path);
+    rmdir(dir);
+    free(tracer.changes);
+    printf("Fingerprint tests: %d failures\n", failures);
+    return failures;
+}
+
+// Get the node of a path of the include graph, present on disk
+static uint32_t present_node(include_graph *graph, const char *path) {
+    uint32_t id = get_node(graph, path);
+    graph->nodes[id].present = 1;
+    return id;
+}
+
+// Check if a list separated by newlines holds a line
+static int has_line(const char *list, const char *line) {
+    size_t len = strlen(line);
+    for (const char *p = list; p != NULL; p = strchr(p, '\n')) {
+        p += *p == '\n';
+        if (strncmp(p, line, len) == 0 && (p[len] == '\n' || !p[len])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Check the units a batch of one change affects
+// Returns the number of failures
+static int check_affected(include_graph *graph, const char *path,
+                          uint32_t kind, const char *const *units,
+                          size_t count) {
+    ggyl_change change = {path, kind};
+    ggyl_batch batch = {&change, 1, 0, ""};
+    const char *affected = affected_units(graph, &batch);
+    affected += strlen("GGYL_AFFECTED=");
+    size_t lines = *affected != '\0';
+    for (const char *p = affected; (p = strchr(p, '\n')) != NULL; p++) {
+        lines++;
+    }
+    int failures = lines != count;
+    for (size_t i = 0; i < count; i++) {
+        failures += !has_line(affected, units[i]);
+    }
+    if (failures > 0) {
+        fprintf(stderr, "%s affected \"%s\"\n", path, affected);
+    }
+    return failures > 0;
+}
+
+// Normalize paths, parse a .d file, resolve includes and find the units
+// changes affect, with ggyl running in /work
+// Returns the number of failures
+int test_includes() {
+    include_graph graph;
+    memset(&graph, 0, sizeof(graph));
+    strcpy(graph.cwd, "/work");
+    int failures = 0;
+
+    const char *paths[][2] = {
+        {"a/./b//c", "a/b/c"},   {"a/../b", "b"},
+        {"../a", "../a"},        {"a/../../b", "../b"},
+        {"../../a/..", "../.."}, {"/work/src/x.c", "src/x.c"},
+        {"/work", "/work"},      {"/workshop/a", "/workshop/a"},
+        {"/other/../x", "/x"},   {"/..", "/"},
+        {"./", ""},              {"src/", "src"}};
+    char path[MAX_LEN];
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        normalize_path(&graph, paths[i][0], strlen(paths[i][0]), path,
+                       sizeof(path));
+        if (strcmp(path, paths[i][1]) != 0) {
+            fprintf(stderr, "%s normalized to %s instead of %s\n",
+                    paths[i][0], path, paths[i][1]);
+            failures++;
+        }
+    }
+
+    // The rule of a .d file goes on over continued lines, and ends there
+    uint32_t a = present_node(&graph, "src/a.c");
+    uint32_t local = present_node(&graph, "src/local.h");
+    uint32_t lib = present_node(&graph, "include/lib/x.h");
+    present_node(&graph, "other/ax.h");
+    char deps[] = "obj/a.o: /work/src/a.c \\\n include/lib/x.h \\\n"
+                  "  ./src/local.h\n\nsrc/local.h:\n";
+    graph.text = deps;
+    uint32_t unit, count = parse_deps(&graph, &unit, strlen(deps));
+    if (unit != a || count != 2 || graph.found[0] != lib ||
+        graph.found[1] != local) {
+        fprintf(stderr, "Parsed a .d file into %u edges\n", count);
+        failures++;
+    }
+    graph.text = NULL;
+
+    // Includes are found next to the file, and then by their suffix on a
+    // component boundary
+    struct {
+        const char *name;
+        const char *path;
+    } includes[] = {{"local.h", "src/local.h"},
+                    {"lib/x.h", "include/lib/x.h"},
+                    {"../include/lib/x.h", "include/lib/x.h"},
+                    {"x.h", "include/lib/x.h"},
+                    {"b/x.h", "src/b/x.h"},
+                    {"missing.h", "src/missing.h"}};
+    for (size_t i = 0; i < sizeof(includes) / sizeof(includes[0]); i++) {
+        uint32_t id = resolve_include(&graph, a, includes[i].name,
+                                      strlen(includes[i].name));
+        if (strcmp(graph.nodes[id].path, includes[i].path) != 0) {
+            fprintf(stderr, "%s resolved to %s instead of %s\n",
+                    includes[i].name, graph.nodes[id].path,
+                    includes[i].path);
+            failures++;
+        }
+    }
+
+    // src/a.c includes a header of lib, and everything below a directory
+    // is affected by it
+    present_node(&graph, "src/b.c");
+    uint32_t c = present_node(&graph, "lib/c.c");
+    uint32_t header = present_node(&graph, "lib/c.h");
+    set_edges(&graph, a, NO_NODE, &header, 1);
+    set_edges(&graph, c, NO_NODE, &header, 1);
+    const char *in_src[] = {"src/a.c", "src/b.c"};
+    const char *in_lib[] = {"lib/c.c", "src/a.c"};
+    const char *every[] = {"src/a.c", "src/b.c", "lib/c.c"};
+    failures += check_affected(&graph, "/work/src/b.c", GGYL_MODIFIED,
+                               in_src + 1, 1);
+    failures += check_affected(&graph, "/work/src", GGYL_CREATED | GGYL_DIR,
+                               in_src, 2);
+    failures += check_affected(&graph, "/work/lib", GGYL_DELETED | GGYL_DIR,
+                               in_lib, 2);
+    failures += check_affected(&graph, "/work", GGYL_OVERFLOW, every, 3);
+    printf("Include tests: %d failures\n", failures);
+    return failures;
+}
+
 int main() {
     int_list *list =
         create_list(int, free_int, compare_int, int_to_str, print_int);
@@ -40,5 +417,10 @@ int main() {
 
     free_tree(tree);
 
+    if (test_globs() != 0 || test_trace() != 0 ||
+        test_fingerprints() != 0 || test_includes() != 0) {
+        return 1;
+    }
+
     return 0;
 }
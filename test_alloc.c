@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include "ggyl.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+
+/*
+ * Checks that the steady state of the event path never touches the heap.
+ *
+ * A log of a few cycles of edits, creates, deletes, renames and directory
+ * churn is replayed through a watcher with the journal, the ring and the
+ * latency histograms on. Once the first cycles have grown every buffer to
+ * size, malloc and friends are counted until the log has been played, and
+ * any allocation fails the test.
+ */
+
+#define CYCLES 20
+#define WARM_CYCLES 5
+#define FILES 50
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static int counting;
+static uint64_t allocations;
+static void *first_caller; // Of the first allocation that was counted
+
+// Count an allocation made by caller
+static void count_allocation(void *caller) {
+    if (counting) {
+        if (allocations++ == 0) {
+            first_caller = caller;
+        }
+    }
+}
+
+void *malloc(size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr != NULL ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_memalign(alignment, size);
+}
+
+/* -------------------------------- Workload ------------------------------ */
+
+// Log being written
+typedef struct {
+    FILE *out;
+    uint64_t time_ns;
+    uint64_t events;
+} workload;
+
+// Append an event to the log, 1ms after the last one
+static void add_event(workload *w, uint32_t mask, uint32_t cookie,
+                      const char *dir, const char *name) {
+    w->time_ns += 1000000;
+    event_log_record record = {w->time_ns, mask, cookie,
+                               (uint16_t)strlen(dir), (uint16_t)strlen(name)};
+    fwrite(&record, sizeof(record), 1, w->out);
+    fwrite(dir, 1, record.dir_len, w->out);
+    fwrite(name, 1, record.name_len, w->out);
+    w->events++;
+}
+
+// Let the pending batch settle
+static void pause_events(workload *w) { w->time_ns += 50000000; }
+
+// Write a cycle of the workload, every cycle touches the same paths
+static void add_cycle(workload *w) {
+    char name[64];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "f%d.c", i);
+        add_event(w, IN_MODIFY, 0, "src", name);
+        snprintf(name, sizeof(name), "g%d.h", i);
+        add_event(w, IN_MODIFY, 0, "src/lib", name);
+        add_event(w, IN_MODIFY, 0, "src/lib", name);
+    }
+    pause_events(w);
+
+    // Editors save through a temporary file, and builds write objects
+    add_event(w, IN_CREATE, 0, "src", "tmp.c");
+    add_event(w, IN_MODIFY, 0, "src", "tmp.c");
+    add_event(w, IN_MOVED_FROM, 1, "src", "tmp.c");
+    add_event(w, IN_MOVED_TO, 1, "src", "f0.c");
+    add_event(w, IN_MODIFY, 0, "", "main.o");
+    add_event(w, IN_ATTRIB, 0, "src", "f1.c");
+    pause_events(w);
+
+    // Directories come and go
+    add_event(w, IN_CREATE | IN_ISDIR, 0, "src", "gen");
+    add_event(w, IN_CREATE, 0, "src/gen", "out.c");
+    add_event(w, IN_DELETE, 0, "src/gen", "out.c");
+    add_event(w, IN_DELETE | IN_ISDIR, 0, "src", "gen");
+    pause_events(w);
+
+    add_event(w, IN_Q_OVERFLOW, 0, "", "");
+    pause_events(w);
+}
+
+/* --------------------------------- Test --------------------------------- */
+
+static uint64_t warm_events;
+static uint64_t batches;
+
+// Count batches, and allocations once the warm up cycles have been played
+static void on_batch(ggyl_watcher *watcher, const ggyl_batch *batch,
+                     void *arg) {
+    (void)batch;
+    (void)arg;
+    ggyl_stats stats;
+    ggyl_get_stats(watcher, &stats);
+    counting = stats.replayed >= warm_events;
+    batches++;
+}
+
+int main() {
+    char log_path[] = "/tmp/ggyl_test_alloc_XXXXXX";
+    int fd = mkstemp(log_path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    workload w = {fdopen(fd, "w"), 0, 0};
+    event_log_start start = {EVENT_LOG_MAGIC, EVENT_LOG_VERSION, 0};
+    fwrite(&start, sizeof(start), 1, w.out);
+    for (int i = 0; i < CYCLES; i++) {
+        add_cycle(&w);
+        if (i == WARM_CYCLES - 1) {
+            warm_events = w.events;
+        }
+    }
+    fclose(w.out);
+
+    const char *patterns[] = {"*.c", "[fg]*.h", "Makefile"};
+    char socket_path[64], ring_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/ggyl_test_alloc_%d.sock",
+             (int)getpid());
+    snprintf(ring_path, sizeof(ring_path), "/dev/shm/ggyl_test_alloc_%d.ring",
+             (int)getpid());
+    ggyl_options options;
+    ggyl_options_init(&options);
+    options.dir = "tree";
+    options.patterns = patterns;
+    options.num_patterns = 3;
+    options.replay_path = log_path;
+    options.replay_fast = 1;
+    options.socket_path = socket_path;
+    options.journal_size = 1024;
+    options.ring_path = ring_path;
+    options.latency = 1;
+
+    ggyl_watcher *watcher = ggyl_new(&options, on_batch, NULL);
+    if (watcher == NULL || ggyl_start(watcher) != 0) {
+        perror(log_path);
+        unlink(log_path);
+        return EXIT_FAILURE;
+    }
+    int ret;
+    while ((ret = ggyl_poll(watcher, -1)) == 0) {
+    }
+    counting = 0;
+    ggyl_free(watcher);
+    unlink(log_path);
+    if (ret < 0) {
+        perror("ggyl_poll");
+        return EXIT_FAILURE;
+    }
+
+    printf("Replayed %llu events in %llu batches, %llu allocations after "
+           "warming up\n",
+           (unsigned long long)w.events, (unsigned long long)batches,
+           (unsigned long long)allocations);
+    if (allocations > 0) {
+        // addr2line -f -e <file> <offset> tells where it came from
+        Dl_info info;
+        if (dladdr(first_caller, &info) && info.dli_fname != NULL) {
+            printf("First allocation from %s+%#lx\n", info.dli_fname,
+                   (unsigned long)((char *)first_caller -
+                                   (char *)info.dli_fbase));
+        }
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include "ggyl.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+/*
+ * Checks that directories renamed between parents on different shards stay
+ * watched.
+ *
+ * The MOVED_FROM and MOVED_TO of such a rename come from two inotify
+ * instances, so the reads that carry them are merged by time and may be
+ * handled in either order. A directory watched under its new name before its
+ * old name is removed shares the watch with it when both names land on the
+ * same shard. A directory is renamed back and forth between parents many
+ * times, and once both names of a rename came out in a batch, a file is
+ * written in it and in its subdirectory, and both have to come out too.
+ */
+
+#define PARENTS 8
+#define SHARDS 4
+#define RENAMES 64
+#define WAIT_MS 2000
+
+static char root[64];
+static char want[2][MAX_LEN]; // Paths still to be seen, empty once seen
+
+// Cross off the wanted paths that are in the batch
+static void on_batch(ggyl_watcher *watcher, const ggyl_batch *batch,
+                     void *arg) {
+    (void)watcher;
+    (void)arg;
+    for (size_t i = 0; i < batch->count; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (strcmp(batch->changes[i].path, want[j]) == 0) {
+                want[j][0] = '\0';
+            }
+        }
+    }
+}
+
+// Poll until every wanted path was seen
+// Returns 0 once they were, -1 if they weren't within WAIT_MS
+static int wait_for_wanted(ggyl_watcher *watcher) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (want[0][0] != '\0' || want[1][0] != '\0') {
+        if (ggyl_poll(watcher, 10) < 0) {
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 +
+                (now.tv_nsec - start.tv_nsec) / 1000000 >
+            WAIT_MS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write a file
+static void write_file(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        write(fd, "x", 1);
+        close(fd);
+    }
+}
+
+// Remove a file or directory of the tree
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main() {
+    snprintf(root, sizeof(root), "/tmp/ggyl_test_shards_%d", (int)getpid());
+    char path[MAX_LEN], to[MAX_LEN];
+    mkdir(root, 0755);
+    for (int i = 0; i < PARENTS; i++) {
+        snprintf(path, sizeof(path), "%s/p%d", root, i);
+        mkdir(path, 0755);
+    }
+    snprintf(path, sizeof(path), "%s/p0/moved", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/p0/moved/sub", root);
+    mkdir(path, 0755);
+
+    ggyl_options options;
+    ggyl_options_init(&options);
+    options.dir = root;
+    options.debounce_ms = 1;
+    options.shards = SHARDS;
+    ggyl_watcher *watcher = ggyl_new(&options, on_batch, NULL);
+    if (watcher == NULL || ggyl_start(watcher) != 0) {
+        perror(root);
+        nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return EXIT_FAILURE;
+    }
+
+    int parent = 0, lost = -1;
+    for (int i = 0; i < RENAMES && lost < 0; i++) {
+        int next = (parent + 1 + i % (PARENTS - 1)) % PARENTS;
+        snprintf(path, sizeof(path), "%s/p%d/moved", root, parent);
+        snprintf(to, sizeof(to), "%s/p%d/moved", root, next);
+        if (rename(path, to) != 0) {
+            perror(to);
+            lost = i;
+            break;
+        }
+
+        // Files written before both events of the rename are handled could
+        // land between the old watch going and the new one coming
+        strcpy(want[0], path);
+        strcpy(want[1], to);
+        if (wait_for_wanted(watcher) != 0) {
+            lost = i;
+            break;
+        }
+        parent = next;
+
+        snprintf(want[0], MAX_LEN, "%s/p%d/moved/f%d", root, parent, i);
+        write_file(want[0]);
+        snprintf(want[1], MAX_LEN, "%s/p%d/moved/sub/f%d", root, parent, i);
+        write_file(want[1]);
+        if (wait_for_wanted(watcher) != 0) {
+            lost = i;
+        }
+    }
+    ggyl_free(watcher);
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    if (lost >= 0) {
+        printf("Lost the renamed directory after %d renames across %d "
+               "shards, %s %s never came\n",
+               lost + 1, SHARDS, want[0], want[1]);
+        return EXIT_FAILURE;
+    }
+    printf("Renamed a directory %d times across %d shards, every write "
+           "seen\n",
+           RENAMES, SHARDS);
+    return EXIT_SUCCESS;
+}
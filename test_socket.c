@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "ggyl.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Checks the control socket against clients that misbehave.
+ *
+ * A client asks for every file of a tree big enough that the reply doesn't
+ * fit in the socket buffer, and then doesn't read it. Batches still have to
+ * come out and other clients still have to be answered, and the reply is
+ * whole once the client gets around to reading it.
+ *
+ * The journal behind "since" is kept small so it fills up. A clock still in
+ * it gets the net changes made after it, and one compacted away gets a
+ * resync.
+ */
+
+#define DIRS 16
+#define FILES 10000
+#define WAIT_MS 2000
+#define JOURNAL 64
+
+// A watcher stuck writing to a client never returns from ggyl_poll(), the
+// alarm ends the test instead
+#define ALARM_S 30
+
+static char root[64];
+static char socket_path[64];
+static char want[MAX_LEN];  // Path still to be seen, empty once seen
+static char last_clock[64]; // Of the latest batch
+
+// Cross off the wanted path if it is in the batch
+static void on_batch(ggyl_watcher *watcher, const ggyl_batch *batch,
+                     void *arg) {
+    (void)watcher;
+    (void)arg;
+    snprintf(last_clock, sizeof(last_clock), "%s", batch->clock_str);
+    for (size_t i = 0; i < batch->count; i++) {
+        if (strcmp(batch->changes[i].path, want) == 0) {
+            want[0] = '\0';
+        }
+    }
+}
+
+// Milliseconds since start
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Connect to the control socket and send a request line
+// Returns the socket, -1 if it can't connect
+static int send_request(const char *request) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        write(fd, request, strlen(request)) != (ssize_t)strlen(request)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Poll the watcher while reading the whole reply of a client, the watcher
+// and the client share this thread
+// The start of the reply is kept in text unless it is NULL.
+// Returns the number of lines of the reply, -1 if it didn't end in WAIT_MS
+static long read_reply(ggyl_watcher *watcher, int fd, char *text,
+                       size_t size) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long lines = 0;
+    size_t len = 0;
+    char buf[4096];
+    while (elapsed_ms(&start) <= WAIT_MS) {
+        if (ggyl_poll(watcher, 10) < 0) {
+            return -1;
+        }
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            for (ssize_t i = 0; i < n; i++) {
+                lines += buf[i] == '\n';
+                if (text != NULL && len < size - 1) {
+                    text[len++] = buf[i];
+                }
+            }
+            if (text != NULL) {
+                text[len] = '\0';
+            }
+        }
+        if (n == 0) {
+            return lines;
+        }
+    }
+    return -1;
+}
+
+// Poll until the wanted path was seen
+// Returns 0 once it was, -1 if it wasn't within WAIT_MS
+static int wait_for_wanted(ggyl_watcher *watcher) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (want[0] != '\0') {
+        if (ggyl_poll(watcher, 10) < 0 || elapsed_ms(&start) > WAIT_MS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write a file
+static void write_file(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        write(fd, "x", 1);
+        close(fd);
+    }
+}
+
+// Remove a file or directory of the tree
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// A client that never reads its reply holds up neither batches nor other
+// clients
+// Returns the number of failures
+static int test_stalled_client(ggyl_watcher *watcher) {
+    int failures = 0;
+    int stalled = send_request("query **\n");
+    if (stalled < 0) {
+        perror(socket_path);
+        return 1;
+    }
+
+    // Answer the request, the reply fills the socket buffer
+    for (int i = 0; i < 10; i++) {
+        ggyl_poll(watcher, 10);
+    }
+
+    snprintf(want, sizeof(want), "%s/d0/written.c", root);
+    write_file(want);
+    if (wait_for_wanted(watcher) != 0) {
+        printf("A client that doesn't read held up the batch of %s\n", want);
+        failures++;
+    }
+
+    int other = send_request("metrics\n");
+    if (other < 0 || read_reply(watcher, other, NULL, 0) <= 0) {
+        printf("A client that doesn't read held up another client\n");
+        failures++;
+    }
+    if (other >= 0) {
+        close(other);
+    }
+
+    // Every file and directory comes out once the client reads
+    long lines = read_reply(watcher, stalled, NULL, 0);
+    if (lines < FILES) {
+        printf("The stalled client got %ld lines of at least %d\n", lines,
+               FILES);
+        failures++;
+    }
+    close(stalled);
+    return failures;
+}
+
+// Ask for the changes since a clock
+// Returns the reply, or an empty string if there was none
+static const char *changes_since(ggyl_watcher *watcher, const char *since) {
+    static char reply[4096];
+    char request[128];
+    snprintf(request, sizeof(request), "since %s\n", since);
+    reply[0] = '\0';
+    int fd = send_request(request);
+    if (fd >= 0) {
+        read_reply(watcher, fd, reply, sizeof(reply));
+        close(fd);
+    }
+    return reply;
+}
+
+// Check if a reply has a line
+static int has_line(const char *reply, const char *line) {
+    size_t len = strlen(line);
+    for (const char *p = reply; (p = strstr(p, line)) != NULL; p++) {
+        if ((p == reply || p[-1] == '\n') && p[len] == '\n') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Changes since a clock still in the journal come out as their net change,
+// and once the journal has moved past the clock the client has to resync
+// Returns the number of failures
+static int test_journal(ggyl_watcher *watcher) {
+    int failures = 0;
+    char since[64], path[MAX_LEN], created[MAX_LEN], line[MAX_LEN + 16];
+    strcpy(since, last_clock);
+
+    // A file created and deleted again since is left out
+    snprintf(path, sizeof(path), "%s/d1/gone.c", root);
+    write_file(path);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/d1/a_file_with_a_long_name_00001.c",
+             root);
+    write_file(path);
+    snprintf(created, sizeof(created), "%s/d1/new.c", root);
+    strcpy(want, created);
+    write_file(created);
+    if (wait_for_wanted(watcher) != 0) {
+        printf("%s never came\n", created);
+        return 1;
+    }
+
+    const char *reply = changes_since(watcher, since);
+    snprintf(line, sizeof(line), "created %s", created);
+    if (strncmp(reply, "clock ", 6) != 0 || !has_line(reply, line)) {
+        printf("Since %s misses \"%s\":\n%s", since, line, reply);
+        failures++;
+    }
+    snprintf(line, sizeof(line), "modified %s", path);
+    if (!has_line(reply, line)) {
+        printf("Since %s misses \"%s\":\n%s", since, line, reply);
+        failures++;
+    }
+    if (strstr(reply, "gone.c") != NULL) {
+        printf("Since %s has a file created and deleted again:\n%s", since,
+               reply);
+        failures++;
+    }
+
+    // Twice as many changes as the journal holds compact the clock away
+    for (int i = 0; i < JOURNAL * 2; i++) {
+        snprintf(want, sizeof(want), "%s/d2/flood_%d.c", root, i);
+        write_file(want);
+    }
+    if (wait_for_wanted(watcher) != 0) {
+        printf("The flood never came\n");
+        return failures + 1;
+    }
+    reply = changes_since(watcher, since);
+    if (strncmp(reply, "resync ", 7) != 0 || strchr(reply, '\n') == NULL ||
+        strchr(reply, '\n')[1] != '\0') {
+        printf("Since a compacted clock %s didn't resync:\n%s", since, reply);
+        failures++;
+    }
+    return failures;
+}
+
+int main() {
+    alarm(ALARM_S);
+    snprintf(root, sizeof(root), "/tmp/ggyl_test_socket_%d", (int)getpid());
+    snprintf(socket_path, sizeof(socket_path), "/tmp/ggyl_test_socket_%d.sock",
+             (int)getpid());
+    char path[MAX_LEN];
+    mkdir(root, 0755);
+    for (int i = 0; i < DIRS; i++) {
+        snprintf(path, sizeof(path), "%s/d%d", root, i);
+        mkdir(path, 0755);
+    }
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "%s/d%d/a_file_with_a_long_name_%05d.c",
+                 root, i % DIRS, i);
+        write_file(path);
+    }
+
+    ggyl_options options;
+    ggyl_options_init(&options);
+    options.dir = root;
+    options.debounce_ms = 1;
+    options.socket_path = socket_path;
+    options.journal_size = JOURNAL;
+    ggyl_watcher *watcher = ggyl_new(&options, on_batch, NULL);
+    int failures = 1;
+    if (watcher == NULL || ggyl_start(watcher) != 0) {
+        perror(root);
+    } else {
+        failures = test_stalled_client(watcher) + test_journal(watcher);
+    }
+    ggyl_free(watcher);
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("Socket tests: %d failures\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}